@@ -5,6 +5,8 @@
 #include <xul/os/file_system.hpp>
 #include <xul/util/simple_program_options.hpp>
 #include <xul/util/test_case.hpp>
+#include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 
 
@@ -23,7 +25,21 @@ int main(int argc, char** argv)
         printf("invalid data dir: %s\n", config->dataDir.c_str());
         return 11;
     }
-    app->start(config.get());
+    // only this thread takes the shutdown signals, the io threads started by the app inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    if (!app->start(config.get()))
+    {
+        printf("failed to start\n");
+        return 12;
+    }
+    int sig = 0;
+    sigwait(&signals, &sig);
+    printf("stopping on signal %d\n", sig);
+    app->stop();
     app->wait();
     return 0;
 }
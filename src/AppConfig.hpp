@@ -15,8 +15,16 @@ public:
     int connectInterval;
     int tcpPortRange;
     int maxNodeCount;
+    int netThreads;
     std::string dataDir;
     int dbCache;
+    int blockCache;
+    int reorderBuffer;
+    int prune;
+    int blockCompression;
+    bool reindex;
+    bool txIndex;
+    std::string importBlocks;
     uint256 minimumChainWork;
     std::string directNode;
     bool testNet;
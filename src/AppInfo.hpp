@@ -3,6 +3,8 @@
 #include <xul/net/io_service.hpp>
 #include <xul/lang/object_ptr.hpp>
 #include <xul/lang/object.hpp>
+#include <vector>
+#include <stddef.h>
 
 
 namespace xul {
@@ -22,12 +24,15 @@ template <typename T>
 class PeerPool;
 typedef PeerPool<PeerAddress> NodePool;
 class ChainParams;
+class BufferPool;
 
 class ThreadingInfo : public xul::object
 {
 public:
     boost::intrusive_ptr<xul::io_service> iosMain;
     boost::intrusive_ptr<xul::io_service> iosDisk;
+    // socket io and message framing of the nodes, a node stays on one of them for its lifetime
+    std::vector<boost::intrusive_ptr<xul::io_service> > iosNet;
 };
 
 class AppInfo : public xul::object
@@ -36,12 +41,15 @@ public:
     boost::intrusive_ptr<ThreadingInfo> threadingInfo;
     virtual xul::io_service* getIOService() = 0;
     virtual xul::io_service* getDiskIOService() = 0;
+    virtual xul::io_service* getNetIOService(size_t index) = 0;
+    virtual size_t getNetIOServiceCount() const = 0;
     virtual HostNodeInfo* getHostNodeInfo() = 0;
     virtual MessageEncoder* getMessageEncoder() = 0;
     virtual NodePool* getNodePool() = 0;
     virtual const AppConfig* getAppConfig() const = 0;
     virtual BlockCache* getBlockCache() = 0;
     virtual const ChainParams* getChainParams() const = 0;
+    virtual BufferPool* getBufferPool() = 0;
 };
 
 
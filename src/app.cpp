@@ -8,12 +8,16 @@
 #include "net/NodeAddress.hpp"
 #include "version.hpp"
 #include "flags.hpp"
+#include "db.hpp"
 #include "storage/BlockCache.hpp"
 #include "storage/BlockStorage.hpp"
+#include "storage/BlockImporter.hpp"
+#include "storage/TxIndex.hpp"
 #include "data/Block.hpp"
 #include "script/Script.hpp"
 #include "data/MerkleTree.hpp"
 #include "storage/ChainParams.hpp"
+#include "util/BufferPool.hpp"
 
 #include <xul/io/data_input_stream.hpp>
 #include <xul/io/data_output_stream.hpp>
@@ -31,6 +35,10 @@
 #include <xul/util/data_parser.hpp>
 #include <xul/util/options_wrapper.hpp>
 #include <xul/util/timer_holder.hpp>
+#include <xul/net/io_services.hpp>
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <time.h>
 
 namespace xbtc {
@@ -47,6 +55,7 @@ public:
     boost::intrusive_ptr<NodePool> nodePool;
     boost::intrusive_ptr<BlockCache> blockCache;
     boost::intrusive_ptr<const ChainParams> chainParams;
+    boost::intrusive_ptr<BufferPool> bufferPool;
 
     AppInfoImpl()
     {
@@ -55,24 +64,28 @@ public:
 
     virtual xul::io_service* getIOService() { return threadingInfo->iosMain.get(); }
     virtual xul::io_service* getDiskIOService() { return threadingInfo->iosDisk.get(); }
+    virtual xul::io_service* getNetIOService(size_t index) { return threadingInfo->iosNet[index].get(); }
+    virtual size_t getNetIOServiceCount() const { return threadingInfo->iosNet.size(); }
     virtual HostNodeInfo* getHostNodeInfo() { return hostNodeInfo.get(); }
     virtual MessageEncoder* getMessageEncoder() { return messageEncoder.get(); }
     virtual NodePool* getNodePool() { return nodePool.get(); }
     virtual const AppConfig* getAppConfig() const { return appConfig.get(); }
     virtual BlockCache* getBlockCache() { return blockCache.get(); }
     virtual const ChainParams* getChainParams() const { return chainParams.get(); }
+    virtual BufferPool* getBufferPool() { return bufferPool.get(); }
 };
 
 class BitCoinAppImpl : public xul::object_impl<BitCoinApp>, public xul::timer_listener
 {
 public:
-    BitCoinAppImpl()
+    BitCoinAppImpl() : m_stopping(false)
     {
         xul::log_manager::start_console_log_service("xbtc");
         xul::random::init_seed(time(nullptr));
         m_appInfo = new AppInfoImpl;
         m_appInfo->threadingInfo->iosDisk = xul::create_io_service();
         m_appInfo->threadingInfo->iosMain = xul::create_io_service();
+        m_appInfo->bufferPool = createBufferPool(64 * 1024 * 1024);
         m_appInfo->hostNodeInfo = createHostNodeInfo();
         m_appInfo->hostNodeInfo->userAgent = formatUserAgent(CLIENT_NAME, CLIENT_VERSION, std::vector<std::string>());
         m_appInfo->hostNodeInfo->nodeAddress.services = ServiceFlags::NODE_NETWORK;
@@ -88,19 +101,64 @@ public:
         m_config = config;
         m_appInfo->appConfig = config;
         m_appInfo->chainParams = config->testNet ? createTestNetChainParams() : createMainChainParams();
-        m_appInfo->messageEncoder = createMessageEncoder(m_appInfo->chainParams->protocolMagic);
+        m_appInfo->messageEncoder = createMessageEncoder(m_appInfo->chainParams->protocolMagic, m_appInfo->getBufferPool());
+        std::vector<std::string> reindexFiles;
+        if (config->reindex && !prepareBlockReindex(config, reindexFiles))
+        {
+            XUL_APP_REL_ERROR("failed to prepare reindex " << config->dataDir);
+            return false;
+        }
         BlockStorage* blockStorage = createBlockStorage(m_appInfo.get());
-        m_appInfo->blockCache = createBlockCache(config, blockStorage, m_appInfo->chainParams.get());
+        TxIndex* txIndex = config->txIndex ? createTxIndex(m_appInfo.get(), blockStorage) : nullptr;
+        m_appInfo->blockCache = createBlockCache(config, blockStorage, m_appInfo->chainParams.get(), txIndex);
+        int netThreads = std::max(1, std::min(config->netThreads, MAX_NET_THREADS));
+        for (int i = 0; i < netThreads; ++i)
+        {
+            m_appInfo->threadingInfo->iosNet.push_back(xul::create_io_service());
+        }
         // first load data from storage into cache, then start background io services
         m_appInfo->blockCache->load();
         m_appInfo->threadingInfo->iosMain->start();
         m_appInfo->threadingInfo->iosDisk->start();
-        m_nodeManager->start();
-        m_timer.start(1000);
+        for (const auto& ios : m_appInfo->threadingInfo->iosNet)
+        {
+            ios->start();
+        }
+        std::vector<std::string> importFiles = reindexFiles;
+        splitFileList(config->importBlocks, importFiles);
+        if (importFiles.empty())
+        {
+            startNetwork();
+            return true;
+        }
+        // blocks from local files go in first, the network only tops up the chain afterwards
+        m_importer = createBlockImporter(m_appInfo.get());
+        m_importer->start(importFiles, reindexFiles.size(), std::bind(&BitCoinAppImpl::startNetwork, this));
         return true;
     }
     void stop()
     {
+        // nothing may add blocks or change block indexes once the final flush is queued
+        runOnMainThread([this]() {
+            m_stopping = true;
+            m_timer.stop();
+            if (m_importer)
+            {
+                m_importer->stop();
+            }
+            m_nodeManager->stop();
+        });
+        if (m_appInfo->blockCache)
+        {
+            // the block cache belongs to the main io service, close queues its final flush there before the storage closes
+            runOnMainThread([this]() { m_appInfo->blockCache->close(); });
+        }
+        m_appInfo->threadingInfo->iosMain->stop();
+        m_appInfo->threadingInfo->iosDisk->stop();
+        for (const auto& ios : m_appInfo->threadingInfo->iosNet)
+        {
+            ios->stop();
+        }
     }
     void wait()
     {
@@ -113,12 +171,44 @@ public:
         m_nodeManager->onTick(times);
     }
 private:
+    void runOnMainThread(const std::function<void ()>& fn)
+    {
+        std::promise<void> done;
+        xul::io_services::post(m_appInfo->getIOService(), [&fn, &done]() {
+            fn();
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+    void startNetwork()
+    {
+        // the import may finish after a stop
+        if (m_stopping)
+            return;
+        m_nodeManager->start();
+        m_timer.start(1000);
+    }
+    static void splitFileList(const std::string& s, std::vector<std::string>& files)
+    {
+        size_t start = 0;
+        while (start < s.size())
+        {
+            size_t end = s.find(',', start);
+            if (end == std::string::npos)
+                end = s.size();
+            if (end > start)
+                files.push_back(s.substr(start, end - start));
+            start = end + 1;
+        }
+    }
 
 private:
     boost::intrusive_ptr<const AppConfig> m_config;
     boost::intrusive_ptr<AppInfoImpl> m_appInfo;
     boost::intrusive_ptr<NodeManager> m_nodeManager;
+    boost::intrusive_ptr<BlockImporter> m_importer;
     xul::timer_holder m_timer;
+    bool m_stopping;
 };
 
 
@@ -132,8 +222,22 @@ public:
         opts.add("tcpPort", &tcpPort, 18333);
         opts.add("maxNodeCount", &maxNodeCount, 30);
         opts.add("connectInterval", &connectInterval, 30);
+        // io threads the peer sockets are spread over, worth raising on relay nodes with many peers
+        opts.add("netThreads", &netThreads, 1);
         opts.add("dataDir", &dataDir, "");
         opts.add_binary_byte_count("dbCache", &dbCache, 450, "MB");
+        opts.add_binary_byte_count("blockCache", &blockCache, 64, "MB");
+        // memory for downloaded blocks waiting for their parent, the excess is spilled to blocks/reorder
+        opts.add_binary_byte_count("reorderBuffer", &reorderBuffer, 128, "MB");
+        opts.add_binary_byte_count("prune", &prune, 0, "MB");
+        // zlib level used for newly written blocks, 0 stores them raw
+        opts.add("blockCompression", &blockCompression, 0);
+        // rebuild the block index and chainstate from the existing block files
+        opts.add("reindex", &reindex, false);
+        // comma separated block files to import before connecting to the network
+        opts.add("importBlocks", &importBlocks, "");
+        // maintain a txid index over the block files
+        opts.add("txIndex", &txIndex, DEFAULT_TXINDEX);
         opts.add("directNode", &directNode, "");
         opts.add("testNet", &testNet, false);
         // minimumChainWork = uint256::parse("000000000000000000000000000000000000000000f91c579d57cad4bc5278cc");
@@ -1,4 +1,5 @@
 #include "Block.hpp"
+#include "BlockIndexTable.hpp"
 #include "version.hpp"
 #include "util/serialization.hpp"
 #include "util/Hasher.hpp"
@@ -6,6 +7,8 @@
 #include <xul/data/big_number_io.hpp>
 #include <xul/lang/object_impl.hpp>
 #include <xul/macro/minmax.hpp>
+#include <algorithm>
+#include <mutex>
 
 namespace xbtc {
 
@@ -58,32 +61,112 @@ Block* createBlock()
     return xul::create_object<Block>();
 }
 
-bool BlockIndex::read_object(xul::data_input_stream& is)
+size_t estimateBlockMemory(const Block* block)
 {
-    int protoVersion = CLIENT_VERSION;
-    is >> makeVarReader(protoVersion) >> makeVarReader(height) >> makeVarReader(status) >> makeVarReader(transactionCount);
-    if (status & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
-        is >> makeVarReader(fileIndex);
-    if (status & BLOCK_HAVE_DATA)
-        is >> makeVarReader(dataPosition);
-    if (status & BLOCK_HAVE_UNDO)
-        is >> makeVarReader(undoPosition);
-    is >> header;
-    return is.good();
+    size_t bytes = sizeof(Block) + block->transactions.capacity() * sizeof(Transaction);
+    for (const auto& tx : block->transactions)
+    {
+        bytes += tx.inputs.capacity() * sizeof(TransactionInput) + tx.outputs.capacity() * sizeof(TransactionOutput);
+        for (const auto& input : tx.inputs)
+        {
+            bytes += input.signatureScript.capacity();
+            for (const auto& item : input.witness.stack)
+                bytes += sizeof(item) + item.capacity();
+        }
+        for (const auto& output : tx.outputs)
+            bytes += output.scriptPublicKey.capacity();
+    }
+    return bytes;
 }
 
-void BlockIndex::write_object(xul::data_output_stream& os) const
+BlockIndexesData::BlockIndexesData() : blocks(std::make_shared<BlockIndexTable>()), changedBlocks(std::make_shared<BlockIndexTable>())
+{
+    lastBlockFile = 0;
+    pruned = false;
+    sequence = 0;
+    bestHeader = nullptr;
+}
+
+std::atomic<uint32_t> BlockIndexSlab::s_next(1);
+std::atomic<BlockIndex*> BlockIndexSlab::s_slabs[BlockIndexSlab::MAX_SLABS];
+uint32_t BlockIndexSlab::s_firstOwnedSlab = 0;
+
+static std::mutex s_blockIndexSlabMutex;
+
+BlockIndex* BlockIndexSlab::allocate()
 {
-    os << makeVarWriter(CLIENT_VERSION) << makeVarWriter(height) << makeVarWriter(status) << makeVarWriter(transactionCount);
-    if (status & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
-        os << makeVarWriter(fileIndex);
-    if (status & BLOCK_HAVE_DATA)
-        os << makeVarWriter(dataPosition);
-    if (status & BLOCK_HAVE_UNDO)
-        os << makeVarWriter(undoPosition);
-    os << header;
+    uint32_t handle = s_next.fetch_add(1, std::memory_order_relaxed);
+    assert(handle != NULL_BLOCK_INDEX_HANDLE);
+    uint32_t slabIndex = handle >> SLAB_SHIFT;
+    BlockIndex* slab = s_slabs[slabIndex].load(std::memory_order_acquire);
+    if (!slab)
+    {
+        std::lock_guard<std::mutex> lock(s_blockIndexSlabMutex);
+        slab = s_slabs[slabIndex].load(std::memory_order_relaxed);
+        if (!slab)
+        {
+            slab = new BlockIndex[SLAB_SIZE];
+            s_slabs[slabIndex].store(slab, std::memory_order_release);
+        }
+    }
+    BlockIndex* block = slab + (handle & SLAB_MASK);
+    block->handle = handle;
+    return block;
 }
 
+void BlockIndexSlab::copyEntries(std::vector<BlockIndex>& entries)
+{
+    uint32_t count = s_next.load(std::memory_order_acquire);
+    entries.clear();
+    entries.reserve(count);
+    for (uint32_t start = 0; start < count; start += SLAB_SIZE)
+    {
+        const BlockIndex* slab = s_slabs[start >> SLAB_SHIFT].load(std::memory_order_acquire);
+        uint32_t size = count - start < SLAB_SIZE ? count - start : SLAB_SIZE;
+        entries.insert(entries.end(), slab, slab + size);
+    }
+}
+
+bool BlockIndexSlab::restore(BlockIndex* entries, uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(s_blockIndexSlabMutex);
+    if (count == 0 || s_next.load(std::memory_order_relaxed) != 1 || s_slabs[0].load(std::memory_order_relaxed))
+        return false;
+    uint32_t fullSlabs = count >> SLAB_SHIFT;
+    for (uint32_t slabIndex = 0; slabIndex < fullSlabs; ++slabIndex)
+    {
+        s_slabs[slabIndex].store(entries + (slabIndex << SLAB_SHIFT), std::memory_order_release);
+    }
+    // the last slab keeps growing, so it gets memory of its own
+    uint32_t rest = count & SLAB_MASK;
+    if (rest > 0)
+    {
+        BlockIndex* slab = new BlockIndex[SLAB_SIZE];
+        std::copy(entries + (fullSlabs << SLAB_SHIFT), entries + count, slab);
+        s_slabs[fullSlabs].store(slab, std::memory_order_release);
+    }
+    s_firstOwnedSlab = fullSlabs;
+    s_next.store(count, std::memory_order_release);
+    return true;
+}
+
+#ifdef XUL_RUN_TEST
+// slabs restored in place from a snapshot are only forgotten, not unmapped
+void BlockIndexSlab::reset()
+{
+    std::lock_guard<std::mutex> lock(s_blockIndexSlabMutex);
+    uint32_t slabCount = (s_next.load(std::memory_order_relaxed) + SLAB_MASK) >> SLAB_SHIFT;
+    for (uint32_t slabIndex = 0; slabIndex < slabCount && slabIndex < MAX_SLABS; ++slabIndex)
+    {
+        BlockIndex* slab = s_slabs[slabIndex].exchange(nullptr, std::memory_order_acq_rel);
+        if (slabIndex >= s_firstOwnedSlab)
+            delete[] slab;
+    }
+    s_firstOwnedSlab = 0;
+    s_next.store(1, std::memory_order_release);
+}
+#endif
+
 inline int invertLowestOne(int n)
 {
     return n & (n - 1);
@@ -102,8 +185,9 @@ inline int getSkipHeight(int height)
 
 void BlockIndex::buildSkip()
 {
-    if (previous)
-        skip = previous->getAncestor(getSkipHeight(height));
+    BlockIndex* previous = getPrevious();
+    BlockIndex* skip = previous ? previous->getAncestor(getSkipHeight(height)) : nullptr;
+    skipHandle = skip ? skip->handle : NULL_BLOCK_INDEX_HANDLE;
 }
 
 BlockIndex* BlockIndex::getAncestor(int destHeight)
@@ -119,18 +203,18 @@ BlockIndex* BlockIndex::getAncestor(int destHeight)
     {
         int heightSkip = getSkipHeight(heightWalk);
         int heightSkipPrev = getSkipHeight(heightWalk - 1);
-        if (pindexWalk->skip &&
+        if (pindexWalk->skipHandle != NULL_BLOCK_INDEX_HANDLE &&
             (heightSkip == destHeight ||
              (heightSkip > destHeight && !(heightSkipPrev < heightSkip - 2 &&
                                        heightSkipPrev >= destHeight)))) {
             // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
-            pindexWalk = pindexWalk->skip.get();
+            pindexWalk = pindexWalk->getSkip();
             heightWalk = heightSkip;
         }
         else
         {
-            assert(pindexWalk->previous);
-            pindexWalk = pindexWalk->previous.get();
+            assert(pindexWalk->previousHandle != NULL_BLOCK_INDEX_HANDLE);
+            pindexWalk = pindexWalk->getPrevious();
             heightWalk--;
         }
     }
@@ -152,12 +236,12 @@ bool BlockIndex::raiseValidity(enum BlockStatus upTo)
 
 BlockIndex* createBlockIndex()
 {
-    return xul::create_object<BlockIndex>();
+    return BlockIndexSlab::allocate();
 }
 
 BlockIndex* createBlockIndex(const BlockHeader& h)
 {
-    auto b = xul::create_object<BlockIndex>();
+    BlockIndex* b = BlockIndexSlab::allocate();
     b->header = h;
     return b;
 }
@@ -185,6 +269,35 @@ xul::data_output_stream& operator<<(xul::data_output_stream& os, const Block& bl
 }
 
 
+xul::data_input_stream& operator>>(xul::data_input_stream& is, BlockIndex& block)
+{
+    int protoVersion = CLIENT_VERSION;
+    is >> makeVarReader(protoVersion) >> makeVarReader(block.height) >> makeVarReader(block.status) >> makeVarReader(block.transactionCount);
+    if (block.status & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
+        is >> makeVarReader(block.fileIndex);
+    if (block.status & BLOCK_HAVE_DATA)
+        is >> makeVarReader(block.dataPosition);
+    if ((block.status & BLOCK_HAVE_DATA) && (block.status & BLOCK_OPT_COMPRESSED))
+        is >> makeVarReader(block.compressedSize);
+    if (block.status & BLOCK_HAVE_UNDO)
+        is >> makeVarReader(block.undoPosition);
+    return is >> block.header;
+}
+
+xul::data_output_stream& operator<<(xul::data_output_stream& os, const BlockIndex& block)
+{
+    os << makeVarWriter(CLIENT_VERSION) << makeVarWriter(block.height) << makeVarWriter(block.status) << makeVarWriter(block.transactionCount);
+    if (block.status & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
+        os << makeVarWriter(block.fileIndex);
+    if (block.status & BLOCK_HAVE_DATA)
+        os << makeVarWriter(block.dataPosition);
+    if ((block.status & BLOCK_HAVE_DATA) && (block.status & BLOCK_OPT_COMPRESSED))
+        os << makeVarWriter(block.compressedSize);
+    if (block.status & BLOCK_HAVE_UNDO)
+        os << makeVarWriter(block.undoPosition);
+    return os << block.header;
+}
+
 xul::data_input_stream& operator>>(xul::data_input_stream& is, BlockFileInfo& info)
 {
     is >> makeVarReader(info.blocks) >> makeVarReader(info.size) >> makeVarReader(info.undoSize);
@@ -201,3 +314,100 @@ xul::data_output_stream& operator<<(xul::data_output_stream& os, const BlockFile
 
 
 }
+
+#ifdef XUL_RUN_TEST
+
+#include <xul/util/test_case.hpp>
+#include <random>
+#ifdef XBTC_RUN_BENCHMARK
+#include <xul/util/time_counter.hpp>
+#include <iostream>
+#endif
+
+namespace xbtc {
+
+class BlockIndexSkipTestCase : public xul::test_case
+{
+public:
+    virtual void run()
+    {
+        checkAncestors(5000, 10000);
+#ifdef XBTC_RUN_BENCHMARK
+        // opt in, a synthetic chain of mainnet size
+        checkAncestors(1000000, 1000000);
+#endif
+    }
+
+private:
+    void checkAncestors(int chainLength, int lookups)
+    {
+        std::vector<BlockIndex*> chain(chainLength);
+        for (int i = 0; i < chainLength; ++i)
+        {
+            chain[i] = createBlockIndex();
+            chain[i]->height = i;
+            if (i > 0)
+                chain[i]->setPrevious(chain[i - 1]);
+            chain[i]->buildSkip();
+        }
+        for (int i = 1; i < chainLength; ++i)
+        {
+            assert(chain[i]->getSkip() && chain[i]->getSkip()->height < i);
+        }
+
+        std::mt19937 rng(12345);
+        std::uniform_int_distribution<int> dist(0, chainLength - 1);
+#ifdef XBTC_RUN_BENCHMARK
+        xul::time_counter counter;
+#endif
+        for (int i = 0; i < lookups; ++i)
+        {
+            int from = dist(rng);
+            int to = std::uniform_int_distribution<int>(0, from)(rng);
+            BlockIndex* ancestor = chain[from]->getAncestor(to);
+            assert(ancestor == chain[to]);
+        }
+#ifdef XBTC_RUN_BENCHMARK
+        int64_t elapsed = counter.elapsed();
+#endif
+        // a walk over the skip pointers stays logarithmic, about 60 hops on 5000 blocks and 125 on a million, a linear
+        // one takes thousands
+        int maxHops = 0;
+        for (int i = 0; i < 1000; ++i)
+        {
+            int from = dist(rng);
+            maxHops = std::max(maxHops, countHops(chain[from], std::uniform_int_distribution<int>(0, from)(rng)));
+        }
+        assert(maxHops <= 8 * log2Ceil(chainLength));
+#ifdef XBTC_RUN_BENCHMARK
+        std::cout << "getAncestor: " << lookups << " lookups on " << chainLength << " blocks in "
+                  << elapsed << " ms, at most " << maxHops << " hops" << std::endl;
+#endif
+        BlockIndexSlab::reset();
+    }
+    // the hops of a plain greedy walk, taking the skip pointer whenever it does not overshoot
+    static int countHops(BlockIndex* block, int height)
+    {
+        int hops = 0;
+        while (block->height > height)
+        {
+            BlockIndex* skip = block->getSkip();
+            block = skip && skip->height >= height ? skip : block->getPrevious();
+            ++hops;
+        }
+        return hops;
+    }
+    static int log2Ceil(int n)
+    {
+        int bits = 0;
+        while ((1 << bits) < n)
+            ++bits;
+        return bits;
+    }
+};
+
+XUL_TEST_SUITE_REGISTRATION(BlockIndexSkipTestCase);
+
+}
+
+#endif
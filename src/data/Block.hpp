@@ -2,8 +2,9 @@
 
 #include "Transaction.hpp"
 #include "util/number.hpp"
-#include <xul/io/serializable.hpp>
+#include <xul/lang/object.hpp>
 #include <xul/lang/object_ptr.hpp>
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <map>
@@ -58,6 +59,7 @@ enum BlockStatus : uint32_t
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+    BLOCK_OPT_COMPRESSED    =   256, //!< block data in blk*.dat is compressed, see BlockIndex::compressedSize
 };
 
 
@@ -66,6 +68,8 @@ class DiskBlockPos
 public:
     int fileIndex;
     unsigned position;
+    // length of the stored record payload when the block is compressed, 0 for a raw block
+    unsigned compressedSize;
 
     DiskBlockPos()
     {
@@ -76,12 +80,14 @@ public:
     {
         fileIndex = fileIn;
         position = pos;
+        compressedSize = 0;
     }
 
     void clear()
     {
         fileIndex = -1;
         position = 0;
+        compressedSize = 0;
     }
     bool isNull() const
     {
@@ -153,7 +159,12 @@ public:
     void addBlock(unsigned height, uint64_t timestamp);
 };
 
-class BlockIndex : public xul::object, public xul::serializable
+// 32-bit slot number of a block index inside BlockIndexSlab, 0 is the null handle
+typedef uint32_t BlockIndexHandle;
+
+const BlockIndexHandle NULL_BLOCK_INDEX_HANDLE = 0;
+
+class BlockIndex
 {
 public:
     BlockHeader header;
@@ -163,22 +174,23 @@ public:
     int fileIndex;
     uint32_t dataPosition;
     uint32_t undoPosition;
+    uint32_t compressedSize;
     uint256 chainWork;
     uint32_t chainTransactionCount;
     int32_t sequenceId;
     uint32_t maxTime;
-    boost::intrusive_ptr<BlockIndex> previous;
-    boost::intrusive_ptr<BlockIndex> skip;
+    BlockIndexHandle handle;
+    BlockIndexHandle previousHandle;
+    BlockIndexHandle skipHandle;
 
     BlockIndex()
     {
+        handle = NULL_BLOCK_INDEX_HANDLE;
         doClear();
     }
     void clear()
     {
         header.clear();
-        previous.reset();
-        skip.reset();
         doClear();
     }
     void buildSkip();
@@ -188,11 +200,22 @@ public:
         assert(!header.hash.is_null());
         return header.hash;
     }
+    BlockIndex* getPrevious() const;
+    BlockIndex* getSkip() const;
+    void setPrevious(const BlockIndex* block)
+    {
+        previousHandle = block ? block->handle : NULL_BLOCK_INDEX_HANDLE;
+    }
     void setDiskPosition(const DiskBlockPos& pos)
     {
         fileIndex = pos.fileIndex;
         dataPosition = pos.position + 8;
         undoPosition = 0;
+        compressedSize = pos.compressedSize;
+        if (compressedSize > 0)
+            status |= BLOCK_OPT_COMPRESSED;
+        else
+            status &= ~BLOCK_OPT_COMPRESSED;
     }
 
     BlockIndex* getAncestor(int destHeight);
@@ -204,8 +227,6 @@ public:
             return false;
         return ((status & BLOCK_VALID_MASK) >= upTo);
     }
-    virtual bool read_object(xul::data_input_stream& is);
-    virtual void write_object(xul::data_output_stream& os) const;
 private:
     void doClear()
     {
@@ -215,12 +236,73 @@ private:
         fileIndex = 0;
         dataPosition = 0;
         undoPosition = 0;
+        compressedSize = 0;
         chainTransactionCount = 0;
         sequenceId = 0;
         maxTime = 0;
+        previousHandle = NULL_BLOCK_INDEX_HANDLE;
+        skipHandle = NULL_BLOCK_INDEX_HANDLE;
+    }
+};
+
+/**
+ * Block indexes are never freed, so they are carved out of fixed size slabs that live for the whole process.
+ * A handle packs the slab number and the slot inside it; slabs are published once and never move, so resolving
+ * a handle is two loads and needs no lock.
+ */
+class BlockIndexSlab
+{
+public:
+    static const int SLAB_SHIFT = 14;
+    static const uint32_t SLAB_SIZE = 1u << SLAB_SHIFT;
+    static const uint32_t SLAB_MASK = SLAB_SIZE - 1;
+    static const uint32_t MAX_SLABS = 1u << (32 - SLAB_SHIFT);
+
+    // thread safe, the block indexes are loaded from several threads at startup
+    static BlockIndex* allocate();
+    static BlockIndex* get(BlockIndexHandle handle)
+    {
+        if (handle == NULL_BLOCK_INDEX_HANDLE)
+            return nullptr;
+        BlockIndex* slab = s_slabs[handle >> SLAB_SHIFT].load(std::memory_order_acquire);
+        assert(slab);
+        return slab + (handle & SLAB_MASK);
     }
+    static size_t getCount()
+    {
+        return s_next.load(std::memory_order_relaxed) - 1;
+    }
+    // copies every slot up to the last allocated one, slot 0 included, for the block index snapshot
+    static void copyEntries(std::vector<BlockIndex>& entries);
+    /**
+     * Installs the entries of a block index snapshot, only possible before anything was allocated.
+     * Complete slabs are used in place, so the entries must stay valid for the rest of the process.
+     */
+    static bool restore(BlockIndex* entries, uint32_t count);
+
+private:
+#ifdef XUL_RUN_TEST
+    friend class BlockIndexSkipTestCase;
+    // frees every slab and starts over from the first handle, no block index or handle may be used afterwards
+    static void reset();
+#endif
+
+    static std::atomic<uint32_t> s_next;
+    static std::atomic<BlockIndex*> s_slabs[MAX_SLABS];
+    // the slabs below it are used in place from a snapshot and not owned
+    static uint32_t s_firstOwnedSlab;
 };
 
+inline BlockIndex* BlockIndex::getPrevious() const
+{
+    return BlockIndexSlab::get(previousHandle);
+}
+
+inline BlockIndex* BlockIndex::getSkip() const
+{
+    return BlockIndexSlab::get(skipHandle);
+}
+
 class Block : public xul::object
 {
 public:
@@ -233,32 +315,46 @@ public:
 
 typedef boost::intrusive_ptr<Block> BlockPtr;
 
-typedef boost::intrusive_ptr<BlockIndex> BlockIndexPtr;
-typedef std::unordered_map<uint256, BlockIndexPtr> BlockIndexMap;
-typedef std::shared_ptr<BlockIndexMap> BlockIndexMapPtr;
+typedef std::unordered_map<uint256, BlockIndex*> BlockIndexMap;
+
+class BlockIndexTable;
+typedef std::shared_ptr<BlockIndexTable> BlockIndexTablePtr;
+
+class BlockIndexSnapshot;
 
 class BlockIndexesData
 {
 public:
-    BlockIndexMapPtr blocks;
-    // std::vector<BlockIndexPtr> blocks;
+    // new block indexes, stored in full
+    BlockIndexTablePtr blocks;
+    // existing block indexes whose status or disk position changed, the block index journal stores them without the header
+    BlockIndexTablePtr changedBlocks;
     std::vector<BlockFileInfo> files;
     int lastBlockFile;
-
-    BlockIndexesData() : blocks(std::make_shared<BlockIndexMap>())
-    {
-        lastBlockFile = 0;
-    }
+    bool pruned;
+    // number of the flush, stored with the block indexes so a snapshot can tell whether it is current
+    uint64_t sequence;
+    // written after the block indexes when set
+    std::shared_ptr<BlockIndexSnapshot> snapshot;
+    // set on load when the indexes were restored from a snapshot, they are then already checked and linked
+    BlockIndex* bestHeader;
+
+    BlockIndexesData();
 };
 
 
 Block* createBlock();
+// rough heap footprint of a decoded block, for the caches and buffers that hold blocks within a byte budget
+size_t estimateBlockMemory(const Block* block);
 BlockIndex* createBlockIndex();
 BlockIndex* createBlockIndex(const BlockHeader& h);
 
 xul::data_input_stream& operator>>(xul::data_input_stream& is, BlockHeader& header);
 xul::data_output_stream& operator<<(xul::data_output_stream& os, const BlockHeader& header);
 
+xul::data_input_stream& operator>>(xul::data_input_stream& is, BlockIndex& block);
+xul::data_output_stream& operator<<(xul::data_output_stream& os, const BlockIndex& block);
+
 xul::data_input_stream& operator>>(xul::data_input_stream& is, BlockFileInfo& info);
 xul::data_output_stream& operator<<(xul::data_output_stream& os, const BlockFileInfo& info);
 
@@ -0,0 +1,222 @@
+#include "BlockIndexTable.hpp"
+
+#include <string.h>
+
+namespace xbtc {
+
+
+const size_t BLOCK_INDEX_TABLE_MIN_CAPACITY = 16;
+
+BlockIndexTable::SlotArray::SlotArray(size_t capacity) : mask(capacity - 1), shift(64), slots(new std::atomic<uint64_t>[capacity])
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    while ((size_t(1) << (64 - shift)) < capacity)
+        --shift;
+    assert(shift >= 32);
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        slots[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+BlockIndexTable::BlockIndexTable() : m_slots(nullptr), m_count(0)
+{
+}
+
+BlockIndexTable::BlockIndexTable(const BlockIndexTable& other) : m_slots(nullptr), m_count(0)
+{
+    *this = other;
+}
+
+BlockIndexTable& BlockIndexTable::operator=(const BlockIndexTable& other)
+{
+    if (this == &other)
+        return *this;
+    std::vector<uint64_t> slots;
+    other.copySlots(slots);
+    clear();
+    if (!slots.empty())
+    {
+        rehash(slots.size());
+        SlotArray* array = m_slots.load(std::memory_order_relaxed);
+        size_t count = 0;
+        for (size_t i = 0; i < slots.size(); ++i)
+        {
+            array->slots[i].store(slots[i], std::memory_order_relaxed);
+            if (getHandle(slots[i]) != NULL_BLOCK_INDEX_HANDLE)
+                ++count;
+        }
+        m_count.store(count, std::memory_order_relaxed);
+    }
+    return *this;
+}
+
+BlockIndexTable::~BlockIndexTable()
+{
+    freeSlots();
+}
+
+void BlockIndexTable::freeSlots()
+{
+    delete m_slots.load(std::memory_order_relaxed);
+    m_slots.store(nullptr, std::memory_order_relaxed);
+    for (SlotArray* slots : m_retiredSlots)
+    {
+        delete slots;
+    }
+    m_retiredSlots.clear();
+}
+
+void BlockIndexTable::clear()
+{
+    freeSlots();
+    m_count.store(0, std::memory_order_relaxed);
+}
+
+void BlockIndexTable::reserve(size_t count)
+{
+    // keep the load factor at or below 3/4
+    size_t capacity = BLOCK_INDEX_TABLE_MIN_CAPACITY;
+    while (capacity * 3 < count * 4)
+        capacity *= 2;
+    const SlotArray* slots = m_slots.load(std::memory_order_relaxed);
+    if (!slots || capacity > slots->capacity())
+        rehash(capacity);
+}
+
+uint64_t BlockIndexTable::hashKey(const uint256& hash)
+{
+    // block hashes are uniform apart from the zero bytes of the proof of work, fold all words and mix
+    uint64_t words[4];
+    assert(hash.size() == sizeof(words));
+    memcpy(words, hash.data(), sizeof(words));
+    uint64_t key = words[0] ^ words[1] ^ words[2] ^ words[3];
+    return key * 0x9E3779B97F4A7C15ULL;
+}
+
+size_t BlockIndexTable::findSlot(const SlotArray& slots, const uint256& hash, uint64_t key)
+{
+    uint32_t tag = static_cast<uint32_t>(key >> 32);
+    for (size_t pos = getHomeSlot(slots, tag); ; pos = (pos + 1) & slots.mask)
+    {
+        uint64_t slot = slots.slots[pos].load(std::memory_order_acquire);
+        if (getHandle(slot) == NULL_BLOCK_INDEX_HANDLE)
+            return pos;
+        if (getTag(slot) == tag && BlockIndexSlab::get(getHandle(slot))->getHash() == hash)
+            return pos;
+    }
+}
+
+BlockIndex* BlockIndexTable::find(const uint256& hash) const
+{
+    const SlotArray* slots = m_slots.load(std::memory_order_acquire);
+    if (!slots)
+        return nullptr;
+    uint64_t slot = slots->slots[findSlot(*slots, hash, hashKey(hash))].load(std::memory_order_acquire);
+    return BlockIndexSlab::get(getHandle(slot));
+}
+
+bool BlockIndexTable::insert(BlockIndex* block)
+{
+    assert(block && block->handle != NULL_BLOCK_INDEX_HANDLE);
+    size_t count = m_count.load(std::memory_order_relaxed);
+    const SlotArray* current = m_slots.load(std::memory_order_relaxed);
+    if (!current)
+        rehash(BLOCK_INDEX_TABLE_MIN_CAPACITY);
+    else if ((count + 1) * 4 > current->capacity() * 3)
+        rehash(current->capacity() * 2);
+    SlotArray* slots = m_slots.load(std::memory_order_relaxed);
+    uint64_t key = hashKey(block->getHash());
+    std::atomic<uint64_t>& slot = slots->slots[findSlot(*slots, block->getHash(), key)];
+    if (getHandle(slot.load(std::memory_order_relaxed)) != NULL_BLOCK_INDEX_HANDLE)
+        return false;
+    // a reader that sees the handle also sees the complete block index behind it
+    slot.store(makeSlot(static_cast<uint32_t>(key >> 32), block->handle), std::memory_order_release);
+    m_count.store(count + 1, std::memory_order_relaxed);
+    return true;
+}
+
+bool BlockIndexTable::erase(const uint256& hash)
+{
+    SlotArray* slots = m_slots.load(std::memory_order_relaxed);
+    if (!slots || empty())
+        return false;
+    size_t hole = findSlot(*slots, hash, hashKey(hash));
+    if (getHandle(slots->slots[hole].load(std::memory_order_relaxed)) == NULL_BLOCK_INDEX_HANDLE)
+        return false;
+    // shift the following entries of the probe run back, an entry may move into the hole only if the hole
+    // lies between its home slot and its current slot
+    for (size_t pos = (hole + 1) & slots->mask; ; pos = (pos + 1) & slots->mask)
+    {
+        uint64_t slot = slots->slots[pos].load(std::memory_order_relaxed);
+        if (getHandle(slot) == NULL_BLOCK_INDEX_HANDLE)
+            break;
+        size_t home = getHomeSlot(*slots, getTag(slot));
+        if (((pos - home) & slots->mask) >= ((pos - hole) & slots->mask))
+        {
+            slots->slots[hole].store(slot, std::memory_order_relaxed);
+            hole = pos;
+        }
+    }
+    slots->slots[hole].store(0, std::memory_order_relaxed);
+    m_count.store(size() - 1, std::memory_order_relaxed);
+    return true;
+}
+
+void BlockIndexTable::copySlots(std::vector<uint64_t>& slots) const
+{
+    const SlotArray* array = m_slots.load(std::memory_order_acquire);
+    slots.resize(array ? array->capacity() : 0);
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        slots[i] = array->slots[i].load(std::memory_order_acquire);
+    }
+}
+
+bool BlockIndexTable::restoreSlots(const uint64_t* slots, size_t capacity, size_t count)
+{
+    if (capacity < BLOCK_INDEX_TABLE_MIN_CAPACITY || (capacity & (capacity - 1)) != 0 || count * 4 > capacity * 3)
+        return false;
+    clear();
+    rehash(capacity);
+    SlotArray* array = m_slots.load(std::memory_order_relaxed);
+    size_t used = 0;
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        array->slots[i].store(slots[i], std::memory_order_relaxed);
+        if (getHandle(slots[i]) != NULL_BLOCK_INDEX_HANDLE)
+            ++used;
+    }
+    if (used != count)
+    {
+        clear();
+        return false;
+    }
+    m_count.store(count, std::memory_order_relaxed);
+    return true;
+}
+
+void BlockIndexTable::rehash(size_t capacity)
+{
+    SlotArray* slots = new SlotArray(capacity);
+    SlotArray* oldSlots = m_slots.load(std::memory_order_relaxed);
+    // the home slot is part of the tag, so growing never has to look at the block indexes
+    if (oldSlots)
+    {
+        for (size_t i = 0; i < oldSlots->capacity(); ++i)
+        {
+            uint64_t slot = oldSlots->slots[i].load(std::memory_order_relaxed);
+            if (getHandle(slot) == NULL_BLOCK_INDEX_HANDLE)
+                continue;
+            size_t pos = getHomeSlot(*slots, getTag(slot));
+            while (getHandle(slots->slots[pos].load(std::memory_order_relaxed)) != NULL_BLOCK_INDEX_HANDLE)
+                pos = (pos + 1) & slots->mask;
+            slots->slots[pos].store(slot, std::memory_order_relaxed);
+        }
+        m_retiredSlots.push_back(oldSlots);
+    }
+    m_slots.store(slots, std::memory_order_release);
+}
+
+
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Block.hpp"
+#include "util/number.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+namespace xbtc {
+
+
+/**
+ * Open addressing table from block hash to BlockIndexSlab handle.
+ * A slot is 8 bytes, a tag taken from the hash and the handle, so a lookup touches the block index only
+ * when the tag matches. Linear probing with backward shift deletion, no tombstones.
+ *
+ * One writer and any number of readers on other threads: find and iteration never lock. A slot is published
+ * with a single release store after its block index is complete, and a grown slot array replaces the old one
+ * with a release store too. Replaced arrays are retired, not freed, until clear or destruction, since a reader
+ * may still be probing them; they add up to less than the live array. erase, clear, reserve after load and
+ * the snapshot restore are writer only and must not run while other threads read.
+ */
+class BlockIndexTable
+{
+private:
+    class SlotArray
+    {
+    public:
+        size_t mask;
+        int shift;
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+
+        explicit SlotArray(size_t capacity);
+        size_t capacity() const { return mask + 1; }
+    };
+
+public:
+    class const_iterator
+    {
+    public:
+        const_iterator(const SlotArray* slots, size_t pos) : m_slots(slots), m_pos(pos)
+        {
+            skipEmpty();
+        }
+        BlockIndex* operator*() const
+        {
+            return BlockIndexSlab::get(getHandle(m_slots->slots[m_pos].load(std::memory_order_acquire)));
+        }
+        const_iterator& operator++()
+        {
+            ++m_pos;
+            skipEmpty();
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const { return m_pos == other.m_pos; }
+        bool operator!=(const const_iterator& other) const { return m_pos != other.m_pos; }
+
+    private:
+        void skipEmpty()
+        {
+            if (!m_slots)
+                return;
+            while (m_pos < m_slots->capacity() && getHandle(m_slots->slots[m_pos].load(std::memory_order_acquire)) == NULL_BLOCK_INDEX_HANDLE)
+                ++m_pos;
+        }
+
+    private:
+        const SlotArray* m_slots;
+        size_t m_pos;
+    };
+
+    BlockIndexTable();
+    BlockIndexTable(const BlockIndexTable& other);
+    BlockIndexTable& operator=(const BlockIndexTable& other);
+    ~BlockIndexTable();
+
+    size_t size() const { return m_count.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+    void clear();
+    void reserve(size_t count);
+
+    BlockIndex* find(const uint256& hash) const;
+    // keyed by the hash of the block, returns false if a block with the same hash is already there
+    bool insert(BlockIndex* block);
+    bool erase(const uint256& hash);
+
+    // the raw slots, 8 bytes each, for the block index snapshot
+    void copySlots(std::vector<uint64_t>& slots) const;
+    bool restoreSlots(const uint64_t* slots, size_t capacity, size_t count);
+
+    // iterates the slot array current at the call, entries inserted later may or may not be visited
+    const_iterator begin() const
+    {
+        const SlotArray* slots = m_slots.load(std::memory_order_acquire);
+        return const_iterator(slots, 0);
+    }
+    const_iterator end() const
+    {
+        const SlotArray* slots = m_slots.load(std::memory_order_acquire);
+        return const_iterator(slots, slots ? slots->capacity() : 0);
+    }
+
+private:
+    // a slot is the tag in the low and the handle in the high half, the layout of the snapshot file
+    static uint64_t makeSlot(uint32_t tag, BlockIndexHandle handle)
+    {
+        return (static_cast<uint64_t>(handle) << 32) | tag;
+    }
+    static uint32_t getTag(uint64_t slot)
+    {
+        return static_cast<uint32_t>(slot);
+    }
+    static BlockIndexHandle getHandle(uint64_t slot)
+    {
+        return static_cast<BlockIndexHandle>(slot >> 32);
+    }
+    static uint64_t hashKey(const uint256& hash);
+    // the home slot is taken from the top bits of the key, which are also the top bits of the tag
+    static size_t getHomeSlot(const SlotArray& slots, uint32_t tag)
+    {
+        return static_cast<size_t>((static_cast<uint64_t>(tag) << 32) >> slots.shift);
+    }
+    static size_t findSlot(const SlotArray& slots, const uint256& hash, uint64_t key);
+    void rehash(size_t capacity);
+    void freeSlots();
+
+private:
+    std::atomic<SlotArray*> m_slots;
+    // arrays replaced by rehash, readers that loaded them before may still be probing
+    std::vector<SlotArray*> m_retiredSlots;
+    std::atomic<size_t> m_count;
+};
+
+
+}
@@ -7,7 +7,7 @@ namespace xbtc {
 // const std::string DB_COIN = "C";
 const std::string DB_COINS = "c";
 // const std::string DB_BLOCK_FILES = "f";
-const std::string DB_TXINDEX = "t";
+// const std::string DB_TXINDEX = "t";
 // const std::string DB_BLOCK_INDEX = "b";
 
 const std::string DB_BEST_BLOCK = "B";
@@ -15,6 +15,8 @@ const std::string DB_HEAD_BLOCKS = "H";
 const std::string DB_FLAG = "F";
 const std::string DB_REINDEX_FLAG = "R";
 const std::string DB_LAST_BLOCK = "l";
+const std::string DB_PRUNED_FLAG = "p";
+const std::string DB_FLUSH_SEQUENCE = "S";
 
 
 }
@@ -11,7 +11,8 @@ const char DB_COIN = 'C';
 extern const std::string DB_COINS;
 // extern const std::string DB_BLOCK_FILES;
 const char DB_BLOCK_FILES = 'f';
-extern const std::string DB_TXINDEX;
+// extern const std::string DB_TXINDEX;
+const char DB_TXINDEX = 't';
 const char DB_BLOCK_INDEX = 'b';
 
 extern const std::string DB_BEST_BLOCK;
@@ -19,6 +20,8 @@ extern const std::string DB_HEAD_BLOCKS;
 extern const std::string DB_FLAG;
 extern const std::string DB_REINDEX_FLAG;
 extern const std::string DB_LAST_BLOCK;
+extern const std::string DB_PRUNED_FLAG;
+extern const std::string DB_FLUSH_SEQUENCE;
 
 const unsigned int OBFUSCATE_KEY_NUM_BYTES = 8;
 
@@ -52,10 +55,65 @@ static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
 static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
+/** Maximum size of a serialized block, witness data included */
+static const unsigned int MAX_BLOCK_SERIALIZED_SIZE = 4000000;
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Number of blocks below the tip whose block files are never pruned */
+static const int MIN_BLOCKS_TO_KEEP = 288;
+/** Minimum disk usage target for block files when pruning is enabled */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
+/** Number of blocks below the tip that are never evicted from the decoded block cache */
+static const int BLOCK_CACHE_TIP_BLOCKS = 16;
+/** Set in the size field of a block record header when the payload is a compressed block preceded by its raw size */
+static const uint32_t BLOCK_COMPRESSED_FLAG = 0x80000000;
+/** Size of the buffers block file appends are gathered in before an asynchronous write is issued */
+static const size_t BLOCK_WRITE_STAGING_SIZE = 0x100000; // 1 MiB
+/** Maximum number of asynchronous block file writes in flight */
+static const int BLOCK_WRITE_QUEUE_DEPTH = 16;
+/** Blocks of a batched read starting at most this far apart in a file are fetched in one sequential read */
+static const unsigned int BLOCK_READ_COALESCE_SPAN = 0x400000; // 4 MiB
+/** Maximum number of blk?????.dat files kept memory-mapped for reading */
+static const int MAX_MAPPED_BLOCKFILES = 64;
+/** Number of written blocks synced to disk together before they are reported as written */
+static const unsigned int BLOCK_WRITE_GROUP_SIZE = 16;
+/** Maximum time in milliseconds a written block waits for its group to be synced */
+static const unsigned int BLOCK_WRITE_GROUP_INTERVAL = 500;
+
+/** Number of blocks indexed per slice of the txindex backfill */
+static const int TXINDEX_BACKFILL_BATCH_SIZE = 100;
+/** Headers batches at least this large are hashed and checked on several threads */
+static const size_t MIN_PARALLEL_HEADER_BATCH = 256;
+/** Maximum number of threads hashing and checking a headers batch */
+static const int MAX_HEADER_BATCH_THREADS = 4;
+/** Maximum number of threads loading and checking block indexes at startup */
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
+/** Minimum time in milliseconds between block index snapshots taken at flushes, shutdown always takes one */
+static const unsigned int BLOCK_INDEX_SNAPSHOT_INTERVAL = 30 * 60 * 1000;
+/** Size in bytes of the block index journal at which a flush compacts it into the block index database */
+static const uint64_t BLOCK_INDEX_JOURNAL_COMPACT_SIZE = 32 * 1024 * 1024;
+/** Maximum number of blocks read ahead of validation during reindex or import */
+static const int MAX_IMPORT_BLOCKS_IN_FLIGHT = 256;
+/** Maximum estimated memory in bytes of imported blocks waiting for their parent, the file reader pauses beyond it */
+static const size_t MAX_IMPORT_ORPHAN_BYTES = 256 * 1024 * 1024;
+/** Maximum number of block decoding threads used during reindex or import */
+static const int MAX_IMPORT_THREADS = 8;
+/** Maximum number of threads decoding block messages received from peers */
+static const int MAX_BLOCK_DECODE_THREADS = 4;
+/** Maximum number of received block messages waiting for or under decoding, all peers together */
+static const int MAX_BLOCK_DECODE_QUEUE = 32;
+/** Maximum number of block messages of one peer waiting for decoding before its socket stops reading */
+static const int MAX_DECODING_BLOCKS_PER_PEER = 4;
+/** Maximum number of spilled blocks the reorder buffer reads back ahead of need at a time, outside MAX_BLOCK_DECODE_QUEUE */
+static const int MAX_REORDER_RELOADS = 8;
+/** Maximum estimated bytes of blocks the reorder buffer keeps in spill files, the furthest parked blocks are dropped beyond it */
+static const size_t MAX_REORDER_SPILL_BYTES = 1024 * 1024 * 1024;
+/** Maximum number of messages of one peer handed to the main thread and not yet handled before its socket stops reading */
+static const int MAX_QUEUED_MESSAGES_PER_PEER = 64;
+/** Maximum number of network io threads */
+static const int MAX_NET_THREADS = 16;
 
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
@@ -68,6 +126,14 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Maximum number of header segments between checkpoints fetched at the same time, each from its own peer */
+static const int MAX_HEADER_SEGMENTS_IN_FLIGHT = 8;
+/** Time in milliseconds a peer has to answer a getheaders for a header segment before the segment moves on */
+static const unsigned int HEADER_SEGMENT_TIMEOUT = 10000;
+/** Time in milliseconds without header segment progress after which parallel header sync falls back to one peer */
+static const unsigned int HEADER_SEGMENT_STALL_TIMEOUT = 60000;
+/** Number of times a header segment may end off its checkpoint before the checkpoints are taken as wrong */
+static const int MAX_HEADER_SEGMENT_MISMATCHES = 2;
 /** Maximum depth of blocks we're willing to serve as compact blocks to peers
  *  when requested. For older blocks, a regular BLOCK response will be sent. */
 static const int MAX_CMPCTBLOCK_DEPTH = 5;
@@ -102,6 +168,12 @@ static const unsigned int MAX_FEEFILTER_CHANGE_DELAY = 5 * 60;
 static const int64_t BLOCK_DOWNLOAD_TIMEOUT_BASE = 1000000;
 /** Additional block download timeout per parallel downloading peer (i.e. 5 min) */
 static const int64_t BLOCK_DOWNLOAD_TIMEOUT_PER_PEER = 500000;
+/** Expected time between blocks in seconds, the unit of the block download timeouts */
+static const int64_t BLOCK_DOWNLOAD_TARGET_SPACING = 10 * 60;
+/** Minimum time in milliseconds between refilling the block download pipelines of all peers on block arrival */
+static const unsigned int BLOCK_DOWNLOAD_SCHEDULE_INTERVAL = 100;
+/** Minimum time in milliseconds between two getheaders asking a peer how far its chain goes */
+static const unsigned int BLOCK_AVAILABILITY_PROBE_INTERVAL = 10000;
 
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 /** Maximum age of our tip in seconds for us to be considered current for fee estimation */
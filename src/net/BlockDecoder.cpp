@@ -0,0 +1,120 @@
+#include "BlockDecoder.hpp"
+#include "AppInfo.hpp"
+#include "storage/Validator.hpp"
+#include "storage/BlockDecodePool.hpp"
+#include "db.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+
+#include <atomic>
+#include <vector>
+
+
+namespace xbtc {
+
+
+class BlockDecoderImpl : public xul::object_impl<BlockDecoder>
+{
+public:
+    explicit BlockDecoderImpl(AppInfo* appInfo) : m_appInfo(appInfo), m_queued(0), m_failedCount(0)
+    {
+        XUL_LOGGER_INIT("BlockDecoder");
+        XUL_REL_EVENT("new");
+        m_validator = createValidator(appInfo->getAppConfig());
+        m_pool = createBlockDecodePool(appInfo);
+    }
+    ~BlockDecoderImpl()
+    {
+        XUL_REL_EVENT("delete");
+        stop();
+    }
+
+    virtual void start()
+    {
+        m_pool->start(MAX_BLOCK_DECODE_THREADS);
+    }
+    virtual void stop()
+    {
+        m_pool->stop();
+        m_waiters.clear();
+    }
+    virtual void decode(const MessagePayload& payload, const BlockDecodeCallback& callback)
+    {
+        ++m_queued;
+        addRequest(payload, callback, true);
+    }
+    virtual void decodeStored(const MessagePayload& payload, const BlockDecodeCallback& callback)
+    {
+        addRequest(payload, callback, false);
+    }
+    virtual bool isFull() const
+    {
+        return m_queued >= MAX_BLOCK_DECODE_QUEUE;
+    }
+    virtual void waitForRoom(const std::function<void ()>& callback)
+    {
+        m_waiters.push_back(callback);
+    }
+
+private:
+    // counted requests are the ones held against MAX_BLOCK_DECODE_QUEUE
+    void addRequest(const MessagePayload& payload, const BlockDecodeCallback& callback, bool counted)
+    {
+        MessagePayload retained = retainMessagePayload(payload, m_appInfo->getBufferPool());
+        // the pool is stopped before the decoder goes away, so neither closure needs a reference to it
+        m_pool->decode([this, retained]() { return decodeBlock(retained); },
+            [this, callback, counted](const BlockPtr& block) { onBlockDecoded(block, callback, counted); });
+    }
+    // worker threads
+    BlockPtr decodeBlock(const MessagePayload& payload)
+    {
+        BlockPtr block = decodeBlockData(payload.data, payload.size);
+        if (!block || !m_validator->checkBlock(block.get(), payload.size))
+            return BlockPtr();
+        return block;
+    }
+    // main io service
+    void onBlockDecoded(const BlockPtr& block, const BlockDecodeCallback& callback, bool counted)
+    {
+        if (counted)
+        {
+            assert(m_queued > 0);
+            --m_queued;
+        }
+        if (!block)
+        {
+            ++m_failedCount;
+            XUL_WARN("onBlockDecoded invalid block " << m_failedCount);
+        }
+        callback(block);
+        if (!isFull() && !m_waiters.empty())
+        {
+            std::vector<std::function<void ()> > waiters;
+            waiters.swap(m_waiters);
+            for (const auto& waiter : waiters)
+            {
+                waiter();
+            }
+        }
+    }
+
+private:
+    XUL_LOGGER_DEFINE();
+    boost::intrusive_ptr<AppInfo> m_appInfo;
+    boost::intrusive_ptr<Validator> m_validator;
+    boost::intrusive_ptr<BlockDecodePool> m_pool;
+    // requests handed to decode whose callback has not run yet, changed on the main io service only
+    std::atomic<int> m_queued;
+    int m_failedCount;
+    std::vector<std::function<void ()> > m_waiters;
+};
+
+
+BlockDecoder* createBlockDecoder(AppInfo* appInfo)
+{
+    return new BlockDecoderImpl(appInfo);
+}
+
+
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "MessageCodec.hpp"
+#include "data/Block.hpp"
+#include <xul/lang/object.hpp>
+#include <functional>
+
+
+namespace xbtc {
+
+
+class AppInfo;
+
+// runs on the main io service, a null block means the payload is not a valid block
+typedef std::function<void (const BlockPtr&)> BlockDecodeCallback;
+
+/**
+ * Parses, hashes and checks received block messages on worker threads, so the network thread only checks the
+ * message checksum. A block that fails the context free checks of Validator::checkBlock comes back as null,
+ * the others go back to the main io service, where they are ordered and queued for the disk.
+ * The queue is bounded by MAX_BLOCK_DECODE_QUEUE: decode never blocks, the nodes stop reading their sockets
+ * while isFull and resume from waitForRoom. isFull may be called on any thread, the rest on the main io service.
+ */
+class BlockDecoder : public xul::object
+{
+public:
+    virtual void start() = 0;
+    // main io service, the requests still queued or decoding are dropped and their callbacks never run
+    virtual void stop() = 0;
+    // the payload is retained, a transient one is copied into a pooled buffer
+    virtual void decode(const MessagePayload& payload, const BlockDecodeCallback& callback) = 0;
+    // for blocks read back from disk, they are not counted in the queue the nodes wait on, the caller bounds them
+    virtual void decodeStored(const MessagePayload& payload, const BlockDecodeCallback& callback) = 0;
+    virtual bool isFull() const = 0;
+    // the callback runs on the main io service once the queue has room again
+    virtual void waitForRoom(const std::function<void ()>& callback) = 0;
+};
+
+BlockDecoder* createBlockDecoder(AppInfo* appInfo);
+
+}
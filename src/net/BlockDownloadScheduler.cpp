@@ -0,0 +1,244 @@
+#include "BlockDownloadScheduler.hpp"
+#include "Node.hpp"
+#include "NodeManager.hpp"
+#include "NodeSyncInfo.hpp"
+#include "NodeInfo.hpp"
+#include "AppInfo.hpp"
+#include "AppConfig.hpp"
+#include "storage/BlockCache.hpp"
+#include "storage/BlockChain.hpp"
+#include "data/Block.hpp"
+#include "flags.hpp"
+#include "db.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+#include <xul/util/time_counter.hpp>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+
+namespace xbtc {
+
+
+class BlockDownloadSchedulerImpl : public xul::object_impl<BlockDownloadScheduler>
+{
+public:
+    typedef boost::intrusive_ptr<Node> NodePtr;
+    typedef std::map<Node*, NodePtr> NodeMap;
+
+    explicit BlockDownloadSchedulerImpl(NodeManager& nodeManager) : m_nodeManager(nodeManager)
+    {
+        XUL_LOGGER_INIT("BlockDownloadScheduler");
+        XUL_DEBUG("new");
+    }
+    virtual ~BlockDownloadSchedulerImpl()
+    {
+        XUL_DEBUG("delete");
+    }
+
+    virtual void addNode(Node* node)
+    {
+        m_nodes[node] = node;
+        schedule(node);
+    }
+    virtual void removeNode(Node* node)
+    {
+        if (m_nodes.erase(node) == 0)
+            return;
+        size_t released = releaseBlocks(node);
+        if (released > 0)
+        {
+            XUL_EVENT("removeNode release " << released << " " << *node);
+            scheduleAll();
+        }
+    }
+    virtual bool onBlockReceived(const uint256& hash, Node* node)
+    {
+        NodeSyncInfo& syncInfo = node->getSyncInfo();
+        bool requested = syncInfo.removeBlockRecord(hash);
+        auto iter = m_blocksInFlight.find(hash);
+        // a parked block keeps its mark until the reorder buffer releases it
+        if (iter != m_blocksInFlight.end() && iter->second)
+        {
+            // a block reassigned after a timeout may still come from the node first asked
+            if (iter->second != node)
+                iter->second->getSyncInfo().removeBlockRecord(hash);
+            m_blocksInFlight.erase(iter);
+        }
+        if (requested)
+        {
+            syncInfo.stalling = false;
+            syncInfo.downloadTimedOut = false;
+            syncInfo.downloadingSince.sync();
+        }
+        return requested;
+    }
+    virtual void onBlockParked(const uint256& hash)
+    {
+        m_blocksInFlight.insert(std::make_pair(hash, static_cast<Node*>(nullptr)));
+    }
+    virtual void onBlockReleased(const uint256& hash)
+    {
+        auto iter = m_blocksInFlight.find(hash);
+        if (iter != m_blocksInFlight.end() && iter->second == nullptr)
+            m_blocksInFlight.erase(iter);
+    }
+    virtual void schedule(Node* node)
+    {
+        fillPipeline(node);
+        // the window may have moved for the others too
+        if (m_lastScheduleTime.elapsed() >= BLOCK_DOWNLOAD_SCHEDULE_INTERVAL)
+            scheduleAll();
+    }
+    virtual void scheduleAll()
+    {
+        m_lastScheduleTime.sync();
+        // nodes that just timed out come last, so their old blocks go to someone else first
+        std::vector<Node*> timedOut;
+        for (const auto& item : m_nodes)
+        {
+            Node* node = item.first;
+            if (node->getSyncInfo().downloadTimedOut)
+                timedOut.push_back(node);
+            else
+                fillPipeline(node);
+        }
+        for (Node* node : timedOut)
+        {
+            fillPipeline(node);
+        }
+    }
+    virtual void onTick(int64_t times)
+    {
+        checkTimeouts();
+        scheduleAll();
+    }
+    virtual size_t getBlocksInFlight() const
+    {
+        return m_blocksInFlight.size();
+    }
+
+private:
+    void fillPipeline(Node* node)
+    {
+        NodeSyncInfo& syncInfo = node->getSyncInfo();
+        int room = MAX_BLOCKS_IN_TRANSIT_PER_PEER - static_cast<int>(syncInfo.requestingBlocks.size());
+        if (room <= 0)
+            return;
+        BlockCache* cache = m_nodeManager.getAppInfo()->getBlockCache();
+        probeBlockAvailability(node, cache);
+        std::vector<BlockIndex*> blocks;
+        Node* staller = nullptr;
+        syncInfo.findBlocksToDownload(blocks, room, cache, m_nodeManager.getAppInfo()->getAppConfig(), m_blocksInFlight, node, staller);
+        if (blocks.empty())
+        {
+            if (staller && !staller->getSyncInfo().stalling)
+            {
+                XUL_EVENT("fillPipeline stalled by " << *staller << " " << *node);
+                staller->getSyncInfo().stalling = true;
+                staller->getSyncInfo().stallingSince.sync();
+            }
+            return;
+        }
+        for (auto block : blocks)
+        {
+            m_blocksInFlight[block->getHash()] = node;
+        }
+        node->requestBlocks(blocks);
+    }
+    // a full node is asked for the headers after the parent of our best header whenever its known chain falls
+    // behind that header, at least one header comes back and tells how far the chain of the node really goes
+    void probeBlockAvailability(Node* node, BlockCache* cache)
+    {
+        const NodeInfo* nodeInfo = node->getNodeInfo();
+        if (!(nodeInfo->nodeAddress.services & ServiceFlags::NODE_NETWORK))
+            return;
+        NodeSyncInfo& syncInfo = node->getSyncInfo();
+        syncInfo.processBlockAvailability(cache);
+        BlockIndex* bestHeader = cache->getBestHeader();
+        if (syncInfo.bestKnownBlock && syncInfo.bestKnownBlock->chainWork >= bestHeader->chainWork)
+            return;
+        if (!bestHeader->getPrevious() || (syncInfo.headersProbed && syncInfo.headersProbeTime.elapsed() < BLOCK_AVAILABILITY_PROBE_INTERVAL))
+            return;
+        std::vector<uint256> hashes;
+        cache->getChain()->getLocator(hashes, bestHeader->getPrevious());
+        node->requestHeaders(std::move(hashes), uint256());
+        syncInfo.probingHeaders = true;
+        syncInfo.headersProbed = true;
+        syncInfo.headersProbeTime.sync();
+        XUL_DEBUG("probeBlockAvailability " << bestHeader->height << " " << *node);
+    }
+    size_t releaseBlocks(Node* node)
+    {
+        NodeSyncInfo& syncInfo = node->getSyncInfo();
+        size_t count = syncInfo.requestingBlocks.size();
+        for (const auto& item : syncInfo.requestingBlocks)
+        {
+            auto iter = m_blocksInFlight.find(item.first);
+            if (iter != m_blocksInFlight.end() && iter->second == node)
+                m_blocksInFlight.erase(iter);
+        }
+        syncInfo.requestingBlocks.clear();
+        syncInfo.stalling = false;
+        return count;
+    }
+    void checkTimeouts()
+    {
+        int downloading = 0;
+        for (const auto& item : m_nodes)
+        {
+            if (item.first->getSyncInfo().isRequestingBlock())
+                ++downloading;
+        }
+        // the more nodes share the download, the longer each one may take for its blocks
+        int64_t timeout = BLOCK_DOWNLOAD_TARGET_SPACING * 1000
+            * (BLOCK_DOWNLOAD_TIMEOUT_BASE + BLOCK_DOWNLOAD_TIMEOUT_PER_PEER * std::max(downloading - 1, 0)) / 1000000;
+        std::vector<Node*> stallers;
+        for (const auto& item : m_nodes)
+        {
+            Node* node = item.first;
+            NodeSyncInfo& syncInfo = node->getSyncInfo();
+            if (syncInfo.stalling && syncInfo.stallingSince.elapsed() > BLOCK_STALLING_TIMEOUT * 1000)
+            {
+                stallers.push_back(node);
+                continue;
+            }
+            if (syncInfo.isRequestingBlock() && syncInfo.downloadingSince.elapsed() > timeout)
+            {
+                if (syncInfo.downloadTimedOut)
+                {
+                    stallers.push_back(node);
+                    continue;
+                }
+                XUL_WARN("checkTimeouts download timeout " << xul::make_tuple(syncInfo.requestingBlocks.size(), timeout) << " " << *node);
+                releaseBlocks(node);
+                syncInfo.downloadTimedOut = true;
+                syncInfo.downloadingSince.sync();
+            }
+        }
+        for (Node* node : stallers)
+        {
+            XUL_REL_WARN("checkTimeouts drop stalling node " << node->getSyncInfo().requestingBlocks.size() << " " << *node);
+            // comes back through removeNode, which releases its blocks
+            m_nodeManager.removeNode(node);
+        }
+    }
+
+private:
+    XUL_LOGGER_DEFINE();
+    NodeManager& m_nodeManager;
+    NodeMap m_nodes;
+    BlockInFlightMap m_blocksInFlight;
+    xul::time_counter m_lastScheduleTime;
+};
+
+
+BlockDownloadScheduler* createBlockDownloadScheduler(NodeManager& nodeManager)
+{
+    return new BlockDownloadSchedulerImpl(nodeManager);
+}
+
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "util/number.hpp"
+#include <xul/lang/object.hpp>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+class NodeManager;
+class Node;
+
+/**
+ * Spreads the block download window over all nodes that can serve it. Every requested block is tracked in one
+ * table, so a block is in flight from at most one node, and each node is kept at MAX_BLOCKS_IN_TRANSIT_PER_PEER.
+ * A node whose block holds back the window for BLOCK_STALLING_TIMEOUT is dropped, a node that delivers nothing
+ * within the download timeout loses its blocks to the others. Main io service only.
+ */
+class BlockDownloadScheduler : public xul::object
+{
+public:
+    virtual void addNode(Node* node) = 0;
+    // the blocks in flight from the node go back to the others
+    virtual void removeNode(Node* node) = 0;
+    // returns false if the block was not in flight from the node, it is accepted anyway
+    virtual bool onBlockReceived(const uint256& hash, Node* node) = 0;
+    // a received block waits in the reorder buffer, it is neither asked for again nor counted as stored
+    virtual void onBlockParked(const uint256& hash) = 0;
+    virtual void onBlockReleased(const uint256& hash) = 0;
+    // refills the pipeline of the node, the others follow at most every BLOCK_DOWNLOAD_SCHEDULE_INTERVAL
+    virtual void schedule(Node* node) = 0;
+    virtual void scheduleAll() = 0;
+    virtual void onTick(int64_t times) = 0;
+    virtual size_t getBlocksInFlight() const = 0;
+};
+
+BlockDownloadScheduler* createBlockDownloadScheduler(NodeManager& nodeManager);
+
+}
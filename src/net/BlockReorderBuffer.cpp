@@ -0,0 +1,532 @@
+#include "BlockReorderBuffer.hpp"
+#include "BlockDecoder.hpp"
+#include "AppInfo.hpp"
+#include "AppConfig.hpp"
+#include "storage/BlockCache.hpp"
+#include "storage/BlockOrphanTable.hpp"
+#include "util/BufferPool.hpp"
+#include "db.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/net/io_services.hpp>
+#include <xul/log/log.hpp>
+#include <xul/util/time_counter.hpp>
+#include <xul/io/data_output_stream.hpp>
+#include <xul/data/big_number_io.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/os/file_system.hpp>
+#include <xul/std/strings.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+namespace xbtc {
+
+
+class BlockReorderBufferImpl : public xul::object_impl<BlockReorderBuffer>
+{
+public:
+    class ParkedBlock
+    {
+    public:
+        uint256 hash;
+        uint256 previousHash;
+        int height;
+        // null while the block is only in its spill file
+        BlockPtr block;
+        size_t bytes;
+        xul::time_counter parkTime;
+        uint32_t spillFile;
+        // counted as spilled from the moment the write is posted
+        bool spilled;
+        bool writing;
+        bool loading;
+        // released or given up, disk work still in flight finds it gone
+        bool removed;
+
+        ParkedBlock() : height(0), bytes(0), spillFile(0), spilled(false), writing(false), loading(false), removed(false)
+        {
+        }
+    };
+    typedef std::shared_ptr<ParkedBlock> ParkedBlockPtr;
+
+    explicit BlockReorderBufferImpl(AppInfo* appInfo, BlockDecoder* decoder, const BlockReleaseCallback& callback)
+        : m_appInfo(appInfo)
+        , m_decoder(decoder)
+        , m_callback(callback)
+        , m_maxMemoryBytes(std::max(appInfo->getAppConfig()->reorderBuffer, 0))
+        , m_memoryBytes(0)
+        , m_spilledBytes(0)
+        , m_spilledBlocks(0)
+        , m_loadingBytes(0)
+        , m_reloads(0)
+        , m_nextSpillFile(0)
+        , m_maxHeadWait(0)
+        , m_spillDir(xul::paths::join(appInfo->getAppConfig()->dataDir, "blocks/reorder"))
+        , m_spillDirReady(false)
+    {
+        XUL_LOGGER_INIT("BlockReorderBuffer");
+        XUL_REL_EVENT("new " << m_maxMemoryBytes);
+    }
+    virtual ~BlockReorderBufferImpl()
+    {
+        XUL_REL_EVENT("delete");
+    }
+
+    virtual bool addBlock(const BlockPtr& block, bool requested)
+    {
+        const uint256& hash = block->getHash();
+        if (m_blocks.find(hash) != m_blocks.end())
+            return true;
+        BlockCache* cache = m_appInfo->getBlockCache();
+        BlockIndex* blockIndex = cache->getBlockIndex(hash);
+        if (hasBlockData(blockIndex))
+        {
+            XUL_DEBUG("addBlock stored already " << blockIndex->height << " " << hash);
+            return false;
+        }
+        // without a known parent there is nothing to wait for, the block cache decides
+        BlockIndex* previous = block->header.previousBlockHash.is_null() ? nullptr : cache->getBlockIndex(block->header.previousBlockHash);
+        if (!previous || hasBlockData(previous))
+        {
+            release(hash, block, false);
+            return false;
+        }
+        // a peer may push any number of blocks nobody asked for, those with a parent but no valid header of their own are not kept
+        if (!requested && !(blockIndex && blockIndex->isValid(BLOCK_VALID_TREE)))
+        {
+            XUL_DEBUG("addBlock drop unrequested " << previous->height + 1 << " " << hash);
+            return false;
+        }
+        park(block, previous->height + 1);
+        // beyond the spill limit the block itself may have been given up at once
+        return m_blocks.find(hash) != m_blocks.end();
+    }
+    virtual bool contains(const uint256& hash) const
+    {
+        return m_blocks.find(hash) != m_blocks.end();
+    }
+    virtual void getStats(BlockReorderStats& stats) const
+    {
+        stats.blocks = m_blocks.size();
+        stats.memoryBytes = m_memoryBytes;
+        stats.spilledBlocks = m_spilledBlocks;
+        stats.spilledBytes = m_spilledBytes;
+        stats.headHeight = -1;
+        stats.headWait = 0;
+        if (!m_heights.empty())
+        {
+            const ParkedBlockPtr& head = m_heights.begin()->second;
+            stats.headHeight = head->height;
+            stats.headWait = head->parkTime.elapsed();
+        }
+        stats.maxHeadWait = std::max(m_maxHeadWait, stats.headWait);
+    }
+    virtual void onTick(int64_t times)
+    {
+        if (m_heights.empty())
+            return;
+        int64_t headWait = m_heights.begin()->second->parkTime.elapsed();
+        if (headWait > m_maxHeadWait)
+            m_maxHeadWait = headWait;
+        refill();
+        if (times % 10 == 0)
+        {
+            BlockReorderStats stats;
+            getStats(stats);
+            XUL_REL_EVENT("stats " << xul::make_tuple(stats.blocks, stats.memoryBytes, stats.spilledBlocks, stats.spilledBytes)
+                << " " << xul::make_tuple(stats.headHeight, stats.headWait, stats.maxHeadWait));
+        }
+    }
+
+private:
+    void park(const BlockPtr& block, int height)
+    {
+        ParkedBlockPtr entry = std::make_shared<ParkedBlock>();
+        entry->hash = block->getHash();
+        entry->previousHash = block->header.previousBlockHash;
+        entry->height = height;
+        entry->block = block;
+        entry->bytes = estimateBlockMemory(block.get());
+        m_blocks[entry->hash] = entry;
+        m_children.add(entry->previousHash, entry);
+        m_heights.insert(std::make_pair(height, entry));
+        m_memoryBytes += entry->bytes;
+        XUL_DEBUG("park " << xul::make_tuple(height, m_blocks.size(), m_memoryBytes) << " " << entry->hash);
+        spillExcess();
+    }
+    void unpark(const ParkedBlockPtr& entry)
+    {
+        assert(!entry->removed);
+        entry->removed = true;
+        // the head of the line has waited its full time when it leaves
+        if (m_heights.begin()->second == entry && entry->parkTime.elapsed() > m_maxHeadWait)
+            m_maxHeadWait = entry->parkTime.elapsed();
+        m_blocks.erase(entry->hash);
+        m_children.remove(entry->previousHash, entry);
+        eraseEntry(m_heights, entry->height, entry);
+        if (entry->spilled)
+        {
+            m_spilledBytes -= entry->bytes;
+            --m_spilledBlocks;
+            // an unfinished write or read removes the file itself
+            if (!entry->writing && !entry->loading)
+                removeSpillFile(entry->spillFile);
+        }
+        else
+        {
+            m_memoryBytes -= entry->bytes;
+        }
+        if (entry->loading)
+        {
+            m_loadingBytes -= entry->bytes;
+            --m_reloads;
+        }
+    }
+    static void eraseEntry(std::multimap<int, ParkedBlockPtr>& entries, int key, const ParkedBlockPtr& entry)
+    {
+        auto range = entries.equal_range(key);
+        for (auto iter = range.first; iter != range.second; ++iter)
+        {
+            if (iter->second == entry)
+            {
+                entries.erase(iter);
+                return;
+            }
+        }
+    }
+    // releases the block, then every parked descendant that is in memory, parent before child
+    void release(const uint256& hash, const BlockPtr& block, bool parked)
+    {
+        std::deque<ParkedBlockPtr> ready;
+        releaseOne(hash, block, parked, ready);
+        while (!ready.empty())
+        {
+            ParkedBlockPtr entry = ready.front();
+            ready.pop_front();
+            releaseOne(entry->hash, entry->block, true, ready);
+        }
+        refill();
+    }
+    void releaseOne(const uint256& hash, const BlockPtr& block, bool parked, std::deque<ParkedBlockPtr>& ready)
+    {
+        m_callback(hash, block, parked);
+        std::vector<ParkedBlockPtr> children;
+        m_children.getChildren(hash, children);
+        if (children.empty())
+            return;
+        BlockIndex* blockIndex = m_appInfo->getBlockCache()->getBlockIndex(hash);
+        if (!hasBlockData(blockIndex))
+        {
+            // a rejected parent fails its descendants for good, a given up one only sends them back to the download
+            bool failed = blockIndex && block;
+            XUL_WARN("releaseOne drop descendants of rejected block " << xul::make_tuple(children.size(), failed) << " " << hash);
+            for (const auto& child : children)
+            {
+                dropWithDescendants(child, failed);
+            }
+            return;
+        }
+        for (const auto& child : children)
+        {
+            if (child->block)
+            {
+                unpark(child);
+                ready.push_back(child);
+            }
+            else if (!child->loading)
+            {
+                load(child);
+            }
+        }
+    }
+    // failed descendants are marked in the block cache, so the scheduler does not download them again once their
+    // in flight marks go
+    void dropWithDescendants(const ParkedBlockPtr& root, bool failed)
+    {
+        BlockCache* cache = m_appInfo->getBlockCache();
+        std::vector<ParkedBlockPtr> entries(1, root);
+        while (!entries.empty())
+        {
+            ParkedBlockPtr entry = entries.back();
+            entries.pop_back();
+            m_children.getChildren(entry->hash, entries);
+            unpark(entry);
+            BlockIndex* blockIndex = failed ? cache->getBlockIndex(entry->hash) : nullptr;
+            if (blockIndex)
+                cache->markBlockFailed(blockIndex, true);
+            m_callback(entry->hash, BlockPtr(), true);
+        }
+    }
+    // the blocks furthest from the tip are needed last, they leave memory first, to the spill files while
+    // MAX_REORDER_SPILL_BYTES allows and back to the download after that
+    void spillExcess()
+    {
+        auto iter = m_heights.rbegin();
+        while (iter != m_heights.rend() && m_memoryBytes > m_maxMemoryBytes)
+        {
+            ParkedBlockPtr entry = iter->second;
+            ++iter;
+            if (!entry->block || entry->spilled)
+                continue;
+            if (m_spilledBytes + entry->bytes <= MAX_REORDER_SPILL_BYTES)
+            {
+                spill(entry);
+                continue;
+            }
+            XUL_WARN("spillExcess give up " << xul::make_tuple(entry->height, m_memoryBytes, m_spilledBytes) << " " << entry->hash);
+            dropWithDescendants(entry, false);
+            // the descendants left the height map as well
+            iter = m_heights.rbegin();
+        }
+    }
+    // reads the spilled blocks closest to the tip back while memory is at most half used, so the next gap to
+    // fill does not wait for the disk, at most MAX_REORDER_RELOADS at a time
+    void refill()
+    {
+        for (auto iter = m_heights.begin(); iter != m_heights.end() && m_reloads < MAX_REORDER_RELOADS; ++iter)
+        {
+            const ParkedBlockPtr& entry = iter->second;
+            if (!entry->spilled || entry->writing || entry->loading)
+                continue;
+            if ((m_memoryBytes + m_loadingBytes + entry->bytes) * 2 > m_maxMemoryBytes)
+                break;
+            load(entry);
+        }
+    }
+    void spill(const ParkedBlockPtr& entry)
+    {
+        entry->spilled = true;
+        entry->writing = true;
+        entry->spillFile = m_nextSpillFile++;
+        m_memoryBytes -= entry->bytes;
+        m_spilledBytes += entry->bytes;
+        ++m_spilledBlocks;
+        XUL_EVENT("spill " << xul::make_tuple(entry->height, m_memoryBytes, m_spilledBlocks) << " " << entry->hash);
+        boost::intrusive_ptr<BlockReorderBufferImpl> self(this);
+        BlockPtr block = entry->block;
+        std::string filepath = getSpillFilePath(entry->spillFile);
+        size_t sizeHint = entry->bytes;
+        xul::io_services::post(m_appInfo->getDiskIOService(), [self, entry, block, filepath, sizeHint]() {
+            bool success = self->writeSpillFile(filepath, block.get(), sizeHint);
+            xul::io_services::post(self->m_appInfo->getIOService(), [self, entry, success]() {
+                self->onSpillWritten(entry, success);
+            });
+        });
+    }
+    void onSpillWritten(const ParkedBlockPtr& entry, bool success)
+    {
+        entry->writing = false;
+        if (entry->removed)
+        {
+            if (success)
+                removeSpillFile(entry->spillFile);
+            return;
+        }
+        if (!success)
+        {
+            XUL_WARN("onSpillWritten failed, keep in memory " << entry->height << " " << entry->hash);
+            entry->spilled = false;
+            m_spilledBytes -= entry->bytes;
+            --m_spilledBlocks;
+            m_memoryBytes += entry->bytes;
+            return;
+        }
+        entry->block.reset();
+    }
+    void load(const ParkedBlockPtr& entry)
+    {
+        assert(entry->spilled && !entry->writing && !entry->loading && !entry->block);
+        entry->loading = true;
+        m_loadingBytes += entry->bytes;
+        ++m_reloads;
+        boost::intrusive_ptr<BlockReorderBufferImpl> self(this);
+        std::string filepath = getSpillFilePath(entry->spillFile);
+        xul::io_services::post(m_appInfo->getDiskIOService(), [self, entry, filepath]() {
+            PooledBuffer data = self->readSpillFile(filepath);
+            ::unlink(filepath.c_str());
+            xul::io_services::post(self->m_appInfo->getIOService(), [self, entry, data]() {
+                self->onSpillRead(entry, data);
+            });
+        });
+    }
+    void onSpillRead(const ParkedBlockPtr& entry, const PooledBuffer& data)
+    {
+        if (entry->removed)
+            return;
+        if (!data)
+        {
+            onSpillLoaded(entry, BlockPtr());
+            return;
+        }
+        boost::intrusive_ptr<BlockReorderBufferImpl> self(this);
+        // reloads stay out of the decode queue, they would hold back the sockets of the nodes
+        m_decoder->decodeStored(MessagePayload(reinterpret_cast<const uint8_t*>(data->data()), data->size(), data), [self, entry](const BlockPtr& block) {
+            self->onSpillLoaded(entry, block);
+        });
+    }
+    void onSpillLoaded(const ParkedBlockPtr& entry, const BlockPtr& block)
+    {
+        if (entry->removed)
+            return;
+        entry->loading = false;
+        m_loadingBytes -= entry->bytes;
+        --m_reloads;
+        if (!block || block->getHash() != entry->hash)
+        {
+            XUL_REL_ERROR("onSpillLoaded failed to read back " << entry->height << " " << entry->hash);
+            dropWithDescendants(entry, false);
+            return;
+        }
+        entry->block = block;
+        entry->spilled = false;
+        m_spilledBytes -= entry->bytes;
+        --m_spilledBlocks;
+        m_memoryBytes += entry->bytes;
+        BlockIndex* previous = m_appInfo->getBlockCache()->getBlockIndex(entry->previousHash);
+        if (hasBlockData(previous))
+        {
+            unpark(entry);
+            release(entry->hash, entry->block, true);
+        }
+    }
+
+    // disk io service
+    std::string getSpillFilePath(uint32_t spillFile) const
+    {
+        return xul::paths::join(m_spillDir, xul::strings::format("%08u.blk", spillFile));
+    }
+    bool prepareSpillDirectory()
+    {
+        if (m_spillDirReady)
+            return true;
+        if (!xul::file_system::ensure_directory_exists(m_spillDir.c_str()))
+        {
+            XUL_REL_ERROR("prepareSpillDirectory failed " << m_spillDir);
+            return false;
+        }
+        // files left behind by an earlier run belong to blocks that are gone
+        DIR* dir = opendir(m_spillDir.c_str());
+        if (dir)
+        {
+            while (struct dirent* item = readdir(dir))
+            {
+                if (item->d_name[0] != '.')
+                    ::unlink(xul::paths::join(m_spillDir, item->d_name).c_str());
+            }
+            closedir(dir);
+        }
+        m_spillDirReady = true;
+        return true;
+    }
+    // the estimated memory of a block is never below its serialized size, so the first buffer is nearly always enough
+    PooledBuffer serializeBlock(const Block* block, size_t sizeHint)
+    {
+        size_t firstSize = std::min<size_t>(std::max<size_t>(sizeHint, 4096), MAX_BLOCK_SERIALIZED_SIZE);
+        for (size_t bufsize = firstSize; bufsize <= MAX_BLOCK_SERIALIZED_SIZE * 2; bufsize *= 2)
+        {
+            PooledBuffer s = m_appInfo->getBufferPool()->allocate(bufsize);
+            xul::memory_data_output_stream os(&(*s)[0], s->size(), false);
+            os << *block;
+            if (os.good())
+            {
+                s->resize(os.position());
+                return s;
+            }
+            bufsize = s->size();
+        }
+        XUL_WARN("serializeBlock block too large " << block->getHash());
+        return PooledBuffer();
+    }
+    bool writeSpillFile(const std::string& filepath, const Block* block, size_t sizeHint)
+    {
+        if (!prepareSpillDirectory())
+            return false;
+        PooledBuffer data = serializeBlock(block, sizeHint);
+        if (!data)
+            return false;
+        FILE* fp = fopen(filepath.c_str(), "wb");
+        if (!fp)
+        {
+            XUL_WARN("writeSpillFile failed to open " << filepath << " " << errno);
+            return false;
+        }
+        bool success = fwrite(data->data(), 1, data->size(), fp) == data->size();
+        if (fclose(fp) != 0)
+            success = false;
+        if (!success)
+        {
+            XUL_WARN("writeSpillFile failed to write " << filepath << " " << errno);
+            ::unlink(filepath.c_str());
+        }
+        return success;
+    }
+    PooledBuffer readSpillFile(const std::string& filepath)
+    {
+        FILE* fp = fopen(filepath.c_str(), "rb");
+        if (!fp)
+        {
+            XUL_WARN("readSpillFile failed to open " << filepath << " " << errno);
+            return PooledBuffer();
+        }
+        PooledBuffer data;
+        if (fseek(fp, 0, SEEK_END) == 0)
+        {
+            long size = ftell(fp);
+            if (size > 0 && fseek(fp, 0, SEEK_SET) == 0)
+            {
+                data = m_appInfo->getBufferPool()->allocate(size);
+                data->resize(size);
+                if (fread(&(*data)[0], 1, size, fp) != static_cast<size_t>(size))
+                    data.reset();
+            }
+        }
+        fclose(fp);
+        return data;
+    }
+    void removeSpillFile(uint32_t spillFile)
+    {
+        std::string filepath = getSpillFilePath(spillFile);
+        xul::io_services::post(m_appInfo->getDiskIOService(), [filepath]() {
+            ::unlink(filepath.c_str());
+        });
+    }
+
+private:
+    XUL_LOGGER_DEFINE();
+    boost::intrusive_ptr<AppInfo> m_appInfo;
+    boost::intrusive_ptr<BlockDecoder> m_decoder;
+    BlockReleaseCallback m_callback;
+    const size_t m_maxMemoryBytes;
+    std::unordered_map<uint256, ParkedBlockPtr> m_blocks;
+    BlockOrphanTable<ParkedBlockPtr> m_children;
+    std::multimap<int, ParkedBlockPtr> m_heights;
+    size_t m_memoryBytes;
+    size_t m_spilledBytes;
+    size_t m_spilledBlocks;
+    size_t m_loadingBytes;
+    // spilled blocks being read or decoded
+    int m_reloads;
+    uint32_t m_nextSpillFile;
+    int64_t m_maxHeadWait;
+    const std::string m_spillDir;
+    // disk io service only
+    bool m_spillDirReady;
+};
+
+
+BlockReorderBuffer* createBlockReorderBuffer(AppInfo* appInfo, BlockDecoder* decoder, const BlockReleaseCallback& callback)
+{
+    return new BlockReorderBufferImpl(appInfo, decoder, callback);
+}
+
+
+}
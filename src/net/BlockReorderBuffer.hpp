@@ -0,0 +1,57 @@
+#pragma once
+
+#include "data/Block.hpp"
+#include <xul/lang/object.hpp>
+#include <functional>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+class AppInfo;
+class BlockDecoder;
+
+class BlockReorderStats
+{
+public:
+    size_t blocks;
+    size_t memoryBytes;
+    size_t spilledBlocks;
+    size_t spilledBytes;
+    // the parked block closest to the tip and how long in ms it has waited for its parent, -1 and 0 when empty
+    int headHeight;
+    int64_t headWait;
+    int64_t maxHeadWait;
+
+    BlockReorderStats() : blocks(0), memoryBytes(0), spilledBlocks(0), spilledBytes(0), headHeight(-1), headWait(0), maxHeadWait(0)
+    {
+    }
+};
+
+// parked tells whether the block waited in the buffer, a null block was given up and is not coming back
+typedef std::function<void (const uint256& hash, const BlockPtr& block, bool parked)> BlockReleaseCallback;
+
+/**
+ * Puts downloaded blocks back into chain order before they reach the block cache. A block whose parent has data
+ * is released at once, the others are parked by their parent and released, parent before child, as the gaps before
+ * them fill. Only blocks requested from the sending node, or whose header is known and valid, are parked, the other
+ * unordered ones are dropped. Parked blocks are kept in memory up to AppConfig::reorderBuffer bytes, beyond that the
+ * ones furthest from the tip are spilled to blocks/reorder, up to MAX_REORDER_SPILL_BYTES, and read back through the
+ * BlockDecoder, outside its queue, when their turn comes. Past both limits the furthest blocks are given up and go
+ * back to the download. A block rejected by the block cache fails its parked descendants there. Main io service only.
+ */
+class BlockReorderBuffer : public xul::object
+{
+public:
+    // requested tells whether the block was in flight from the node that sent it,
+    // returns true if the block is parked, false if it was released right away, dropped or is stored already
+    virtual bool addBlock(const BlockPtr& block, bool requested) = 0;
+    virtual bool contains(const uint256& hash) const = 0;
+    virtual void getStats(BlockReorderStats& stats) const = 0;
+    virtual void onTick(int64_t times) = 0;
+};
+
+BlockReorderBuffer* createBlockReorderBuffer(AppInfo* appInfo, BlockDecoder* decoder, const BlockReleaseCallback& callback);
+
+}
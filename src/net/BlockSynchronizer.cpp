@@ -1,5 +1,8 @@
 
 #include "BlockSynchronizer.hpp"
+#include "BlockDownloadScheduler.hpp"
+#include "BlockReorderBuffer.hpp"
+#include "HeaderSegmentScheduler.hpp"
 #include "Node.hpp"
 #include "NodeManager.cpp"
 #include "NodeSyncInfo.hpp"
@@ -17,6 +20,7 @@
 #include <xul/log/log.hpp>
 #include <xul/util/time_counter.hpp>
 #include <xul/data/big_number_io.hpp>
+#include <functional>
 #include <map>
 
 
@@ -34,6 +38,10 @@ public:
     {
         XUL_LOGGER_INIT("BlockSynchronizer");
         XUL_DEBUG("new");
+        m_downloadScheduler = createBlockDownloadScheduler(nodeManager);
+        m_headerSegments = createHeaderSegmentScheduler(nodeManager);
+        m_reorderBuffer = createBlockReorderBuffer(nodeManager.getAppInfo(), nodeManager.getBlockDecoder(),
+            std::bind(&BlockSynchronizerImpl::onBlockReleased, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
     }
     virtual ~BlockSynchronizerImpl()
     {
@@ -42,9 +50,12 @@ public:
 
     virtual void onTick(int64_t times)
     {
+        m_headerSegments->onTick(times);
         checkHeaderRequestTimeout();
         chooseHeadersRueqster(false);
         scheduleRequestHeaders();
+        m_downloadScheduler->onTick(times);
+        m_reorderBuffer->onTick(times);
     }
 
     void checkHeaderRequestTimeout()
@@ -73,73 +84,98 @@ public:
     {
         XUL_DEBUG("addNode " << m_nodes.size() << " " << *node);
         m_nodes[node] = node;
+        m_headerSegments->addNode(node);
         chooseHeadersRueqster(false);
+        m_downloadScheduler->addNode(node);
     }
     virtual void removeNode(Node* node)
     {
         XUL_DEBUG("removeNode " << m_nodes.size() << " " << *node);
         m_nodes.erase(node);
+        m_headerSegments->removeNode(node);
         if (node == m_headersRueqster.get())
         {
             chooseHeadersRueqster(true);
         }
+        m_downloadScheduler->removeNode(node);
     }
     virtual void handleHeaders(std::vector<BlockHeader>& headers, Node* node)
     {
-        m_requestingHeaders = false;
-        NodeSyncInfo& syncInfo = node->getSyncInfo();
-        BlockIndex* block;
-        for (auto& header : headers)
+        if (m_headerSegments->handleHeaders(headers, node))
         {
-            header.computeHash();
-            block = m_nodeManager.getAppInfo()->getBlockCache()->addBlockIndex(header);
+            m_downloadScheduler->scheduleAll();
+            // the single requester goes on from the last checkpoint
+            if (!m_headerSegments->isActive() && !m_requestingHeaders)
+                requestHeaders(nullptr);
+            return;
         }
-        if (!headers.empty())
+        NodeSyncInfo& syncInfo = node->getSyncInfo();
+        // the answer to an availability probe of another node leaves the headers requester alone
+        bool probe = syncInfo.probingHeaders && node != m_headersRueqster.get();
+        syncInfo.probingHeaders = false;
+        if (!probe)
+            m_requestingHeaders = false;
+        BlockIndex* block = m_nodeManager.getAppInfo()->getBlockCache()->addBlockIndexes(headers);
+        if (!headers.empty() && (!block || block->getHash() != headers.back().hash))
         {
-            m_lastHeadersReceiveTime.sync();
-            assert(block);
-            syncInfo.updateBlockAvailability(headers[headers.size() - 1].hash, block, m_nodeManager.getAppInfo()->getBlockCache());
-            XUL_EVENT("handleHeaders request again " << xul::make_tuple(headers.size(), block->height) << " " << *node);
-            requestHeaders(block);
+            // the block cache stopped at an invalid or unlinked header, the node only has what was taken
+            XUL_WARN("handleHeaders headers rejected from " << (block ? block->height : -1) << " " << headers.size() << " " << *node);
         }
-        if (headers.size() < 2000 && !syncInfo.lastDownloadBlock)
+        if (block)
         {
-            XUL_EVENT("handleCommand_headers start request block " << headers.size() << " " << *node);
-            checkRequestBlocks(node);
+            m_lastHeadersReceiveTime.sync();
+            syncInfo.updateBlockAvailability(block->getHash(), block, m_nodeManager.getAppInfo()->getBlockCache());
+            if (!probe)
+            {
+                XUL_EVENT("handleHeaders request again " << xul::make_tuple(headers.size(), block->height) << " " << *node);
+                requestHeaders(block);
+            }
         }
+        // new headers extend the window of every node, not only of the one that sent them
+        m_downloadScheduler->scheduleAll();
+    }
+    virtual void handleBlockAnnouncement(const uint256& hash, Node* node)
+    {
+        BlockCache* cache = m_nodeManager.getAppInfo()->getBlockCache();
+        // an unknown hash is kept until the headers requester brings its header
+        node->getSyncInfo().updateBlockAvailability(hash, cache->getBlockIndex(hash), cache);
+        m_downloadScheduler->schedule(node);
     }
     virtual void handleBlock(Block* block, Node* node)
     {
         XUL_EVENT("handleBlock " << block->header.merkleRootHash << " " << *node);
-        for (auto& tx : block->transactions)
+        bool requested = m_downloadScheduler->onBlockReceived(block->getHash(), node);
+        if (!requested)
         {
-            tx.computeHash();
+            XUL_DEBUG("handleBlock unrequested " << block->getHash() << " " << *node);
         }
-        node->getSyncInfo().removeBlockRecord(block);
-        BlockIndex* blockIndex = m_nodeManager.getAppInfo()->getBlockCache()->addBlock(block);
-        XUL_EVENT("handleBlock index " << blockIndex->height << " " << *node);
-        if (blockIndex->height == 33275)
+        // blocks from different nodes come out of order, the block cache gets them parent before child
+        if (m_reorderBuffer->addBlock(BlockPtr(block), requested))
         {
-            XUL_EVENT("handleBlock check point " << blockIndex->height << " " << *node);
+            XUL_DEBUG("handleBlock parked " << block->getHash() << " " << *node);
+            m_downloadScheduler->onBlockParked(block->getHash());
         }
-        checkRequestBlocks(node);
+        m_downloadScheduler->schedule(node);
     }
 
 private:
-    void checkRequestBlocks(Node* node)
+    void onBlockReleased(const uint256& hash, const BlockPtr& block, bool parked)
     {
-        if (!node->getSyncInfo().isRequestingBlock())
+        if (parked)
+            m_downloadScheduler->onBlockReleased(hash);
+        if (!block)
         {
-            requestBlocks(node);
+            XUL_WARN("onBlockReleased given up " << hash);
+            return;
         }
-    }
-    void requestBlocks(Node* node)
-    {
-        std::vector<BlockIndex*> blocks;
-        node->getSyncInfo().findBlocksToDownload(blocks, 128, m_nodeManager.getAppInfo()->getBlockCache(), m_nodeManager.getAppInfo()->getAppConfig());
-        if (blocks.size() > 0)
+        BlockIndex* blockIndex = m_nodeManager.getAppInfo()->getBlockCache()->addBlock(block.get());
+        if (!blockIndex)
         {
-            node->requestBlocks(blocks);
+            XUL_WARN("onBlockReleased rejected " << hash);
+        }
+        else
+        {
+            XUL_EVENT("onBlockReleased index " << xul::make_tuple(blockIndex->height, parked));
         }
     }
     void chooseHeadersRueqster(bool forced)
@@ -151,18 +187,19 @@ private:
     }
     void requestHeaders(BlockIndex* block)
     {
-        if (!m_headersRueqster)
+        // below the last checkpoint the header segments are fetched from several nodes instead
+        if (!m_headersRueqster || m_headerSegments->isActive())
             return;
         XUL_DEBUG("requestHeaders " << m_nodes.size() << " " << *m_headersRueqster);
         if (block == nullptr)
         {
             block = m_nodeManager.getAppInfo()->getBlockCache()->getBestHeader();
             assert(block);
-            block = block->previous.get();
+            block = block->getPrevious();
         }
         std::vector<uint256> hashes;
         m_nodeManager.getAppInfo()->getBlockCache()->getChain()->getLocator(hashes, block);
-        m_headersRueqster->requestHeaders(std::move(hashes));
+        m_headersRueqster->requestHeaders(std::move(hashes), uint256());
         m_requestingHeaders = true;
         m_lastHeadersRequestTime.sync();
     }
@@ -196,6 +233,9 @@ private:
     XUL_LOGGER_DEFINE();
     NodeManager& m_nodeManager;
     NodeMap m_nodes;
+    boost::intrusive_ptr<BlockDownloadScheduler> m_downloadScheduler;
+    boost::intrusive_ptr<BlockReorderBuffer> m_reorderBuffer;
+    boost::intrusive_ptr<HeaderSegmentScheduler> m_headerSegments;
     NodePtr m_headersRueqster;
     bool m_requestingHeaders;
     xul::time_counter m_startTime;
@@ -229,10 +269,16 @@ void NodeSyncInfo::updateBlockAvailability(const uint256& hash, BlockIndex* bloc
         lastUnknownBlockHash = hash;
     }
 }
-void NodeSyncInfo::findBlocksToDownload(std::vector<BlockIndex*>& blocks, int count, BlockCache* cache, const AppConfig* config)
+void NodeSyncInfo::findBlocksToDownload(std::vector<BlockIndex*>& blocks, int count, BlockCache* cache, const AppConfig* config,
+                                        const BlockInFlightMap& blocksInFlight, Node* self, Node*& staller)
 {
+    staller = nullptr;
+    if (count <= 0)
+        return;
     processBlockAvailability(cache);
-    BlockChain* chain = cache->getChain();
+    // the disk thread moves the tip meanwhile, one view keeps the tip and the heights below it consistent
+    EpochGuard guard;
+    const BlockChainView* chain = cache->getChain()->getView();
     if (!bestKnownBlock || bestKnownBlock->chainWork < chain->getTip()->chainWork
         || bestKnownBlock->chainWork < config->minimumChainWork)
     {
@@ -245,39 +291,77 @@ void NodeSyncInfo::findBlocksToDownload(std::vector<BlockIndex*>& blocks, int co
         // Guessing wrong in either direction is not a problem.
         lastCommonBlock = chain->getBlock(std::min(bestKnownBlock->height, chain->getHeight()));
     }
-    lastCommonBlock = findLastCommonAncestor(lastCommonBlock.get(), bestKnownBlock.get());
+    lastCommonBlock = findLastCommonAncestor(lastCommonBlock, bestKnownBlock);
     if (lastCommonBlock == bestKnownBlock)
         return;
+    // the window starts at the first block not yet received, it moves only when that block arrives
     int windowEnd = lastCommonBlock->height + BLOCK_DOWNLOAD_WINDOW;
     int maxHeight = std::min<int>(bestKnownBlock->height, windowEnd + 1);
-    BlockIndex* block = lastCommonBlock.get();
-    int realCount = std::min(maxHeight - block->height, std::max<int>(count, 128));
-    blocks.resize(realCount);
-    block = bestKnownBlock->getAncestor(block->height + realCount);
-    assert(block);
-    blocks[realCount - 1] = block;
-    lastDownloadBlock = block;
-    lastCommonBlock = block;
-    for (int i = realCount - 1; i > 0; --i)
+    Node* waitingFor = nullptr;
+    bool contiguous = true;
+    std::vector<BlockIndex*> toFetch;
+    BlockIndex* walk = lastCommonBlock;
+    while (walk->height < maxHeight)
     {
-        blocks[i - 1] = blocks[i]->previous.get();
+        // walk the path to the best known block in batches, getAncestor is cheap but not free
+        int fetchCount = std::min(maxHeight - walk->height, std::max<int>(count - static_cast<int>(blocks.size()), 128));
+        toFetch.resize(fetchCount);
+        walk = bestKnownBlock->getAncestor(walk->height + fetchCount);
+        assert(walk);
+        toFetch[fetchCount - 1] = walk;
+        for (int i = fetchCount - 1; i > 0; --i)
+        {
+            toFetch[i - 1] = toFetch[i]->getPrevious();
+        }
+        for (BlockIndex* block : toFetch)
+        {
+            if (!block->isValid(BLOCK_VALID_TREE))
+                return;
+            if (block->transactionCount > 0 || chain->contains(block))
+            {
+                // received, the common block only moves over an unbroken run of received blocks
+                if (contiguous)
+                    lastCommonBlock = block;
+                continue;
+            }
+            contiguous = false;
+            auto iter = blocksInFlight.find(block->getHash());
+            if (iter == blocksInFlight.end())
+            {
+                if (block->height > windowEnd)
+                {
+                    // the window is full and its lowest missing block is in flight from another node
+                    if (blocks.empty() && waitingFor != self)
+                        staller = waitingFor;
+                    return;
+                }
+                blocks.push_back(block);
+                if (static_cast<int>(blocks.size()) == count)
+                    return;
+            }
+            else if (!waitingFor)
+            {
+                waitingFor = iter->second;
+            }
+        }
     }
 }
 
 void NodeSyncInfo::recordRequestingBlocks(const std::vector<BlockIndex*>& blocks)
 {
-    assert(requestingBlocks.empty());
+    if (requestingBlocks.empty())
+        downloadingSince.sync();
     for (auto block : blocks)
     {
         assert(!block->getHash().is_null());
+        assert(requestingBlocks.find(block->getHash()) == requestingBlocks.end());
         requestingBlocks[block->getHash()] = block;
     }
 }
-void NodeSyncInfo::removeBlockRecord(const xbtc::Block* block)
+bool NodeSyncInfo::removeBlockRecord(const uint256& hash)
 {
-    assert(!block->getHash().is_null());
-    int count = requestingBlocks.erase(block->getHash());
-    assert(count == 1);
+    assert(!hash.is_null());
+    return requestingBlocks.erase(hash) > 0;
 }
 
 BlockSynchronizer* createBlockSynchronizer(NodeManager& nodeManager)
@@ -18,6 +18,8 @@ public:
     virtual void addNode(Node* node) = 0;
     virtual void removeNode(Node* node) = 0;
     virtual void handleHeaders(std::vector<BlockHeader>& headers, Node* node) = 0;
+    // a block the node announced with inv
+    virtual void handleBlockAnnouncement(const uint256& hash, Node* node) = 0;
     virtual void handleBlock(Block* block, Node* node) = 0;
 };
 
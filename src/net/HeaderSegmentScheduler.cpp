@@ -0,0 +1,347 @@
+#include "HeaderSegmentScheduler.hpp"
+#include "Node.hpp"
+#include "NodeManager.hpp"
+#include "NodeInfo.hpp"
+#include "AppInfo.hpp"
+#include "storage/BlockCache.hpp"
+#include "storage/ChainParams.hpp"
+#include "storage/Validator.hpp"
+#include "data/Block.hpp"
+#include "db.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+#include <xul/util/time_counter.hpp>
+#include <xul/data/big_number_io.hpp>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+
+
+namespace xbtc {
+
+
+class HeaderSegmentSchedulerImpl : public xul::object_impl<HeaderSegmentScheduler>
+{
+public:
+    typedef boost::intrusive_ptr<Node> NodePtr;
+    typedef std::map<Node*, NodePtr> NodeMap;
+
+    // the headers after startHash up to and including endHash
+    class HeaderSegment
+    {
+    public:
+        int startHeight;
+        uint256 startHash;
+        int endHeight;
+        uint256 endHash;
+        // linked from startHash, not checked against endHash before the segment is complete
+        std::vector<BlockHeader> headers;
+        Node* node;
+        xul::time_counter requestTime;
+        int mismatches;
+
+        HeaderSegment() : startHeight(0), endHeight(0), node(nullptr), mismatches(0)
+        {
+        }
+        bool isComplete() const
+        {
+            return startHeight + static_cast<int>(headers.size()) == endHeight;
+        }
+        const uint256& getLastHash() const
+        {
+            return headers.empty() ? startHash : headers.back().hash;
+        }
+    };
+    typedef std::shared_ptr<HeaderSegment> HeaderSegmentPtr;
+
+    explicit HeaderSegmentSchedulerImpl(NodeManager& nodeManager) : m_nodeManager(nodeManager), m_built(false), m_active(false)
+    {
+        XUL_LOGGER_INIT("HeaderSegmentScheduler");
+        m_validator = createValidator(nodeManager.getAppInfo()->getAppConfig());
+        XUL_DEBUG("new");
+    }
+    virtual ~HeaderSegmentSchedulerImpl()
+    {
+        XUL_DEBUG("delete");
+    }
+
+    virtual bool isActive() const
+    {
+        return m_active || !m_built;
+    }
+    virtual void addNode(Node* node)
+    {
+        m_nodes[node] = node;
+        if (!m_built)
+            buildSegments();
+        assignSegments();
+    }
+    virtual void removeNode(Node* node)
+    {
+        m_nodes.erase(node);
+        m_excludedNodes.erase(node);
+        m_timedOutNodes.erase(node);
+        m_lateRequests.erase(node);
+        auto iter = m_requests.find(node);
+        if (iter == m_requests.end())
+            return;
+        iter->second->node = nullptr;
+        m_requests.erase(iter);
+        assignSegments();
+    }
+    virtual bool handleHeaders(std::vector<BlockHeader>& headers, Node* node)
+    {
+        auto lateIter = m_lateRequests.find(node);
+        if (lateIter != m_lateRequests.end() && (headers.empty() || headers[0].previousBlockHash == lateIter->second))
+        {
+            // the segment has moved on since, the answer is dropped
+            m_lateRequests.erase(lateIter);
+            return true;
+        }
+        auto iter = m_requests.find(node);
+        if (iter == m_requests.end())
+            return false;
+        HeaderSegmentPtr segment = iter->second;
+        // an announcement of a new block does not continue the segment, it takes the usual way
+        if (!headers.empty() && headers[0].previousBlockHash != segment->getLastHash())
+            return false;
+        m_requests.erase(iter);
+        segment->node = nullptr;
+        bool forged = false;
+        if (appendHeaders(segment, headers, node, forged))
+            m_lastProgressTime.sync();
+        if (forged)
+        {
+            // comes back through removeNode, the segment goes to another node
+            m_nodeManager.removeNode(node);
+            assignSegments();
+            return true;
+        }
+        if (!m_active)
+            return true;
+        if (!segment->isComplete() && headers.size() == MAX_HEADERS_RESULTS && m_excludedNodes.find(node) == m_excludedNodes.end())
+        {
+            // the node has more of the segment, it keeps it
+            requestSegment(segment, node);
+        }
+        insertSegments();
+        assignSegments();
+        return true;
+    }
+    virtual void onTick(int64_t times)
+    {
+        if (!m_active)
+            return;
+        std::vector<Node*> timedOut;
+        for (const auto& item : m_requests)
+        {
+            if (item.second->requestTime.elapsed() > HEADER_SEGMENT_TIMEOUT)
+                timedOut.push_back(item.first);
+        }
+        for (Node* node : timedOut)
+        {
+            // a node gets one more segment after its first timeout, a slow moment is not a broken node
+            bool retry = m_timedOutNodes.insert(node).second;
+            XUL_EVENT("onTick segment request timeout " << xul::make_tuple(m_requests[node]->endHeight, retry) << " " << *node);
+            if (!retry)
+                m_excludedNodes.insert(node);
+            dropRequest(node);
+        }
+        if (m_lastProgressTime.elapsed() > HEADER_SEGMENT_STALL_TIMEOUT)
+        {
+            abandon("no progress");
+            return;
+        }
+        assignSegments();
+    }
+
+private:
+    void buildSegments()
+    {
+        m_built = true;
+        BlockCache* cache = m_nodeManager.getAppInfo()->getBlockCache();
+        BlockIndex* bestHeader = cache->getBestHeader();
+        int startHeight = bestHeader->height;
+        uint256 startHash = bestHeader->getHash();
+        for (const auto& checkpoint : m_nodeManager.getAppInfo()->getChainParams()->checkpoints)
+        {
+            if (checkpoint.first <= startHeight)
+                continue;
+            HeaderSegmentPtr segment = std::make_shared<HeaderSegment>();
+            segment->startHeight = startHeight;
+            segment->startHash = startHash;
+            segment->endHeight = checkpoint.first;
+            segment->endHash = checkpoint.second;
+            m_segments.push_back(segment);
+            startHeight = checkpoint.first;
+            startHash = checkpoint.second;
+        }
+        // a single segment is no faster than the single requester
+        if (m_segments.size() < 2)
+            m_segments.clear();
+        m_active = !m_segments.empty();
+        m_lastProgressTime.sync();
+        XUL_REL_EVENT("buildSegments " << xul::make_tuple(m_segments.size(), bestHeader->height, startHeight));
+    }
+    // returns true if the headers moved the segment on, forged is set for a header without its proof of work
+    bool appendHeaders(const HeaderSegmentPtr& segment, std::vector<BlockHeader>& headers, Node* node, bool& forged)
+    {
+        if (headers.empty())
+        {
+            XUL_EVENT("appendHeaders node lacks segment " << segment->endHeight << " " << *node);
+            m_excludedNodes.insert(node);
+            return false;
+        }
+        size_t oldSize = segment->headers.size();
+        for (auto& header : headers)
+        {
+            header.computeHash();
+            if (header.previousBlockHash != segment->getLastHash())
+            {
+                XUL_WARN("appendHeaders unlinked header " << segment->startHeight + segment->headers.size() << " " << *node);
+                segment->headers.resize(oldSize);
+                m_excludedNodes.insert(node);
+                return false;
+            }
+            // checked here as well as in the block cache, so a chain made up to the next checkpoint costs work
+            if (!m_validator->validateBlockHeader(header))
+            {
+                XUL_REL_WARN("appendHeaders header fails proof of work " << segment->startHeight + segment->headers.size() << " " << *node);
+                segment->headers.resize(oldSize);
+                m_excludedNodes.insert(node);
+                forged = true;
+                return false;
+            }
+            segment->headers.push_back(header);
+            // a node that does not know the stop hash goes on past it
+            if (segment->isComplete())
+                break;
+        }
+        if (segment->isComplete() && segment->getLastHash() != segment->endHash)
+        {
+            ++segment->mismatches;
+            XUL_REL_WARN("appendHeaders segment ends off its checkpoint " << xul::make_tuple(segment->endHeight, segment->mismatches)
+                << " " << segment->getLastHash() << " " << *node);
+            // the fork may start anywhere in the segment, none of it is trusted
+            segment->headers.clear();
+            m_excludedNodes.insert(node);
+            if (segment->mismatches >= MAX_HEADER_SEGMENT_MISMATCHES)
+                abandon("checkpoint mismatch");
+            return false;
+        }
+        return true;
+    }
+    // complete segments go into the block cache in height order, the lowest one first
+    void insertSegments()
+    {
+        BlockCache* cache = m_nodeManager.getAppInfo()->getBlockCache();
+        while (!m_segments.empty() && m_segments.front()->isComplete() && !m_segments.front()->node)
+        {
+            HeaderSegmentPtr segment = m_segments.front();
+            BlockIndex* block = cache->addBlockIndexes(segment->headers);
+            if (!block || block->getHash() != segment->endHash)
+            {
+                abandon("segment rejected by block cache");
+                return;
+            }
+            XUL_EVENT("insertSegments " << xul::make_tuple(segment->startHeight, segment->endHeight, m_segments.size()));
+            m_segments.pop_front();
+        }
+        if (m_segments.empty())
+        {
+            XUL_REL_EVENT("insertSegments all segments inserted " << cache->getBestHeader()->height);
+            m_active = false;
+        }
+    }
+    void assignSegments()
+    {
+        if (!m_active)
+            return;
+        int inFlight = static_cast<int>(m_requests.size());
+        for (const auto& segment : m_segments)
+        {
+            if (inFlight >= MAX_HEADER_SEGMENTS_IN_FLIGHT)
+                break;
+            if (segment->node || segment->isComplete())
+                continue;
+            Node* node = findIdleNode(segment->endHeight);
+            if (!node)
+                break;
+            requestSegment(segment, node);
+            ++inFlight;
+        }
+    }
+    // the idle node with the lowest round trip time that announced a chain reaching the height
+    Node* findIdleNode(int height)
+    {
+        Node* best = nullptr;
+        for (const auto& item : m_nodes)
+        {
+            Node* node = item.first;
+            const NodeInfo* nodeInfo = node->getNodeInfo();
+            if (nodeInfo->startHeight < height || m_requests.find(node) != m_requests.end()
+                || m_excludedNodes.find(node) != m_excludedNodes.end())
+                continue;
+            if (!best || nodeInfo->rtt < best->getNodeInfo()->rtt)
+                best = node;
+        }
+        return best;
+    }
+    void requestSegment(const HeaderSegmentPtr& segment, Node* node)
+    {
+        assert(!segment->node && m_requests.find(node) == m_requests.end());
+        segment->node = node;
+        segment->requestTime.sync();
+        m_requests[node] = segment;
+        std::vector<uint256> hashes(1, segment->getLastHash());
+        node->requestHeaders(std::move(hashes), segment->endHash);
+    }
+    // a late answer to the request is recognized and dropped instead of reaching the block cache unlinked
+    void dropRequest(Node* node)
+    {
+        auto iter = m_requests.find(node);
+        assert(iter != m_requests.end());
+        m_lateRequests[node] = iter->second->getLastHash();
+        iter->second->node = nullptr;
+        m_requests.erase(iter);
+    }
+    void abandon(const char* reason)
+    {
+        XUL_REL_WARN("abandon parallel header sync " << reason << " " << m_segments.size());
+        m_active = false;
+        m_segments.clear();
+        while (!m_requests.empty())
+        {
+            dropRequest(m_requests.begin()->first);
+        }
+    }
+
+private:
+    XUL_LOGGER_DEFINE();
+    NodeManager& m_nodeManager;
+    boost::intrusive_ptr<Validator> m_validator;
+    NodeMap m_nodes;
+    // in height order, inserted segments are removed from the front
+    std::deque<HeaderSegmentPtr> m_segments;
+    std::map<Node*, HeaderSegmentPtr> m_requests;
+    // the hash the dropped request of each node continued from
+    std::map<Node*, uint256> m_lateRequests;
+    // nodes that failed a segment are not asked for another one
+    std::set<Node*> m_excludedNodes;
+    // nodes that let a segment request time out once, a second timeout excludes them
+    std::set<Node*> m_timedOutNodes;
+    bool m_built;
+    bool m_active;
+    xul::time_counter m_lastProgressTime;
+};
+
+
+HeaderSegmentScheduler* createHeaderSegmentScheduler(NodeManager& nodeManager)
+{
+    return new HeaderSegmentSchedulerImpl(nodeManager);
+}
+
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <vector>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+class NodeManager;
+class Node;
+class BlockHeader;
+
+/**
+ * Fetches the headers below the last checkpoint of ChainParams from several nodes at once. The checkpoints cut
+ * that range into segments. Each segment is asked from one node with getheaders from its lower anchor and a stop
+ * at its upper anchor, up to MAX_HEADER_SEGMENTS_IN_FLIGHT of them at a time. A segment goes into the block cache
+ * only once its headers link up from one anchor to the other, and only after every segment below it. A node whose
+ * headers fail their proof of work is dropped, a node that times out twice gets no more segments. A segment that
+ * ends off its anchor MAX_HEADER_SEGMENT_MISMATCHES times means the checkpoints do not match the network, parallel
+ * sync then gives up and the single headers requester of BlockSynchronizer takes over. Main io service only.
+ */
+class HeaderSegmentScheduler : public xul::object
+{
+public:
+    // false once every segment is inserted or parallel sync gave up
+    virtual bool isActive() const = 0;
+    virtual void addNode(Node* node) = 0;
+    virtual void removeNode(Node* node) = 0;
+    // returns false if the headers are not the answer to a segment request of the node
+    virtual bool handleHeaders(std::vector<BlockHeader>& headers, Node* node) = 0;
+    virtual void onTick(int64_t times) = 0;
+};
+
+HeaderSegmentScheduler* createHeaderSegmentScheduler(NodeManager& nodeManager);
+
+}
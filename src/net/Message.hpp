@@ -9,6 +9,8 @@ namespace xbtc {
 
 
 const int PROTOCOL_HEADER_SIZE = 24;
+// largest payload accepted from a peer, a block at the serialized size limit
+const uint32_t MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
 
 class MessageHeader
 {
@@ -11,11 +11,17 @@
 #include <xul/io/data_input_stream.hpp>
 
 #include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <string.h>
 
 
 namespace xbtc {
 
 
+// most messages fit in the smallest buffer, larger ones are encoded again into doubled buffers
+const size_t MIN_MESSAGE_BUFFER_SIZE = 64 * 1024;
+const size_t MAX_MESSAGE_BUFFER_SIZE = 8 * 1024 * 1024;
+
 inline bool writeMessageCommand(xul::data_output_stream& os, const std::string& msgtype)
 {
     const int max_command_size = 12;
@@ -33,20 +39,36 @@ inline bool writeMessageCommand(xul::data_output_stream& os, const std::string&
 class MessageEncoderImpl : public xul::object_impl<MessageEncoder>
 {
 public:
-    explicit MessageEncoderImpl(uint32_t protocolMagic) : m_protocolMagic(protocolMagic)
+    explicit MessageEncoderImpl(uint32_t protocolMagic, BufferPool* bufferPool) : m_protocolMagic(protocolMagic), m_bufferPool(bufferPool)
     {
         XUL_LOGGER_INIT("MessageEncoder");
         XUL_DEBUG("new");
-        m_buffer.resize(1*1024*1024);
     }
 
-    virtual const uint8_t* getData() const
+    virtual PooledBuffer encode(const Message& msg)
     {
-        return m_buffer.data();
+        for (size_t bufsize = MIN_MESSAGE_BUFFER_SIZE; bufsize <= MAX_MESSAGE_BUFFER_SIZE; bufsize *= 2)
+        {
+            PooledBuffer buf = m_bufferPool->allocate(bufsize);
+            uint8_t* data = reinterpret_cast<uint8_t*>(&(*buf)[0]);
+            int size = doEncode(msg, data, buf->size());
+            if (size < 0)
+                return PooledBuffer();
+            if (size > 0)
+            {
+                buf->resize(size);
+                return buf;
+            }
+            bufsize = buf->size();
+        }
+        XUL_WARN("encode message too large " << msg.getMessageType());
+        return PooledBuffer();
     }
-    virtual int encode(const Message& msg)
+
+private:
+    int doEncode(const Message& msg, uint8_t* data, size_t capacity)
     {
-        xul::memory_data_output_stream os(m_buffer.data(), m_buffer.size(), false);
+        xul::memory_data_output_stream os(data, capacity, false);
         os.write_uint32(m_protocolMagic);
         if (!writeMessageCommand(os, msg.getMessageType()))
         {
@@ -59,11 +81,16 @@ public:
         os.write_uint32(0);
         int payloadPos = os.position();
         msg.write_object(os);
+        if (!os.good())
+        {
+            // buffer overflow, try again with a larger one
+            return 0;
+        }
         int totalSize = os.position();
         int payloadSize = totalSize - payloadPos;
         os.seek(lenthPos);
         os.write_uint32(payloadSize);
-        uint256 checksum = Hasher256::hash(m_buffer.data() + payloadPos, payloadSize);
+        uint256 checksum = Hasher256::hash(data + payloadPos, payloadSize);
         os.write_bytes(&checksum[0], 4);
         os.seek(totalSize);
         return totalSize;
@@ -71,14 +98,14 @@ public:
 
 protected:
     XUL_LOGGER_DEFINE();
-    xul::byte_buffer m_buffer;
     const uint32_t m_protocolMagic;
+    boost::intrusive_ptr<BufferPool> m_bufferPool;
 };
 
 class CheckedMessageDecoderListener : public MessageDecoderListener
 {
 public:
-    virtual void onMessageDecoded(const MessageHeader& header, const std::vector<uint8_t>& payload)
+    virtual void onMessageDecoded(const MessageHeader& header, const MessagePayload& payload)
     {
 //        assert(false);
     }
@@ -89,32 +116,36 @@ public:
     }
 };
 
+/**
+ * Messages lying completely within a received chunk are decoded right out of the socket's receive buffer.
+ * Only a message split across chunks is assembled, in a pooled buffer sized for the whole message once its
+ * header is in, so every byte of it is copied exactly once and nothing is moved when more data arrives.
+ */
 class MessageDecoderImpl : public xul::object_impl<MessageDecoder>
 {
 public:
-    explicit MessageDecoderImpl(uint32_t protocolMagic) : m_protocolMagic(protocolMagic)
+    explicit MessageDecoderImpl(uint32_t protocolMagic, BufferPool* bufferPool)
+        : m_protocolMagic(protocolMagic), m_bufferPool(bufferPool), m_pendingSize(0), m_messageSize(0)
     {
         setListener(nullptr);
     }
     virtual bool decode(const uint8_t* data, int size)
     {
-        XUL_APP_DEBUG("MessageDecoder.decode buffer " << xul::make_tuple(m_buffer.size(), size));
-        const uint8_t* buf = data;
-        int bufsize = size;
-        if (!m_buffer.empty())
+        XUL_APP_DEBUG("MessageDecoder.decode buffer " << xul::make_tuple(m_pendingSize, m_messageSize, size));
+        while (size > 0)
         {
-            m_buffer.insert(m_buffer.end(), data, data + size);
-            buf = m_buffer.data();
-            bufsize = m_buffer.size();
-            XUL_APP_DEBUG("MessageDecoder.decode append to buffer " << xul::make_tuple(m_buffer.size(), size));
+            int used = m_pendingSize > 0 ? 0 : decodeMessages(data, size);
+            if (used == 0)
+            {
+                // continues or starts the message split across received chunks
+                used = appendPending(data, size);
+            }
+            if (used < 0)
+                return false;
+            assert(used <= size);
+            data += used;
+            size -= used;
         }
-        int processedSize = decodeMessages(buf, bufsize);
-        if (processedSize < 0)
-            return false;
-        assert(processedSize <= bufsize);
-        std::vector<uint8_t> remaining(buf + processedSize, buf + bufsize);
-        XUL_APP_DEBUG("MessageDecoder.decode remaining " << xul::make_tuple(m_buffer.size(), size) << " " << xul::make_tuple(processedSize, bufsize, remaining.size()));
-        m_buffer.swap(remaining);
         return true;
     }
     virtual void setListener(MessageDecoderListener* listener)
@@ -123,12 +154,51 @@ public:
     }
 
 private:
+    // takes bytes of the message being assembled, decodes it once complete, returns the bytes used
+    int appendPending(const uint8_t* data, int size)
+    {
+        size_t targetSize = m_messageSize > 0 ? m_messageSize : PROTOCOL_HEADER_SIZE;
+        size_t used = std::min<size_t>(targetSize - m_pendingSize, size);
+        if (!m_pending || m_pending->size() < targetSize)
+        {
+            PooledBuffer buf = m_bufferPool->allocate(targetSize);
+            if (m_pendingSize > 0)
+                memcpy(&(*buf)[0], m_pending->data(), m_pendingSize);
+            m_pending = buf;
+        }
+        memcpy(&(*m_pending)[m_pendingSize], data, used);
+        m_pendingSize += used;
+        if (m_pendingSize < targetSize)
+            return used;
+        const uint8_t* pending = reinterpret_cast<const uint8_t*>(m_pending->data());
+        if (m_messageSize == 0)
+        {
+            // the header is complete, the rest of the message goes into a buffer of its full size
+            MessageHeader header;
+            if (!readHeader(pending, m_pendingSize, header))
+                return -1;
+            m_messageSize = header.length + PROTOCOL_HEADER_SIZE;
+            if (m_messageSize > m_pendingSize)
+                return used;
+        }
+        // a large buffer goes back to the pool for the next large message of any peer once it is decoded
+        PooledBuffer message;
+        message.swap(m_pending);
+        size_t messageSize = m_pendingSize;
+        m_pendingSize = 0;
+        m_messageSize = 0;
+        int msgsize = decodeOneMessage(pending, messageSize, message);
+        if (msgsize < 0)
+            return msgsize;
+        assert(msgsize == messageSize);
+        return used;
+    }
     int decodeMessages(const uint8_t* data, int size)
     {
         int decodedSize = 0;
         while (decodedSize < size)
         {
-            int msgsize = decodeOneMessage(data + decodedSize, size - decodedSize);
+            int msgsize = decodeOneMessage(data + decodedSize, size - decodedSize, PooledBuffer());
             if (msgsize < 0)
                 return msgsize;
             if (msgsize == 0)
@@ -137,26 +207,30 @@ private:
         }
         return decodedSize;
     }
-    int decodeOneMessage(const uint8_t* data, int size)
+    bool readHeader(const uint8_t* data, int size, MessageHeader& header)
     {
-        if (size < PROTOCOL_HEADER_SIZE)
-        {
-//            assert(false);
-            return 0;
-        }
-        MessageHeader header;
         xul::memory_data_input_stream is(data, size, false);
         if (!header.read_object(is))
         {
             assert(false);
-            return 0;
+            return false;
         }
-        if (header.magic != m_protocolMagic)
+        if (header.magic != m_protocolMagic || header.length > MAX_PROTOCOL_MESSAGE_LENGTH)
         {
-            assert(false);
-            is.set_bad();
-            return -1;
+            XUL_APP_REL_WARN("MessageDecoder.readHeader bad header " << xul::make_tuple(header.magic, header.length) << " " << header.command);
+            return false;
+        }
+        return true;
+    }
+    int decodeOneMessage(const uint8_t* data, int size, const PooledBuffer& buffer)
+    {
+        if (size < PROTOCOL_HEADER_SIZE)
+        {
+            return 0;
         }
+        MessageHeader header;
+        if (!readHeader(data, size, header))
+            return -1;
         if (size < header.length + PROTOCOL_HEADER_SIZE)
         {
             return 0;
@@ -167,30 +241,41 @@ private:
         if (checksumVal != header.checksum)
         {
             assert(false);
-            is.set_bad();
             return -2;
         }
-        std::vector<uint8_t> payload;
-        payload.assign(payloadData, payloadData + header.length);
-        m_listener->onMessageDecoded(header, payload);
+        m_listener->onMessageDecoded(header, MessagePayload(payloadData, header.length, buffer));
         return header.length + PROTOCOL_HEADER_SIZE;
     }
 
 private:
-    xul::openssl_sha256_hasher m_hasher;
     MessageDecoderListener* m_listener;
-    std::vector<uint8_t> m_buffer;
     const uint32_t m_protocolMagic;
+    boost::intrusive_ptr<BufferPool> m_bufferPool;
+    // the message split across received chunks, m_messageSize is 0 until its header is complete
+    PooledBuffer m_pending;
+    size_t m_pendingSize;
+    size_t m_messageSize;
 };
 
-MessageEncoder* createMessageEncoder(uint32_t protocolMagic)
+MessagePayload retainMessagePayload(const MessagePayload& payload, BufferPool* bufferPool)
+{
+    if (payload.buffer)
+        return payload;
+    PooledBuffer buf = bufferPool->allocate(payload.size);
+    buf->resize(payload.size);
+    if (payload.size > 0)
+        memcpy(&(*buf)[0], payload.data, payload.size);
+    return MessagePayload(reinterpret_cast<const uint8_t*>(buf->data()), payload.size, buf);
+}
+
+MessageEncoder* createMessageEncoder(uint32_t protocolMagic, BufferPool* bufferPool)
 {
-    return new MessageEncoderImpl(protocolMagic);
+    return new MessageEncoderImpl(protocolMagic, bufferPool);
 }
 
-MessageDecoder* createMessageDecoder(uint32_t protocolMagic)
+MessageDecoder* createMessageDecoder(uint32_t protocolMagic, BufferPool* bufferPool)
 {
-    return new MessageDecoderImpl(protocolMagic);
+    return new MessageDecoderImpl(protocolMagic, bufferPool);
 }
 
 }
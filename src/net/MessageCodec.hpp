@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Message.hpp"
+#include "util/BufferPool.hpp"
 #include <xul/lang/object.hpp>
 #include <vector>
 #include <stdint.h>
@@ -14,8 +15,8 @@ class Message;
 class MessageEncoder : public xul::object
 {
 public:
-    virtual const uint8_t* getData() const = 0;
-    virtual int encode(const Message& msg) = 0;
+    // returns the complete wire message, or null if it can not be encoded
+    virtual PooledBuffer encode(const Message& msg) = 0;
 };
 
 class MessageHolder : public xul::object
@@ -25,10 +26,30 @@ public:
     std::vector<uint8_t> payload;
 };
 
+/**
+ * Payload of a decoded message. A message assembled from several received chunks lives in a pooled buffer,
+ * which the payload holds; otherwise buffer is null and data points into the socket's receive buffer, valid
+ * only during onMessageDecoded.
+ */
+class MessagePayload
+{
+public:
+    const uint8_t* data;
+    size_t size;
+    PooledBuffer buffer;
+
+    MessagePayload(const uint8_t* d, size_t s, const PooledBuffer& buf) : data(d), size(s), buffer(buf)
+    {
+    }
+};
+
+// a payload that can be kept after onMessageDecoded, the bytes are copied only if nothing holds them yet
+MessagePayload retainMessagePayload(const MessagePayload& payload, BufferPool* bufferPool);
+
 class MessageDecoderListener
 {
 public:
-    virtual void onMessageDecoded(const MessageHeader& header, const std::vector<uint8_t>& payload) = 0;
+    virtual void onMessageDecoded(const MessageHeader& header, const MessagePayload& payload) = 0;
 };
 
 class MessageDecoder : public xul::object
@@ -39,8 +60,8 @@ public:
 };
 
 
-MessageEncoder* createMessageEncoder(uint32_t protocolMagic);
-MessageDecoder* createMessageDecoder(uint32_t protocolMagic);
+MessageEncoder* createMessageEncoder(uint32_t protocolMagic, BufferPool* bufferPool);
+MessageDecoder* createMessageDecoder(uint32_t protocolMagic, BufferPool* bufferPool);
 
 
 }
@@ -8,8 +8,11 @@
 #include <xul/lang/object_impl.hpp>
 #include <xul/net/tcp_socket.hpp>
 #include <xul/net/inet_socket_address.hpp>
+#include <xul/net/io_services.hpp>
 #include <xul/log/log.hpp>
 
+#include <functional>
+
 
 namespace xbtc {
 
@@ -32,8 +35,20 @@ public:
     virtual bool sendMessage(const Message& msg)
     {
         XUL_DEBUG("sendMessage " << msg.getMessageType());
-        int size = m_messageEncoder->encode(msg);
-        return m_nodeInfo->socket->send(m_messageEncoder->getData(), size);
+        // encoded on the calling thread, the socket is only touched on the net io service of the node
+        PooledBuffer data = m_messageEncoder->encode(msg);
+        if (!data)
+            return false;
+        xul::io_services::post(m_nodeInfo->ios.get(), std::bind(&MessageSenderImpl::doSend, m_nodeInfo, data));
+        return true;
+    }
+
+private:
+    // net io service
+    static void doSend(const boost::intrusive_ptr<NodeInfo>& nodeInfo, const PooledBuffer& data)
+    {
+        // the socket copies the data into its send queue, so the buffer goes back to the pool right away
+        nodeInfo->socket->send(reinterpret_cast<const uint8_t*>(data->data()), data->size());
     }
 
 private:
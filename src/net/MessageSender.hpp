@@ -15,6 +15,7 @@ class MessageEncoder;
 class MessageSender : public xul::object
 {
 public:
+    // may be called on any thread, the message is queued on the net io service of the node, false if it can not be encoded
     virtual bool sendMessage(const Message& msg) = 0;
 };
 
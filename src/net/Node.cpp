@@ -7,6 +7,7 @@
 #include "MessageCodec.hpp"
 #include "Messages.hpp"
 #include "NodePool.hpp"
+#include "BlockDecoder.hpp"
 #include "flags.hpp"
 #include "storage/BlockCache.hpp"
 #include "storage/BlockChain.hpp"
@@ -17,8 +18,12 @@
 #include <xul/net/tcp_socket.hpp>
 #include <xul/log/log.hpp>
 #include <xul/io/data_input_stream.hpp>
+#include <xul/net/io_services.hpp>
 
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <unordered_map>
 
 namespace xbtc {
@@ -31,19 +36,38 @@ std::ostream& operator<<(std::ostream& os, const Node& node)
     return os << node.getNodeInfo()->nodeAddress.address;
 }
 
+/**
+ * The socket callbacks and the message decoder run on the net io service of the node, which hands every decoded
+ * message to the main io service where the protocol state lives. The socket stops reading while too many of
+ * those messages wait, and is resumed from the main io service.
+ */
 class NodeImpl : public xul::object_impl<Node>, public xul::tcp_socket_listener, public MessageDecoderListener
 {
 public:
     typedef std::function<void (const MessageHeader&, xul::data_input_stream&)> MessageHandlerFunction;
     typedef std::unordered_map<std::string, MessageHandlerFunction> MessageHandlerFunctionTable;
+    // a received block message, kept in arrival order until it and all before it are decoded
+    class DecodingBlock
+    {
+    public:
+        BlockPtr block;
+        bool decoded;
+
+        DecodingBlock() : decoded(false) {}
+    };
+    typedef std::shared_ptr<DecodingBlock> DecodingBlockPtr;
+
     explicit NodeImpl(NodeInfo* nodeInfo, NodeManager& nodeManager)
         : m_nodeInfo(nodeInfo)
         , m_nodeManager(nodeManager)
+        , m_closed(false)
+        , m_receivePaused(false)
+        , m_queuedMessages(0)
+        , m_queuedBlocks(0)
+        , m_waitingForDecoder(false)
     {
         XUL_LOGGER_INIT("Node");
         XUL_DEBUG("new " << *this);
-        m_nodeInfo->socket->set_listener(this);
-        m_nodeInfo->messageDecoder->setListener(this);
         XBTC_REG_MSG_HANDLER(version);
         XBTC_REG_MSG_HANDLER(verack);
         XBTC_REG_MSG_HANDLER(addr);
@@ -53,7 +77,6 @@ public:
         XBTC_REG_MSG_HANDLER(getblocks);
         XBTC_REG_MSG_HANDLER(getheaders);
         XBTC_REG_MSG_HANDLER(tx);
-        XBTC_REG_MSG_HANDLER(block);
         XBTC_REG_MSG_HANDLER(headers);
         XBTC_REG_MSG_HANDLER(getaddr);
         XBTC_REG_MSG_HANDLER(mempool);
@@ -81,6 +104,8 @@ public:
     virtual void start()
     {
         XUL_DEBUG("start " << *this);
+        boost::intrusive_ptr<NodeImpl> self(this);
+        xul::io_services::post(m_nodeInfo->ios.get(), [self]() { self->attach(); });
         send_getaddr();
         send_sendheaders();
         if (m_nodeInfo->nodeAddress.services & ServiceFlags::NODE_WITNESS)
@@ -92,18 +117,22 @@ public:
     }
     virtual void close()
     {
-        m_nodeInfo->socket->destroy();
+        m_closed = true;
+        // holds the node until the socket is gone, a callback may be running on the net io service right now
+        boost::intrusive_ptr<NodeImpl> self(this);
+        xul::io_services::post(m_nodeInfo->ios.get(), [self]() { self->m_nodeInfo->socket->destroy(); });
     }
     virtual NodeSyncInfo& getSyncInfo()
     {
         return m_syncInfo;
     }
-    virtual void requestHeaders(std::vector<uint256>&& hashes)
+    virtual void requestHeaders(std::vector<uint256>&& hashes, const uint256& hashStop)
     {
-        XUL_EVENT("requestHeaders " << hashes.size() << " " << *this);
+        XUL_EVENT("requestHeaders " << xul::make_tuple(hashes.size(), hashStop.is_null()) << " " << *this);
         GetHeadersMessage msg;
         msg.version = m_nodeManager.getAppInfo()->getHostNodeInfo()->version;
         msg.hashes = hashes;
+        msg.hashStop = hashStop;
         sendMessage(msg);
     }
     virtual void requestBlocks(const std::vector<BlockIndex*>& blocks)
@@ -133,8 +162,11 @@ public:
         assert(false);
 	}
 
+    // main io service
     void handleError(int errcode)
     {
+        if (m_closed)
+            return;
         if (!m_nodeInfo->inbound)
         {
             if (m_nodeManager.getAppInfo()->getNodePool())
@@ -146,26 +178,130 @@ public:
         close();
         m_nodeManager.removeNode(this);
     }
+    // net io service
 	virtual void on_socket_receive( xul::tcp_socket* sender, unsigned char* data, size_t size ) 
 	{
         XUL_DEBUG("on_socket_receive " << m_nodeInfo->socketAddress << " " << size);
-        m_nodeInfo->lastDataReceiveTime.sync();
+        if (m_closed)
+            return;
         if (!m_nodeInfo->messageDecoder->decode(data, size))
         {
             // bad message data
-            handleError(-1);
+            postError(-1);
             return;
         }
-		receivePacket();
+        continueReceive();
 	}
 
 	virtual void on_socket_receive_failed( xul::tcp_socket* sender, int errcode ) 
 	{
 		XUL_DEBUG("on_socket_receive_failed " << m_nodeInfo->socketAddress << " " << errcode);
-		handleError(-2);
+		postError(-2);
 	}
-    virtual void onMessageDecoded(const MessageHeader& header, const std::vector<uint8_t>& payload)
+    virtual void onMessageDecoded(const MessageHeader& header, const MessagePayload& payload)
     {
+        if (m_closed)
+            return;
+        ++m_queuedMessages;
+        if (header.command == MSGTYPE_block)
+            ++m_queuedBlocks;
+        boost::intrusive_ptr<NodeImpl> self(this);
+        MessagePayload retained = retainMessagePayload(payload, m_nodeManager.getAppInfo()->getBufferPool());
+        xul::io_services::post(m_nodeManager.getAppInfo()->getIOService(), [self, header, retained]() { self->handleMessage(header, retained); });
+    }
+
+private:
+    // net io service
+    void attach()
+    {
+        if (m_closed)
+            return;
+        m_nodeInfo->socket->set_listener(this);
+        m_nodeInfo->messageDecoder->setListener(this);
+        std::vector<std::pair<MessageHeader, MessagePayload> > messages;
+        messages.swap(m_nodeInfo->earlyMessages);
+        for (const auto& msg : messages)
+        {
+            onMessageDecoded(msg.first, msg.second);
+        }
+        continueReceive();
+    }
+	void receivePacket()
+	{
+        if (m_closed)
+            return;
+        m_nodeInfo->socket->receive(20 * 1024);
+	}
+    void postError(int errcode)
+    {
+        boost::intrusive_ptr<NodeImpl> self(this);
+        xul::io_services::post(m_nodeManager.getAppInfo()->getIOService(), [self, errcode]() { self->handleError(errcode); });
+    }
+    bool isReceiveBlocked() const
+    {
+        return m_queuedMessages >= MAX_QUEUED_MESSAGES_PER_PEER || m_queuedBlocks >= MAX_DECODING_BLOCKS_PER_PEER
+            || m_nodeManager.getBlockDecoder()->isFull();
+    }
+    // reads on unless too many messages of this node wait for the main io service or the block decoder is full
+    void continueReceive()
+    {
+        // set before checking, so that resumeReceive either sees the pause or this sees the room it made
+        m_receivePaused = true;
+        if (isReceiveBlocked())
+        {
+            if (m_nodeManager.getBlockDecoder()->isFull())
+            {
+                boost::intrusive_ptr<NodeImpl> self(this);
+                xul::io_services::post(m_nodeManager.getAppInfo()->getIOService(), [self]() { self->resumeReceive(); });
+            }
+            return;
+        }
+        if (m_receivePaused.exchange(false))
+            receivePacket();
+    }
+
+    // main io service
+    void resumeReceive()
+    {
+        if (m_closed || !m_receivePaused)
+            return;
+        BlockDecoder* decoder = m_nodeManager.getBlockDecoder();
+        if (decoder->isFull())
+        {
+            if (!m_waitingForDecoder)
+            {
+                m_waitingForDecoder = true;
+                boost::intrusive_ptr<NodeImpl> self(this);
+                decoder->waitForRoom([self]() {
+                    self->m_waitingForDecoder = false;
+                    self->resumeReceive();
+                });
+            }
+            return;
+        }
+        if (isReceiveBlocked() || !m_receivePaused.exchange(false))
+            return;
+        boost::intrusive_ptr<NodeImpl> self(this);
+        xul::io_services::post(m_nodeInfo->ios.get(), [self]() { self->receivePacket(); });
+    }
+    void handleMessage(const MessageHeader& header, const MessagePayload& payload)
+    {
+        if (m_closed)
+            return;
+        --m_queuedMessages;
+        // both are read on the main io service, so the receive time is taken here rather than by the socket
+        m_nodeInfo->lastDataReceiveTime.sync();
+        m_nodeInfo->lastMessageReceiveTime.sync();
+        dispatchMessage(header, payload);
+        resumeReceive();
+    }
+    void dispatchMessage(const MessageHeader& header, const MessagePayload& payload)
+    {
+        if (header.command == MSGTYPE_block)
+        {
+            handleBlockPayload(header, payload);
+            return;
+        }
         auto iter = m_handlers.find(header.command);
         if (iter == m_handlers.end())
         {
@@ -173,19 +309,44 @@ public:
             assert(false);
             return;
         }
-        m_nodeInfo->lastMessageReceiveTime.sync();
-        XUL_DEBUG("onMessageDecoded msg " << header.command << " " << header.length);
+        XUL_DEBUG("handleMessage " << header.command << " " << header.length);
         auto handler = iter->second;
         uint8_t dummybuf[1];
-        xul::memory_data_input_stream is(payload.empty() ? dummybuf : payload.data(), payload.size(), false);
+        xul::memory_data_input_stream is(payload.size == 0 ? dummybuf : payload.data, payload.size, false);
         handler(header, is);
     }
-
-private:
-	void receivePacket()
-	{
-        m_nodeInfo->socket->receive(20 * 1024);
-	}
+    void handleBlockPayload(const MessageHeader& header, const MessagePayload& payload)
+    {
+        XUL_DEBUG("handleBlockPayload " << header.length << " " << *this);
+        DecodingBlockPtr item = std::make_shared<DecodingBlock>();
+        m_decodingBlocks.push_back(item);
+        boost::intrusive_ptr<NodeImpl> self(this);
+        m_nodeManager.getBlockDecoder()->decode(payload, [self, item](const BlockPtr& block) {
+            item->block = block;
+            item->decoded = true;
+            self->onBlockDecoded();
+        });
+    }
+    // blocks are handed on in the order they arrived, a block decoded early waits for the ones before it
+    void onBlockDecoded()
+    {
+        while (!m_decodingBlocks.empty() && m_decodingBlocks.front()->decoded)
+        {
+            DecodingBlockPtr item = m_decodingBlocks.front();
+            m_decodingBlocks.pop_front();
+            --m_queuedBlocks;
+            if (m_closed)
+                continue;
+            if (!item->block)
+            {
+                handleError(-1);
+                continue;
+            }
+            m_nodeManager.getBlockSynchronizer()->handleBlock(item->block.get(), this);
+            XUL_EVENT("onBlockDecoded " << item->block->transactions.size() << " " << *this);
+        }
+        resumeReceive();
+    }
     void sendMessage(const Message& msg)
     {
         m_nodeInfo->messageSender->sendMessage(msg);
@@ -266,7 +427,23 @@ private:
     }
     void handleCommand_inv(const MessageHeader& header, xul::data_input_stream& is)
     {
-        XUL_DEBUG("handleCommand_inv " << *this);
+        InvMessage msg;
+        is >> msg;
+        if (!is)
+        {
+            handleError(-1);
+            return;
+        }
+        XUL_DEBUG("handleCommand_inv " << msg.inventory.size() << " " << *this);
+        // the last announced block is the tip of the node
+        for (auto iter = msg.inventory.rbegin(); iter != msg.inventory.rend(); ++iter)
+        {
+            if ((iter->type & ~MSG_WITNESS_FLAG) == MSG_BLOCK)
+            {
+                m_nodeManager.getBlockSynchronizer()->handleBlockAnnouncement(iter->hash, this);
+                break;
+            }
+        }
     }
     void handleCommand_getdata(const MessageHeader& header, xul::data_input_stream& is)
     {
@@ -288,20 +465,6 @@ private:
     {
         XUL_DEBUG("handleCommand_tx " << *this);
     }
-    void handleCommand_block(const MessageHeader& header, xul::data_input_stream& is)
-    {
-        BlockMessage msg;
-        is >> msg;
-        if (!is)
-        {
-            handleError(-1);
-            assert(false);
-            return;
-        }
-        msg.block->header.computeHash();
-        m_nodeManager.getBlockSynchronizer()->handleBlock(msg.block.get(), this);
-        XUL_EVENT("handleCommand_block " << msg.block->transactions.size() << " " << *this);
-    }
     void handleCommand_headers(const MessageHeader& header, xul::data_input_stream& is)
     {
         HeadersMessage msg;
@@ -395,6 +558,16 @@ private:
     NodeManager& m_nodeManager;
     MessageHandlerFunctionTable m_handlers;
     NodeSyncInfo m_syncInfo;
+    std::atomic<bool> m_closed;
+    // no receive is outstanding on the socket while set, whoever clears it issues the next one
+    std::atomic<bool> m_receivePaused;
+    // posted to the main io service and not handled yet
+    std::atomic<int> m_queuedMessages;
+    // posted and not yet handed to the block synchronizer
+    std::atomic<int> m_queuedBlocks;
+    // main io service only
+    bool m_waitingForDecoder;
+    std::deque<DecodingBlockPtr> m_decodingBlocks;
 };
 
 
@@ -21,7 +21,8 @@ public:
     virtual void start() = 0;
     virtual void close() = 0;
     virtual NodeSyncInfo& getSyncInfo() = 0;
-    virtual void requestHeaders(std::vector<uint256>&& hashes) = 0;
+    // a null hashStop asks for as many headers as the node sends in one message
+    virtual void requestHeaders(std::vector<uint256>&& hashes, const uint256& hashStop) = 0;
     virtual void requestBlocks(const std::vector<BlockIndex*>& blocks) = 0;
 };
 
@@ -31,6 +31,7 @@ public:
 
     explicit NodeConnectorImpl(NodeManager* mgr)
         : m_nodeManager(mgr)
+        , m_nextNetIOService(0)
     {
         XUL_LOGGER_INIT("PeerConnector");
         XUL_DEBUG("new");
@@ -132,10 +133,14 @@ private:
             return;
         }
 
-        NodeInfo* nodeInfo = createOutboundNodeInfo(m_nodeManager->getAppInfo()->getIOService()->create_tcp_socket(), addr);
-        PendingNode* conn = createPendingNode(nodeInfo, m_nodeManager->getAppInfo());
+        // new connections go round the net io services, a node keeps the one its socket was created on
+        AppInfo* appInfo = m_nodeManager->getAppInfo();
+        xul::io_service* ios = appInfo->getNetIOService(m_nextNetIOService++ % appInfo->getNetIOServiceCount());
+        NodeInfo* nodeInfo = createOutboundNodeInfo(ios, ios->create_tcp_socket(), addr);
+        PendingNode* conn = createPendingNode(nodeInfo, appInfo);
         conn->setHandler(this);
         m_nodes[conn] = conn;
+        conn->start();
         m_nodeManager->getAppInfo()->getNodePool()->setPeerConnecting(&addr);
     }
 
@@ -144,6 +149,7 @@ private:
     boost::intrusive_ptr<NodeManager> m_nodeManager;
     PendingNodeMap m_nodes;
     PendingNodeMap m_deadNodes;
+    size_t m_nextNetIOService;
 };
 
 
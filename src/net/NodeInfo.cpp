@@ -17,13 +17,15 @@ namespace xbtc {
 class NodeInfoImpl : public xul::object_impl<NodeInfo>
 {
 public:
-    explicit NodeInfoImpl(xul::tcp_socket* sock, bool inboundIn, const PeerAddress& peerAddr, const xul::inet_socket_address& sockAddr)
+    explicit NodeInfoImpl(xul::io_service* iosIn, xul::tcp_socket* sock, bool inboundIn, const PeerAddress& peerAddr, const xul::inet_socket_address& sockAddr)
     {
+        ios = iosIn;
         socket = sock;
         socketAddress = sockAddr;
         inbound = inboundIn;
         connected = false;
         version = 0;
+        startHeight = 0;
         nodeAddress.address = peerAddr;
         rtt = 0;
     }
@@ -93,16 +95,16 @@ private:
 };
 
 
-NodeInfo* createOutboundNodeInfo(xul::tcp_socket* sock, const PeerAddress& peerAddr)
+NodeInfo* createOutboundNodeInfo(xul::io_service* ios, xul::tcp_socket* sock, const PeerAddress& peerAddr)
 {
-    return new NodeInfoImpl(sock, false, peerAddr, toSocketAddress(peerAddr));
+    return new NodeInfoImpl(ios, sock, false, peerAddr, toSocketAddress(peerAddr));
 }
 
-NodeInfo* createInboundNodeInfo(xul::tcp_socket* sock)
+NodeInfo* createInboundNodeInfo(xul::io_service* ios, xul::tcp_socket* sock)
 {
     xul::inet_socket_address sockAddr;
     sock->get_remote_address(sockAddr);
-    return new NodeInfoImpl(sock, true, PeerAddress(sockAddr.get_ip(), sockAddr.get_port()), sockAddr);
+    return new NodeInfoImpl(ios, sock, true, PeerAddress(sockAddr.get_ip(), sockAddr.get_port()), sockAddr);
 }
 
 HostNodeInfo* createHostNodeInfo() {
@@ -5,19 +5,26 @@
 #include "MessageCodec.hpp"
 #include <xul/net/inet_socket_address.hpp>
 #include <xul/net/tcp_socket.hpp>
+#include <xul/net/io_service.hpp>
 #include <xul/lang/object.hpp>
 #include <xul/lang/object_ptr.hpp>
 #include <xul/util/time_counter.hpp>
 #include <vector>
 #include <string>
+#include <utility>
 
 
 namespace xbtc {
 
 
+/**
+ * The socket and the message decoder of a node are used only on its net io service, ios, the protocol state of
+ * the node lives on the main io service.
+ */
 class NodeInfo : public xul::object
 {
 public:
+    boost::intrusive_ptr<xul::io_service> ios;
     boost::intrusive_ptr<xul::tcp_socket> socket;
     boost::intrusive_ptr<MessageSender> messageSender;
     boost::intrusive_ptr<MessageDecoder> messageDecoder;
@@ -30,8 +37,13 @@ public:
     bool inbound;
     bool connected;
     int version;
+    // height of the chain of the node when it connected, from its version message
+    int startHeight;
     int rtt;
 
+    // decoded after the handshake completed and before the node took over the socket, net io service only
+    std::vector<std::pair<MessageHeader, MessagePayload> > earlyMessages;
+
     const PeerAddress& getPeerAddress() const { return nodeAddress.address; }
 };
 
@@ -46,8 +58,8 @@ public:
     bool headersSynced;
 };
 
-NodeInfo* createOutboundNodeInfo(xul::tcp_socket* sock, const PeerAddress& addr);
-NodeInfo* createInboundNodeInfo(xul::tcp_socket* sock);
+NodeInfo* createOutboundNodeInfo(xul::io_service* ios, xul::tcp_socket* sock, const PeerAddress& addr);
+NodeInfo* createInboundNodeInfo(xul::io_service* ios, xul::tcp_socket* sock);
 HostNodeInfo* createHostNodeInfo();
 
 
@@ -6,6 +6,7 @@
 #include "NodeConnector.hpp"
 #include "AppConfig.hpp"
 #include "BlockSynchronizer.hpp"
+#include "BlockDecoder.hpp"
 #include "storage/ChainParams.hpp"
 
 #include <xul/lang/object_impl.hpp>
@@ -65,7 +66,10 @@ public:
     }
     void stop()
     {
+        if (!m_nameResolver)
+            return;
         m_nameResolver->destroy();
+        m_nameResolver.reset();
     }
     virtual void on_resolver_address(xul::name_resolver* sender, const std::string& name, int errcode, const std::vector<xul::inet4_address>& addrs)
     {
@@ -80,7 +84,7 @@ private:
     void request()
     {
         const auto& seeds = m_appInfo->getChainParams()->dnsSeeds;
-        if (m_times >= seeds.size())
+        if (!m_nameResolver || m_times >= seeds.size())
             return;
         m_nameResolver->async_resolve(seeds[m_times]);
         ++m_times;
@@ -108,6 +112,7 @@ public:
         m_peerDiscoverer = new PeerDiscoverer(m_appInfo.get());
         m_peerDiscoverer->setListener(this);
         m_nodeConnector = createNodeConnector(this);
+        m_blockDecoder = createBlockDecoder(m_appInfo.get());
         m_blockSynchronizer = createBlockSynchronizer(*this);
     }
     virtual ~NodeManagerImpl()
@@ -127,11 +132,19 @@ public:
         {
             m_peerDiscoverer->start();
         }
+        m_blockDecoder->start();
         m_nodeConnector->schedule();
     }
     virtual void stop()
     {
         m_peerDiscoverer->stop();
+        m_nodeConnector->stop();
+        // closed nodes hand nothing more to the block synchronizer
+        while (!m_nodes.empty())
+        {
+            removeNode(m_nodes.begin()->first);
+        }
+        m_blockDecoder->stop();
     }
     virtual void schedule()
     {
@@ -182,6 +195,10 @@ public:
     {
         return m_blockSynchronizer.get();
     }
+    virtual BlockDecoder* getBlockDecoder()
+    {
+        return m_blockDecoder.get();
+    }
 
     virtual void onPeerDiscovered(PeerDiscoverer* sender, const std::vector<xul::inet4_address>& addrs)
     {
@@ -206,6 +223,7 @@ private:
     NodeMap m_deadNodes;
     AddressIndexedNodeMap m_addressIndexedNodes;
     boost::intrusive_ptr<BlockSynchronizer> m_blockSynchronizer;
+    boost::intrusive_ptr<BlockDecoder> m_blockDecoder;
 };
 
 
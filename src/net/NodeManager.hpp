@@ -17,6 +17,7 @@ class NodeInfo;
 class AppInfo;
 class Node;
 class BlockSynchronizer;
+class BlockDecoder;
 
 class NodeManager : public xul::object
 {
@@ -31,6 +32,7 @@ public:
     virtual bool doesNodeAddressConnected(const PeerAddress&) = 0;
     virtual void stop() = 0;
     virtual BlockSynchronizer* getBlockSynchronizer() = 0;
+    virtual BlockDecoder* getBlockDecoder() = 0;
 };
 
 
@@ -2,28 +2,54 @@
 
 #include "data/Block.hpp"
 #include "util/number.hpp"
+#include <xul/util/time_counter.hpp>
+#include <unordered_map>
 
 namespace xbtc {
 
 
 class BlockCache;
 class AppConfig;
+class Node;
+
+// every block requested from some node and not received yet, with the node it was requested from, a null node
+// marks a block received and parked in the reorder buffer until its parent arrives
+typedef std::unordered_map<uint256, Node*> BlockInFlightMap;
 
 class NodeSyncInfo
 {
 public:
-    BlockIndexPtr bestKnownBlock;
+    BlockIndex* bestKnownBlock;
     uint256 lastUnknownBlockHash;
-    BlockIndexPtr lastCommonBlock;
-    BlockIndexPtr lastDownloadBlock;
+    BlockIndex* lastCommonBlock;
     BlockIndexMap requestingBlocks;
+    // set while a block in flight from this node holds back the download window of other nodes
+    bool stalling;
+    xul::time_counter stallingSince;
+    // restarted when a block arrives or a request goes out on an empty pipeline, the download timeout counts from here
+    xul::time_counter downloadingSince;
+    // the blocks in flight timed out and went to other nodes, a second timeout without progress drops the node
+    bool downloadTimedOut;
+    // a getheaders asking how far the chain of the node goes is out, its answer only updates the availability
+    bool probingHeaders;
+    bool headersProbed;
+    xul::time_counter headersProbeTime;
+
+    NodeSyncInfo() : bestKnownBlock(nullptr), lastCommonBlock(nullptr), stalling(false), downloadTimedOut(false)
+        , probingHeaders(false), headersProbed(false)
+    {
+    }
 
     void processBlockAvailability(BlockCache* cache);
     void updateBlockAvailability(const uint256& hash, BlockIndex* block, BlockCache* cache);
-    void findBlocksToDownload(std::vector<BlockIndex*>& blocks, int count, BlockCache* cache, const AppConfig* config);
+    // the next blocks of the download window this node can serve that are neither received nor in flight anywhere,
+    // staller is the node whose block in flight keeps the window from moving when nothing is left to ask for
+    void findBlocksToDownload(std::vector<BlockIndex*>& blocks, int count, BlockCache* cache, const AppConfig* config,
+                              const BlockInFlightMap& blocksInFlight, Node* self, Node*& staller);
     bool isRequestingBlock() const { return !requestingBlocks.empty(); }
     void recordRequestingBlocks(const std::vector<BlockIndex*>& blocks);
-    void removeBlockRecord(const Block* block);
+    // false if the block was not requested from this node
+    bool removeBlockRecord(const uint256& hash);
 };
 
 
@@ -23,11 +23,18 @@
 #include <xul/log/log.hpp>
 #include <xul/util/time_counter.hpp>
 #include <xul/util/random.hpp>
+#include <xul/net/io_services.hpp>
+
+#include <atomic>
 
 
 namespace xbtc {
 
 
+/**
+ * The handshake runs on the net io service of the node, the handler and the node pool are reached on the main
+ * io service. Once verack arrives the socket is left idle until the node takes it over.
+ */
 class PendingNodeImpl : public xul::object_impl<PendingNode>, public xul::tcp_socket_listener, public MessageDecoderListener
 {
 public:
@@ -36,56 +43,47 @@ public:
 		, m_appInfo(appInfo)
 		, m_handler(nullptr)
 		, m_closed(false)
+		, m_handshaked(false)
 	{
 		XUL_LOGGER_INIT("PendingNode");
 		XUL_DEBUG("new");
 		m_nodeInfo->messageSender = createMessageSender(m_nodeInfo.get(), m_appInfo->getMessageEncoder());
-		m_nodeInfo->messageDecoder = createMessageDecoder(appInfo->getChainParams()->protocolMagic);
+		m_nodeInfo->messageDecoder = createMessageDecoder(appInfo->getChainParams()->protocolMagic, appInfo->getBufferPool());
         m_nodeInfo->messageDecoder->setListener(this);
 		m_nodeInfo->socket->set_listener(this);
-		if (!m_nodeInfo->inbound)
-		{
-			m_nodeInfo->socket->connect(m_nodeInfo->socketAddress);
-		}
-		else
-		{
-			receivePacket();
-		}
 	}
 	virtual ~PendingNodeImpl()
 	{
 		XUL_DEBUG("delete");
-		if (!m_nodeInfo->inbound && !m_nodeInfo->connected)
-		{
-			if (m_appInfo->getNodePool())
-			{
-				m_appInfo->getNodePool()->setPeerDisconnected(&m_nodeInfo->nodeAddress.address, 0, false);
-			}
-		}
-		checkClose();
 	}
 
+	virtual void start()
+	{
+		boost::intrusive_ptr<PendingNodeImpl> self(this);
+		xul::io_services::post(m_nodeInfo->ios.get(), [self]() { self->doStart(); });
+	}
 	virtual void close()
 	{
 		XUL_DEBUG("close");
-		//assert(!m_nodeInfo->connected);
-		checkClose();
 		m_closed = true;
-	}
-	void checkClose()
-	{
-		if (!m_nodeInfo->connected)
+		if (!m_nodeInfo->inbound && !m_handshaked)
 		{
-			m_nodeInfo->socket->destroy();
+			if (m_appInfo->getNodePool())
+			{
+				m_appInfo->getNodePool()->setPeerDisconnected(&m_nodeInfo->nodeAddress.address, 0, false);
+			}
 		}
+		boost::intrusive_ptr<PendingNodeImpl> self(this);
+		xul::io_services::post(m_nodeInfo->ios.get(), [self]() { self->checkClose(); });
 	}
 
 	virtual void onTick(int64_t times)
 	{
-		if (m_startTime.get_elapsed32() > 10000 && !m_closed)
+		if (m_startTime.get_elapsed32() > 10000 && !m_closed && !m_handshaked)
 		{
 			XUL_DEBUG("handshake timeout " << m_startTime.get_elapsed32());
-			handleError(-1);
+			boost::intrusive_ptr<PendingNodeImpl> self(this);
+			xul::io_services::post(m_nodeInfo->ios.get(), [self]() { self->handleError(-1); });
 		}
 	}
 	virtual NodeInfo* getNodeInfo()
@@ -98,12 +96,18 @@ public:
         m_handler = handler;
     }
 
-    virtual void onMessageDecoded(const MessageHeader& header, const std::vector<uint8_t>& payload)
+    virtual void onMessageDecoded(const MessageHeader& header, const MessagePayload& payload)
     {
-        assert(header.length == payload.size());
-        XUL_DEBUG("onMessageDecoded " << header.command << " " << payload.size());
+        assert(header.length == payload.size);
+        if (m_nodeInfo->connected)
+        {
+            // already meant for the node, which replays them when it takes over the socket
+            m_nodeInfo->earlyMessages.push_back(std::make_pair(header, retainMessagePayload(payload, m_appInfo->getBufferPool())));
+            return;
+        }
+        XUL_DEBUG("onMessageDecoded " << header.command << " " << payload.size);
         uint8_t dummybuf[1];
-        xul::memory_data_input_stream is(payload.empty() ? dummybuf : payload.data(), payload.size(), false);
+        xul::memory_data_input_stream is(payload.size == 0 ? dummybuf : payload.data, payload.size, false);
         if (header.command == "version")
         {
             handleCommand_version(header, is);
@@ -142,13 +146,18 @@ public:
 	virtual void on_socket_receive( xul::tcp_socket* sender, unsigned char* data, size_t size ) 
 	{
 		XUL_DEBUG("on_socket_receive " << m_nodeInfo->socketAddress << " " << size);
+		if (m_closed)
+			return;
 		if (!m_nodeInfo->messageDecoder->decode(data, size))
         {
             // bad message data
             handleError(-1);
             return;
         }
-		receivePacket();
+		if (!m_nodeInfo->connected)
+		{
+			receivePacket();
+		}
 	}
 
 	virtual void on_socket_receive_failed( xul::tcp_socket* sender, int errcode ) 
@@ -158,6 +167,27 @@ public:
 	}
 
 private:
+	// net io service
+	void doStart()
+	{
+		if (m_closed)
+			return;
+		if (!m_nodeInfo->inbound)
+		{
+			m_nodeInfo->socket->connect(m_nodeInfo->socketAddress);
+		}
+		else
+		{
+			receivePacket();
+		}
+	}
+	void checkClose()
+	{
+		if (!m_nodeInfo->connected)
+		{
+			m_nodeInfo->socket->destroy();
+		}
+	}
     void handleCommand_version(const MessageHeader& header, xul::data_input_stream& is)
     {
         VersionMessage msg;
@@ -169,6 +199,7 @@ private:
         }
         m_nodeInfo->nodeAddress.services = msg.services;
         m_nodeInfo->version = msg.version;
+        m_nodeInfo->startHeight = msg.startHeight;
         m_nodeInfo->userAgent = msg.userAgent;
         XUL_INFO("handleCommand_version " << msg.version << " " << msg.userAgent);
         VerackMessage ackmsg;
@@ -178,7 +209,12 @@ private:
     {
         // make node connected
         m_nodeInfo->connected = true;
-        m_handler->handleConnectionCreated(this);
+        m_handshaked = true;
+        boost::intrusive_ptr<PendingNodeImpl> self(this);
+        xul::io_services::post(m_appInfo->getIOService(), [self]() {
+            if (self->m_handler)
+                self->m_handler->handleConnectionCreated(self.get());
+        });
     }
     void handleCommand_reject(const MessageHeader& header, xul::data_input_stream& is)
 	{
@@ -194,7 +230,17 @@ private:
 	}
     void handleError(int errcode)
     {
-        assert(!m_nodeInfo->connected);
+        // a timeout may be posted while verack is being handled
+        if (m_closed || m_nodeInfo->connected)
+            return;
+        m_closed = true;
+        m_nodeInfo->socket->destroy();
+        boost::intrusive_ptr<PendingNodeImpl> self(this);
+        xul::io_services::post(m_appInfo->getIOService(), std::bind(&PendingNodeImpl::notifyError, self, errcode));
+    }
+    // main io service
+    void notifyError(int errcode)
+    {
         if (!m_nodeInfo->inbound)
         {
             if (m_appInfo->getNodePool())
@@ -203,7 +249,6 @@ private:
             }
         }
 
-        close();
         if (m_handler)
             m_handler->removePendingNode(this);
         else
@@ -240,9 +285,12 @@ private:
 
 	boost::intrusive_ptr<NodeInfo> m_nodeInfo;
 	boost::intrusive_ptr<AppInfo> m_appInfo;
+    // main io service only
     PendingNodeHandler* m_handler;
 	xul::time_counter m_startTime;
-	bool m_closed;
+	std::atomic<bool> m_closed;
+	// m_nodeInfo->connected for the main io service
+	std::atomic<bool> m_handshaked;
 };
 
 
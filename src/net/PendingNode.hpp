@@ -15,6 +15,7 @@ class AppInfo;
 class MessageDecoder;
 
 
+// called on the main io service
 class PendingNodeHandler
 {
 public:
@@ -29,6 +30,8 @@ class PendingNode : public xul::object
 public:
     virtual NodeInfo* getNodeInfo() = 0;
     virtual void setHandler(PendingNodeHandler *) = 0;
+    // connects or starts reading on the net io service of the node
+    virtual void start() = 0;
     virtual void close() = 0;
     virtual void onTick(int64_t times) = 0;
 };
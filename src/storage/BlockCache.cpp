@@ -3,42 +3,153 @@
 #include "BlockChain.hpp"
 #include "Validator.hpp"
 #include "CoinView.hpp"
+#include "TxIndex.hpp"
 #include "data/Block.hpp"
+#include "data/BlockIndexTable.hpp"
 #include "AppConfig.hpp"
 #include "ChainParams.hpp"
 #include "Compatibility.hpp"
 #include "Consensus.hpp"
+#include "db.hpp"
+#include "BlockIndexSnapshot.hpp"
+#include "util/Parallel.hpp"
 
 #include <xul/lang/object_impl.hpp>
 #include <xul/data/big_number_io.hpp>
 #include <xul/data/date_time.hpp>
 #include <xul/util/time_counter.hpp>
+#include <xul/net/io_services.hpp>
 #include <xul/log/log.hpp>
 #include <xul/util/test_case.hpp>
+#include <algorithm>
 #include <deque>
+#include <list>
+#include <mutex>
 #include <unordered_map>
 #include <map>
+#include <set>
 
 
 namespace xbtc {
 
 
+// byte-budgeted LRU of decoded blocks, the blocks close to the chain tip are kept regardless of their age
+class DecodedBlockCache
+{
+public:
+    class Entry
+    {
+    public:
+        BlockPtr block;
+        int height;
+        size_t bytes;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::unordered_map<uint256, EntryList::iterator> EntryTable;
+
+    explicit DecodedBlockCache(size_t maxBytes) : m_maxBytes(maxBytes), m_bytes(0), m_tipHeight(0), m_hits(0), m_misses(0)
+    {
+        XUL_LOGGER_INIT("DecodedBlockCache");
+        XUL_REL_EVENT("new " << maxBytes);
+    }
+    // the reference keeps the block alive once the entry is evicted by another thread
+    BlockPtr get(const uint256& hash)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_entries.find(hash);
+        if (iter == m_entries.end())
+        {
+            ++m_misses;
+            reportStats();
+            return nullptr;
+        }
+        ++m_hits;
+        reportStats();
+        m_lru.splice(m_lru.begin(), m_lru, iter->second);
+        return iter->second->block;
+    }
+    // the tip height only moves with setTipHeight, a block added off the main chain must not pin its neighbours
+    void put(Block* block, int height)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const uint256& hash = block->getHash();
+        auto iter = m_entries.find(hash);
+        if (iter != m_entries.end())
+        {
+            m_lru.splice(m_lru.begin(), m_lru, iter->second);
+            return;
+        }
+        Entry entry;
+        entry.block = block;
+        entry.height = height;
+        entry.bytes = estimateBlockMemory(block);
+        m_lru.push_front(entry);
+        m_entries[hash] = m_lru.begin();
+        m_bytes += entry.bytes;
+        shrink();
+    }
+    void setTipHeight(int height)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tipHeight = height;
+    }
+private:
+    bool isHot(const Entry& entry) const
+    {
+        return entry.height > m_tipHeight - BLOCK_CACHE_TIP_BLOCKS && entry.height <= m_tipHeight;
+    }
+    void shrink()
+    {
+        auto iter = m_lru.end();
+        while (m_bytes > m_maxBytes && iter != m_lru.begin())
+        {
+            --iter;
+            if (isHot(*iter))
+                continue;
+            m_bytes -= iter->bytes;
+            m_entries.erase(iter->block->getHash());
+            iter = m_lru.erase(iter);
+        }
+    }
+    void reportStats()
+    {
+        uint64_t total = m_hits + m_misses;
+        if (total % 1000 != 0)
+            return;
+        XUL_EVENT("stats " << xul::make_tuple(m_entries.size(), m_bytes, m_maxBytes) << " "
+                  << xul::make_tuple(m_hits, m_misses, m_hits * 100 / total));
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    std::mutex m_mutex;
+    EntryList m_lru;
+    EntryTable m_entries;
+    const size_t m_maxBytes;
+    size_t m_bytes;
+    int m_tipHeight;
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
+
 class BlockCacheImpl : public xul::object_impl<BlockCache>, public BlockStorageListener
 {
 public:
-    typedef std::vector<BlockIndexPtr> BlockIndexList;
-    typedef std::multimap<uint256, BlockIndexPtr> UnlinkedBlockIndexChain;
+    typedef std::vector<BlockIndex*> BlockIndexList;
+    typedef std::multimap<uint256, BlockIndex*> UnlinkedBlockIndexChain;
+    typedef std::unordered_map<uint32_t, uint256> BlockProofTable;
 
-    explicit BlockCacheImpl(const AppConfig* config, BlockStorage* storage, const ChainParams* chainParams)
-        : m_config(config), m_storage(storage), m_chainParams(chainParams)
+    explicit BlockCacheImpl(const AppConfig* config, BlockStorage* storage, const ChainParams* chainParams, TxIndex* txIndex)
+        : m_bestHeader(nullptr), m_config(config), m_storage(storage), m_chainParams(chainParams), m_txIndex(txIndex)
+        , m_decodedBlocks(config->blockCache), m_index91812(nullptr), m_index91842(nullptr)
     {
         XUL_LOGGER_INIT("BlockCache");
         XUL_REL_EVENT("new");
         m_chain = createBlockChain();
-        m_blocks = std::make_shared<BlockIndexMap>();
-        m_dirtyBlocks = std::make_shared<BlockIndexMap>();
+        m_blocks = std::make_shared<BlockIndexTable>();
+        m_dirtyBlocks = std::make_shared<BlockIndexTable>();
+        m_changedBlocks = std::make_shared<BlockIndexTable>();
         m_coinView = createCoinView(config);
-        m_validator = createValidator(m_coinView.get(), config);
+        m_validator = createValidator(config);
         m_storage->setListener(this);
     }
     ~BlockCacheImpl()
@@ -53,22 +164,37 @@ public:
         if (!m_storage->load(data))
             return false;
         m_blocks = std::move(data.blocks);
-        sortOutBlocks();
+        if (data.bestHeader)
+        {
+            // restored from a snapshot, already checked and linked with chain work and skip pointers
+            m_bestHeader = data.bestHeader;
+            linkJournaledBlocks();
+            recountChainTransactions();
+            XUL_EVENT("load snapshot " << xul::make_tuple(m_blocks->size(), m_bestHeader->height));
+        }
+        else
+        {
+            sortOutBlocks();
+        }
         m_coinView->load();
         loadGenesisBlock();
         loadChainTip();
+        if (m_txIndex && m_txIndex->open())
+        {
+            m_txIndex->startBackfill(m_chain.get());
+        }
 #if defined(XUL_RUN_TEST) && 0
         for (int i = 0; i <= m_chain->getHeight(); ++i)
         {
             BlockIndex* blockIndex = m_chain->getBlock(i);
-            BlockPtr block(readBlock(blockIndex));
+            BlockPtr block = readBlock(blockIndex);
             if (!block)
             {
                 assert(false);
                 break;
             }
             XUL_WARN("block " << blockIndex->height);
-            assert(m_blocks->find(block->header.hash) != m_blocks->end());
+            assert(m_blocks->find(block->header.hash));
             for (int j = 0; j < block->transactions.size(); ++j)
             {
                 const Transaction& tx = block->transactions[j];
@@ -82,19 +208,23 @@ public:
 #endif
         return true;
     }
-    virtual void onBlockWritten(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos)
+    virtual void onBlockWritten(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos, const TransactionOffsetList& txOffsets)
     {
 //        assert(m_chain->getHeight() == m_coinView->getBestBlockHeight());
         blockIndex->setDiskPosition(pos);
         blockIndex->status |= BLOCK_HAVE_DATA;
         // check witness
         blockIndex->raiseValidity(BlockStatus::BLOCK_VALID_TRANSACTIONS);
-        markDirtyBlock(blockIndex);
+        markChangedBlock(blockIndex);
         if (!updateCoins(block, blockIndex))
         {
             assert(false);
             return;
         }
+        if (m_txIndex)
+        {
+            m_txIndex->addBlock(block, blockIndex, txOffsets);
+        }
         if (blockIndex->height == 91812)
         {
             m_block91812 = block;
@@ -105,11 +235,60 @@ public:
         }
         assert(m_chain->getHeight() == m_coinView->getBestBlockHeight());
     }
-    virtual Block* readBlock(BlockIndex* blockIndex)
+    virtual BlockPtr readBlock(BlockIndex* blockIndex)
     {
-        return m_storage->readBlock(blockIndex);
+        if (!(blockIndex->status & BLOCK_HAVE_DATA))
+            return BlockPtr();
+        BlockPtr block = m_decodedBlocks.get(blockIndex->getHash());
+        if (block)
+            return block;
+        block = m_storage->readBlock(blockIndex);
+        if (block)
+        {
+            m_decodedBlocks.put(block.get(), blockIndex->height);
+        }
+        return block;
+    }
+    virtual void readBlocks(const ConstBlockIndexList& blockIndexes, xul::io_service* ios, const BlockReadCallback& callback)
+    {
+        auto blocks = std::make_shared<BlockList>(blockIndexes.size());
+        ConstBlockIndexList misses;
+        std::vector<size_t> missSlots;
+        for (size_t i = 0; i < blockIndexes.size(); ++i)
+        {
+            if (!(blockIndexes[i]->status & BLOCK_HAVE_DATA))
+                continue;
+            BlockPtr block = m_decodedBlocks.get(blockIndexes[i]->getHash());
+            if (block)
+            {
+                (*blocks)[i] = block;
+                continue;
+            }
+            misses.push_back(blockIndexes[i]);
+            missSlots.push_back(i);
+        }
+        if (misses.empty())
+        {
+            xul::io_services::post(ios, std::bind(callback, *blocks));
+            return;
+        }
+        m_storage->readBlocks(misses, ios, [blocks, missSlots, callback](const BlockList& loaded) {
+            for (size_t j = 0; j < loaded.size(); ++j)
+            {
+                (*blocks)[missSlots[j]] = loaded[j];
+            }
+            callback(*blocks);
+        });
     }
     virtual BlockIndex* addBlock(Block* block)
+    {
+        return doAddBlock(block, nullptr);
+    }
+    virtual BlockIndex* addStoredBlock(Block* block, const DiskBlockPos& pos)
+    {
+        return doAddBlock(block, &pos);
+    }
+    BlockIndex* doAddBlock(Block* block, const DiskBlockPos* storedPos)
     {
         BlockIndex* blockIndex = addBlockIndex(block->header);
         if (blockIndex->height <= 0)
@@ -118,53 +297,83 @@ public:
             return nullptr;
         }
         if (!m_validator->validateBlock(block, blockIndex))
+        {
+            markBlockFailed(blockIndex, false);
             return nullptr;
+        }
         updateBlockIndex(blockIndex, block);
-        saveBlock(block, blockIndex);
+        if (storedPos)
+            m_storage->registerBlock(block, blockIndex, *storedPos);
+        else
+            saveBlock(block, blockIndex);
+        m_decodedBlocks.put(block, blockIndex->height);
         return blockIndex;
     }
+    virtual void markBlockFailed(BlockIndex* blockIndex, bool descendant)
+    {
+        if (blockIndex->status & BLOCK_FAILED_MASK)
+            return;
+        XUL_WARN("markBlockFailed " << xul::make_tuple(blockIndex->height, descendant) << " " << blockIndex->getHash());
+        blockIndex->status |= descendant ? BLOCK_FAILED_CHILD : BLOCK_FAILED_VALID;
+        markChangedBlock(blockIndex);
+    }
     virtual BlockIndex* addBlockIndex(const BlockHeader& header)
     {
         assert(!header.hash.is_null());
-        BlockIndexPtr& block = (*m_blocks)[header.hash];
+        BlockIndex* block = m_blocks->find(header.hash);
         if (block)
-            return block.get();
+            return block;
         if (!m_validator->validateBlockHeader(header))
             return nullptr;
-        block = createBlockIndex(header);
-        if (!block->header.previousBlockHash.is_null())
+        BlockIndex* previous = header.previousBlockHash.is_null() ? nullptr : m_blocks->find(header.previousBlockHash);
+        block = insertBlockIndex(header, previous);
+        markDirtyBlock(block);
+        return block;
+    }
+    virtual BlockIndex* addBlockIndexes(std::vector<BlockHeader>& headers)
+    {
+        if (headers.empty())
+            return nullptr;
+        // hashing and the proof of work check dominate, a full headers message spreads them over several threads
+        std::vector<uint8_t> valid(headers.size(), 0);
+        int maxThreads = headers.size() >= MIN_PARALLEL_HEADER_BATCH ? MAX_HEADER_BATCH_THREADS : 1;
+        runParallel(headers.size(), maxThreads, [this, &headers, &valid](size_t begin, size_t end, int slice) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                headers[i].computeHash();
+                valid[i] = m_validator->validateBlockHeader(headers[i]) ? 1 : 0;
+            }
+        });
+        m_blocks->reserve(m_blocks->size() + headers.size());
+        m_dirtyBlocks->reserve(m_dirtyBlocks->size() + headers.size());
+        BlockIndex* previous = nullptr;
+        for (size_t i = 0; i < headers.size(); ++i)
         {
-            auto iter = m_blocks->find(block->header.previousBlockHash);
-            if (iter != m_blocks->end())
+            const BlockHeader& header = headers[i];
+            BlockIndex* block = m_blocks->find(header.hash);
+            if (!block)
             {
-                block->previous = iter->second;
-                block->height = block->previous->height + 1;
-                if (block->height % 20000 == 1)
-                {
-                    XUL_EVENT("addBlockIndex " << block->height);
-                }
-                if (block->height == 91812)
-                {
-                    m_index91812 = block;
-                }
-                else if (block->height == 91842)
+                // a headers message is a chain, so the parent is nearly always the header before
+                if (!previous || previous->getHash() != header.previousBlockHash)
+                    previous = header.previousBlockHash.is_null() ? nullptr : m_blocks->find(header.previousBlockHash);
+                // everything after an invalid or unlinked header would be unlinked as well
+                if (!valid[i] || (!previous && !header.previousBlockHash.is_null()))
                 {
-                    m_index91842 = block;
+                    XUL_WARN("addBlockIndexes stop at " << xul::make_tuple(i, headers.size(), int(valid[i])) << " " << header.hash);
+                    break;
                 }
+                block = insertBlockIndex(header, previous);
+                m_dirtyBlocks->insert(block);
             }
+            previous = block;
         }
-        block->raiseValidity(BlockStatus::BLOCK_VALID_TREE);
-        updateBlockInfo(block.get());
-        markDirtyBlock(block.get());
-        return block.get();
+        checkFlush();
+        return previous;
     }
     virtual BlockIndex* getBlockIndex(const uint256& hash)
     {
         assert(index >= 0);
-        auto iter = m_blocks->find(hash);
-        if (iter == m_blocks->end())
-            return nullptr;
-        return iter->second.get();
+        return m_blocks->find(hash);
     }
     virtual const ChainParams* getChainParams() const
     {
@@ -182,14 +391,49 @@ public:
     {
         return m_coinView.get();
     }
+    virtual TxIndex* getTxIndex()
+    {
+        return m_txIndex.get();
+    }
     virtual BlockIndex* getBestHeader()
     {
-        return m_bestHeader.get();
+        return m_bestHeader;
     }
     virtual void getLocator(std::vector<uint256>& have, const BlockIndex* block) const
     {
     }
+    virtual void flush()
+    {
+        flushBlockIndexes(m_storage->isSnapshotDue());
+    }
+    virtual void close()
+    {
+        // the last group updates its block indexes and coins before they are flushed for the last time
+        m_storage->finishWrites();
+        flushBlockIndexes(true);
+        m_storage->close();
+    }
 private:
+    void flushBlockIndexes(bool snapshot)
+    {
+        m_lastFlushTime.sync();
+        auto data = std::make_shared<BlockIndexesData>();
+        data->blocks = std::move(m_dirtyBlocks);
+        m_dirtyBlocks = std::make_shared<BlockIndexTable>();
+        data->changedBlocks = std::move(m_changedBlocks);
+        m_changedBlocks = std::make_shared<BlockIndexTable>();
+        pruneBlockFiles(*data->blocks, *data->changedBlocks);
+        if (snapshot && m_bestHeader)
+        {
+            // copied here, the in-memory indexes keep changing while the disk thread writes this flush, the copy
+            // is gone once the snapshot is written
+            auto entries = std::make_shared<std::vector<BlockIndex> >();
+            BlockIndexSlab::copyEntries(*entries);
+            data->snapshot = captureBlockIndexSnapshot(entries, *m_blocks, m_bestHeader);
+        }
+        m_storage->flush(data);
+        m_coinView->flush();
+    }
     bool loadChainTip()
     {
         const uint256& bestBlockHash = m_coinView->getBestBlockHash();
@@ -200,36 +444,39 @@ private:
             XUL_EVENT("loadChainTip null best block hash " << m_blocks->size());
             return false;
         }
-        auto iter = m_blocks->find(bestBlockHash);
-        if (iter == m_blocks->end())
+        BlockIndex* tip = m_blocks->find(bestBlockHash);
+        if (!tip)
         {
             XUL_EVENT("loadChainTip invalid best block hash " << bestBlockHash << " " << m_blocks->size());
             assert(false);
             return false;
         }
-        m_chain->setTip(iter->second.get());
-        XUL_EVENT("loadChainTip set best block hash " << xul::make_tuple(m_blocks->size(), m_chain->getHeight(), iter->second->height) << " " << bestBlockHash);
+        m_chain->setTip(tip);
+        m_decodedBlocks.setTipHeight(tip->height);
+        XUL_EVENT("loadChainTip set best block hash " << xul::make_tuple(m_blocks->size(), m_chain->getHeight(), tip->height) << " " << bestBlockHash);
         return true;
     }
     bool updateCoins(const Block* block, BlockIndex* blockIndex)
     {
-        if (!m_validator->verifyTransactions(block, blockIndex))
+        // validate and connect against a scratch view, the shared coin cache is only touched on success
+        boost::intrusive_ptr<CoinViewOverlay> view = createCoinViewOverlay(m_coinView.get());
+        if (!m_validator->verifyTransactions(block, blockIndex, view.get()))
             return false;
+        view->setBestBlockHash(blockIndex->getHash(), blockIndex->height);
+        if (!view->connectBlock(block, blockIndex->height))
+            return false;
+        view->commit();
         m_chain->setTip(blockIndex);
-        m_coinView->setBestBlockHash(blockIndex->getHash(), blockIndex->height);
-        for (auto tx : block->transactions)
-        {
-            m_coinView->transfer(&tx, blockIndex->height);
-        }
+        m_decodedBlocks.setTipHeight(blockIndex->height);
         return true;
     }
     void loadGenesisBlock()
     {
-        auto iter = m_blocks->find(m_chainParams->genesisBlock->getHash());
-        if (iter != m_blocks->end())
+        BlockIndex* genesis = m_blocks->find(m_chainParams->genesisBlock->getHash());
+        if (genesis)
         {
-            // m_chainParams->genesisBlockIndex = iter->second;
-            m_chain->setTip(iter->second.get());
+            // m_chainParams->genesisBlockIndex = genesis;
+            m_chain->setTip(genesis);
             return;
         }
         BlockIndex* block = addBlockIndex(m_chainParams->genesisBlock->header);
@@ -248,79 +495,130 @@ private:
     {
         m_storage->writeBlock(block, blockIndex);
     }
+    BlockIndex* insertBlockIndex(const BlockHeader& header, BlockIndex* previous)
+    {
+        BlockIndex* block = createBlockIndex(header);
+        m_blocks->insert(block);
+        if (previous)
+        {
+            block->setPrevious(previous);
+            block->height = previous->height + 1;
+            block->buildSkip();
+            if (block->height % 20000 == 1)
+            {
+                XUL_EVENT("addBlockIndex " << block->height);
+            }
+            if (block->height == 91812)
+            {
+                m_index91812 = block;
+            }
+            else if (block->height == 91842)
+            {
+                m_index91842 = block;
+            }
+        }
+        block->raiseValidity(BlockStatus::BLOCK_VALID_TREE);
+        updateBlockInfo(block);
+        return block;
+    }
     void markDirtyBlock(BlockIndex* block)
     {
-        (*m_dirtyBlocks)[block->getHash()] = block;
+        m_dirtyBlocks->insert(block);
+        checkFlush();
+    }
+    // an index created since the last flush is written in full anyway
+    void markChangedBlock(BlockIndex* block)
+    {
+        if (!m_dirtyBlocks->find(block->getHash()))
+        {
+            m_changedBlocks->insert(block);
+        }
         checkFlush();
     }
     void checkFlush()
     {
-        if (m_dirtyBlocks->size() >= 100000 || m_lastFlushTime.elapsed() > 5000)
+        if (m_dirtyBlocks->size() + m_changedBlocks->size() >= 100000 || m_lastFlushTime.elapsed() > 5000)
         {
             flush();
         }
     }
-    void flush()
+    void pruneBlockFiles(const BlockIndexTable& dirtyBlocks, BlockIndexTable& changedBlocks)
     {
-        m_lastFlushTime.sync();
-        auto data = std::make_shared<BlockIndexesData>();
-        data->blocks = std::move(m_dirtyBlocks);
-        m_dirtyBlocks = std::make_shared<BlockIndexMap>();
-        m_storage->flush(data);
-        m_coinView->flush();
+        std::vector<int> files;
+        if (!m_storage->isPruneMode() || !m_storage->findFilesToPrune(m_chain->getHeight(), files))
+            return;
+        std::set<int> fileset(files.begin(), files.end());
+        int count = 0;
+        for (BlockIndex* block : *m_blocks)
+        {
+            if (!(block->status & BLOCK_HAVE_MASK) || fileset.find(block->fileIndex) == fileset.end())
+                continue;
+            block->status &= ~(BLOCK_HAVE_MASK | BLOCK_OPT_COMPRESSED);
+            block->fileIndex = 0;
+            block->dataPosition = 0;
+            block->undoPosition = 0;
+            block->compressedSize = 0;
+            if (!dirtyBlocks.find(block->getHash()))
+            {
+                changedBlocks.insert(block);
+            }
+            ++count;
+        }
+        m_storage->pruneFiles(files);
+        XUL_REL_EVENT("pruneBlockFiles " << xul::make_tuple(files.front(), files.back(), count));
     }
     void updatePreviousBlock()
     {
         xul::time_counter starttime;
-        for (const auto& item : *m_blocks)
-        {
-            const uint256& hash = item.first;
-            BlockIndex* block = item.second.get();
-            assert(block->getHash() == hash);
-            assert(!block->previous);
-            auto iter = m_blocks->find(block->header.previousBlockHash);
-            if (iter != m_blocks->end())
-            {
-                block->previous = iter->second;
-            }
+        for (BlockIndex* block : *m_blocks)
+        {
+            assert(block->previousHandle == NULL_BLOCK_INDEX_HANDLE);
+            block->setPrevious(m_blocks->find(block->header.previousBlockHash));
         }
         XUL_DEBUG("updatePreviousBlock " << xul::make_tuple(m_blocks->size(), starttime.elapsed()));
     }
+    // bits only change at retarget boundaries, so the proofs of almost all headers come out of the memo
+    static const uint256& getBlockProof(uint32_t bits, BlockProofTable& proofs)
+    {
+        auto iter = proofs.find(bits);
+        if (iter != proofs.end())
+            return iter->second;
+        return proofs[bits] = Consensus::calcBlockProof(bits);
+    }
     void updateBlockInfo(BlockIndex* block)
     {
-        block->chainWork = Consensus::calcBlockProof(block->header.bits);
+        accumulateBlockInfo(block, getBlockProof(block->header.bits, m_blockProofs));
+    }
+    void accumulateBlockInfo(BlockIndex* block, const uint256& proof)
+    {
+        block->chainWork = proof;
         block->maxTime = block->header.timestamp;
         block->chainTransactionCount = block->transactionCount;
-        if (block->previous)
+        const BlockIndex* previous = block->getPrevious();
+        if (previous)
         {
-            block->chainTransactionCount += block->previous->chainTransactionCount;
-            block->chainWork += block->previous->chainWork;
-            if (block->maxTime < block->previous->maxTime)
-                block->maxTime = block->previous->maxTime;
+            block->chainTransactionCount += previous->chainTransactionCount;
+            block->chainWork += previous->chainWork;
+            if (block->maxTime < previous->maxTime)
+                block->maxTime = previous->maxTime;
         }
         if (!m_bestHeader || (m_bestHeader->chainWork < block->chainWork))
         {
             m_bestHeader = block;
         }
     }
-    void updateChainWork()
+    // block proofs were filled into chainWork by validateBlockIndexes, one pass in height order adds up the chains
+    // and builds the skip pointers, whose targets are always lower and therefore already done
+    void updateChainWork(const BlockIndexList& blocks)
     {
         xul::time_counter starttime;
-        std::vector<std::pair<int, BlockIndex*> > heightSortedBlocks;
-        heightSortedBlocks.reserve(m_blocks->size());
-        for (const auto& item : *m_blocks)
+        BlockIndexList heightSortedBlocks;
+        sortByHeight(blocks, heightSortedBlocks);
+        XUL_EVENT("updateChainWork sorted " << xul::make_tuple(blocks.size(), starttime.elapsed()));
+        for (BlockIndex* block : heightSortedBlocks)
         {
-            BlockIndex* block = item.second.get();
-            heightSortedBlocks.push_back(std::make_pair(block->height, block));
-        }
-        XUL_EVENT("updateChainWork 1 " << xul::make_tuple(m_blocks->size(), starttime.elapsed()));
-        std::sort(heightSortedBlocks.begin(), heightSortedBlocks.end());
-        XUL_EVENT("updateChainWork 2 " << xul::make_tuple(m_blocks->size(), starttime.elapsed()));
-        for (const auto& item : heightSortedBlocks)
-        {
-            BlockIndex* block = item.second;
-            assert(block->height == item.first);
-            updateBlockInfo(block);
+            block->buildSkip();
+            accumulateBlockInfo(block, block->chainWork);
         }
         XUL_EVENT("updateChainWork " << xul::make_tuple(m_blocks->size(), starttime.elapsed())
             << " " << m_bestHeader << " " << (m_bestHeader ? m_bestHeader->chainWork : uint256()));
@@ -331,52 +629,150 @@ private:
                 << " " << m_bestHeader->chainTransactionCount << " " << xul::unix_time::from_utc_time(m_bestHeader->maxTime));
         }
     }
-    void validateBlockIndexes()
+    // counting sort, heights are dense
+    static void sortByHeight(const BlockIndexList& blocks, BlockIndexList& sortedBlocks)
     {
-        auto iter = m_blocks->begin();
-        while (iter != m_blocks->end())
+        int maxHeight = 0;
+        for (const auto& block : blocks)
         {
-            BlockIndex* block = iter->second.get();
-            if (!m_validator->validateBlockIndex(block))
+            if (block->height > maxHeight)
+                maxHeight = block->height;
+        }
+        std::vector<size_t> heightStarts(maxHeight + 2, 0);
+        for (const auto& block : blocks)
+        {
+            ++heightStarts[block->height + 1];
+        }
+        for (int height = 0; height <= maxHeight; ++height)
+        {
+            heightStarts[height + 1] += heightStarts[height];
+        }
+        sortedBlocks.resize(blocks.size());
+        for (const auto& block : blocks)
+        {
+            sortedBlocks[heightStarts[block->height]++] = block;
+        }
+    }
+    // a header is counted before its block brings the transactions, and a block that arrives later does not carry
+    // its count on to the descendants, so the counts restored from a snapshot are summed up again as sortOutBlocks does
+    void recountChainTransactions()
+    {
+        xul::time_counter starttime;
+        BlockIndexList blocks;
+        blocks.reserve(m_blocks->size());
+        for (BlockIndex* block : *m_blocks)
+        {
+            blocks.push_back(block);
+        }
+        BlockIndexList heightSortedBlocks;
+        sortByHeight(blocks, heightSortedBlocks);
+        for (BlockIndex* block : heightSortedBlocks)
+        {
+            const BlockIndex* previous = block->getPrevious();
+            uint32_t count = block->transactionCount + (previous ? previous->chainTransactionCount : 0);
+            // the slabs are mapped from the snapshot, an entry left as it is keeps its page shared with the file
+            if (block->chainTransactionCount != count)
+                block->chainTransactionCount = count;
+        }
+        XUL_EVENT("recountChainTransactions " << xul::make_tuple(blocks.size(), starttime.elapsed()));
+    }
+    // checks proof of work and computes the block proofs in parallel, the invalid indexes are dropped afterwards
+    void validateBlockIndexes(BlockIndexList& blocks)
+    {
+        xul::time_counter starttime;
+        blocks.clear();
+        blocks.reserve(m_blocks->size());
+        for (BlockIndex* block : *m_blocks)
+        {
+            blocks.push_back(block);
+        }
+        std::vector<uint8_t> invalid(blocks.size(), 0);
+        runParallel(blocks.size(), MAX_BLOCK_INDEX_LOAD_THREADS, [this, &blocks, &invalid](size_t begin, size_t end, int slice) {
+            BlockProofTable proofs;
+            for (size_t i = begin; i < end; ++i)
+            {
+                BlockIndex* block = blocks[i];
+                if (!m_validator->validateBlockIndex(block))
+                {
+                    invalid[i] = 1;
+                    continue;
+                }
+                block->chainWork = getBlockProof(block->header.bits, proofs);
+            }
+        });
+        size_t valid = 0;
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            if (invalid[i])
             {
-                XUL_WARN("validateBlockIndexes invalid block " << block->getHash() << " " << block->height);
-                m_blocks->erase(iter++);
+                XUL_WARN("validateBlockIndexes invalid block " << blocks[i]->getHash() << " " << blocks[i]->height);
+                m_blocks->erase(blocks[i]->getHash());
+                continue;
             }
-            else
+            blocks[valid++] = blocks[i];
+        }
+        blocks.resize(valid);
+        XUL_EVENT("validateBlockIndexes " << xul::make_tuple(blocks.size(), starttime.elapsed()));
+    }
+    // indexes the journal added on top of a snapshot are not linked yet, they all lie above the snapshot's ones
+    void linkJournaledBlocks()
+    {
+        BlockIndexList blocks;
+        for (BlockIndex* block : *m_blocks)
+        {
+            if (block->previousHandle == NULL_BLOCK_INDEX_HANDLE && !block->header.previousBlockHash.is_null())
+                blocks.push_back(block);
+        }
+        if (blocks.empty())
+            return;
+        std::sort(blocks.begin(), blocks.end(), [](const BlockIndex* x, const BlockIndex* y) { return x->height < y->height; });
+        for (BlockIndex* block : blocks)
+        {
+            if (!m_validator->validateBlockIndex(block))
             {
-                ++iter;
+                XUL_WARN("linkJournaledBlocks invalid block " << block->getHash() << " " << block->height);
+                continue;
             }
+            block->setPrevious(m_blocks->find(block->header.previousBlockHash));
+            block->buildSkip();
+            updateBlockInfo(block);
         }
+        XUL_EVENT("linkJournaledBlocks " << xul::make_tuple(blocks.size(), m_bestHeader->height));
     }
     void sortOutBlocks()
     {
         XUL_DEBUG("sortOutBlocks " << xul::make_tuple(m_blocks->size(), 0));
-        validateBlockIndexes();
+        BlockIndexList blocks;
+        validateBlockIndexes(blocks);
         updatePreviousBlock();
-        updateChainWork();
+        updateChainWork(blocks);
     }
 private:
     XUL_LOGGER_DEFINE();
-    BlockIndexMapPtr m_blocks;
-    BlockIndexPtr m_bestHeader;
+    BlockIndexTablePtr m_blocks;
+    BlockIndex* m_bestHeader;
     boost::intrusive_ptr<const AppConfig> m_config;
     boost::intrusive_ptr<BlockStorage> m_storage;
     boost::intrusive_ptr<Validator> m_validator;
     boost::intrusive_ptr<BlockChain> m_chain;
     boost::intrusive_ptr<const ChainParams> m_chainParams;
-    BlockIndexMapPtr m_dirtyBlocks;
+    boost::intrusive_ptr<TxIndex> m_txIndex;
+    BlockIndexTablePtr m_dirtyBlocks;
+    BlockIndexTablePtr m_changedBlocks;
     xul::time_counter m_lastFlushTime;
     boost::intrusive_ptr<CoinView> m_coinView;
-    BlockIndexPtr m_index91812;
-    BlockIndexPtr m_index91842;
+    DecodedBlockCache m_decodedBlocks;
+    BlockProofTable m_blockProofs;
+    BlockIndex* m_index91812;
+    BlockIndex* m_index91842;
     BlockPtr m_block91812;
     BlockPtr m_block91842;
 };
 
 
-BlockCache* createBlockCache(const AppConfig* config, BlockStorage* storage, const ChainParams* chainParams)
+BlockCache* createBlockCache(const AppConfig* config, BlockStorage* storage, const ChainParams* chainParams, TxIndex* txIndex)
 {
-    return new BlockCacheImpl(config, storage, chainParams);
+    return new BlockCacheImpl(config, storage, chainParams, txIndex);
 }
 
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BlockStorage.hpp"
 #include "util/number.hpp"
 #include <xul/lang/object.hpp>
 
@@ -15,22 +16,40 @@ class AppConfig;
 class ChainParams;
 class BlockChain;
 class CoinView;
+class TxIndex;
 
 class BlockCache : public xul::object
 {
 public:
     virtual bool load() = 0;
     virtual BlockIndex* addBlock(Block* block) = 0;;
+    // for reindex, the block is indexed where pos finds it in the block files instead of being written again
+    virtual BlockIndex* addStoredBlock(Block* block, const DiskBlockPos& pos) = 0;
     virtual BlockIndex* addBlockIndex(const BlockHeader& header) = 0;
+    // hashes the headers in place and adds them in one go up to the first invalid or unlinked one, returns the index
+    // of the last header that was added or known, null if there is none
+    virtual BlockIndex* addBlockIndexes(std::vector<BlockHeader>& headers) = 0;
+    // the returned block may be shared with the cache, it must not be modified
+    virtual boost::intrusive_ptr<Block> readBlock(BlockIndex* blockIndex) = 0;
+    // cached blocks are served right away, the rest is read off the calling thread, the callback always runs on ios
+    virtual void readBlocks(const ConstBlockIndexList& blockIndexes, xul::io_service* ios, const BlockReadCallback& callback) = 0;
     virtual BlockIndex* getBlockIndex(const uint256& hash) = 0;
+    // the block, or with descendant set one of its ancestors, failed validation, it is not downloaded again
+    virtual void markBlockFailed(BlockIndex* blockIndex, bool descendant) = 0;
     virtual const ChainParams* getChainParams() const = 0;
     // virtual void getLocator(std::vector<uint256>& have, const BlockIndex* block) const = 0;
     virtual BlockIndex* getTip() = 0;
     virtual BlockIndex* getBestHeader() = 0;
     virtual BlockChain* getChain() = 0;
     virtual CoinView* getCoinView() = 0;
+    // null unless the txIndex option is on
+    virtual TxIndex* getTxIndex() = 0;
+    // persists dirty block indexes and coins
+    virtual void flush() = 0;
+    // final flush at shutdown, leaves a block index snapshot behind and waits for the disk io service
+    virtual void close() = 0;
 };
 
-BlockCache* createBlockCache(const AppConfig* config, BlockStorage* storage, const ChainParams* chainParams);
+BlockCache* createBlockCache(const AppConfig* config, BlockStorage* storage, const ChainParams* chainParams, TxIndex* txIndex);
 
 }
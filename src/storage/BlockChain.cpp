@@ -6,6 +6,8 @@
 #include <xul/data/date_time.hpp>
 #include <xul/util/time_counter.hpp>
 #include <xul/log/log.hpp>
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <deque>
 #include <unordered_map>
@@ -15,6 +17,47 @@
 namespace xbtc {
 
 
+bool BlockChainView::contains(const BlockIndex* block) const
+{
+    return getBlock(block->height) == block;
+}
+
+BlockIndex* BlockChainView::next(const BlockIndex* block) const
+{
+    return getBlock(block->height + 1);
+}
+
+void BlockChainView::getLocator(std::vector<uint256>& have, BlockIndex* block) const
+{
+    int step = 1;
+    have.clear();
+    have.reserve(32);
+    if (!block)
+        block = getTip();
+    while (block)
+    {
+        have.push_back(block->getHash());
+        // Stop when we have added the genesis block.
+        if (block->height == 0)
+            break;
+        // Exponentially larger steps back, plus the genesis block.
+        int height = std::max(block->height - step, 0);
+        if (contains(block))
+        {
+            // Use O(1) CChain index if possible.
+            block = getBlock(height);
+        }
+        else
+        {
+            // Otherwise, use O(log n) skiplist.
+            block = block->getAncestor(height);
+        }
+        if (have.size() > 10)
+            step *= 2;
+    }
+}
+
+
 class BlockChainImpl : public xul::object_impl<BlockChain>
 {
 public:
@@ -22,84 +65,127 @@ public:
     {
         XUL_LOGGER_INIT("BlockChain");
         XUL_REL_EVENT("new");
+        m_view = new BlockChainView;
     }
     ~BlockChainImpl()
     {
         XUL_REL_EVENT("delete");
+        // no reader may be left at destruction, the retired views and chunks are freed on their own
+        const BlockChainView* view = m_view.load();
+        for (BlockChainChunk* chunk : view->chunks)
+        {
+            delete chunk;
+        }
+        delete view;
     }
 
     virtual int getHeight() const
     {
-        assert(m_blocks.size() >= 1);
-        return m_blocks.size() - 1;
+        EpochGuard guard;
+        assert(getView()->getHeight() >= 0);
+        return getView()->getHeight();
     }
     virtual bool contains(const BlockIndex* block) const
     {
-        return getBlock(block->height) == block;
+        EpochGuard guard;
+        return getView()->contains(block);
     }
     virtual BlockIndex* next(BlockIndex* block) const
     {
-        return getBlock(block->height + 1);
+        EpochGuard guard;
+        return getView()->next(block);
     }
     virtual BlockIndex* getTip() const
     {
-        assert(!m_blocks.empty());
-        return m_blocks[m_blocks.size() - 1].get();
-    }
-    virtual void setTip(BlockIndex* block)
-    {
-        if (block == nullptr)
-        {
-            m_blocks.clear();
-            return;
-        }
-        m_blocks.resize(block->height + 1);
-        while (block && m_blocks[block->height].get() != block)
-        {
-            m_blocks[block->height] = block;
-            block = block->previous.get();
-        }
+        EpochGuard guard;
+        assert(getView()->getHeight() >= 0);
+        return getView()->getTip();
     }
     virtual BlockIndex* getBlock(int height) const
     {
-        if (height < 0 || height >= m_blocks.size())
-            return nullptr;
-        return m_blocks[height].get();
+        EpochGuard guard;
+        return getView()->getBlock(height);
     }
     virtual void getLocator(std::vector<uint256>& have, BlockIndex* block) const
     {
-        int step = 1;
-        have.clear();
-        have.reserve(32);
-        if (!block)
-            block = getTip();
-        while (block)
+        EpochGuard guard;
+        getView()->getLocator(have, block);
+    }
+    virtual const BlockChainView* getView() const
+    {
+        return m_view.load(std::memory_order_acquire);
+    }
+    virtual void setTip(BlockIndex* block)
+    {
+        const BlockChainView* current = m_view.load(std::memory_order_relaxed);
+        BlockChainView* view = new BlockChainView;
+        std::vector<BlockChainChunk*> replaced;
+        if (block)
         {
-            have.push_back(block->getHash());
-            // Stop when we have added the genesis block.
-            if (block->height == 0)
-                break;
-            // Exponentially larger steps back, plus the genesis block.
-            int height = std::max(block->height - step, 0);
-            if (contains(block))
+            view->height = block->height;
+            view->chunks = current->chunks;
+            size_t chunkCount = (block->height >> BLOCK_CHAIN_CHUNK_SHIFT) + 1;
+            for (size_t i = chunkCount; i < view->chunks.size(); ++i)
             {
-                // Use O(1) CChain index if possible.
-                block = getBlock(height);
+                replaced.push_back(view->chunks[i]);
             }
-            else
+            view->chunks.resize(chunkCount, nullptr);
+            for (size_t i = 0; i < chunkCount; ++i)
             {
-                // Otherwise, use O(log n) skiplist.
-                block = block->getAncestor(height);
+                if (!view->chunks[i])
+                    view->chunks[i] = new BlockChainChunk;
             }
-            if (have.size() > 10)
-                step *= 2;
+            // entries above the current height are stale or unset, only the ones below can end the walk early
+            int lowest = block->height + 1;
+            while (block && (block->height > current->height || current->getBlock(block->height) != block))
+            {
+                setEntry(*current, *view, block->height, block, replaced);
+                lowest = block->height;
+                block = block->getPrevious();
+            }
+            // the chunks up to the tip now hold published entries, later changes below them must copy
+            for (int h = lowest; h <= view->height; h = (h | (BLOCK_CHAIN_CHUNK_SIZE - 1)) + 1)
+            {
+                BlockChainChunk* chunk = view->chunks[h >> BLOCK_CHAIN_CHUNK_SHIFT];
+                int end = std::min(view->height - (h & ~(BLOCK_CHAIN_CHUNK_SIZE - 1)) + 1, BLOCK_CHAIN_CHUNK_SIZE);
+                if (chunk->published < end)
+                    chunk->published = end;
+            }
+        }
+        else
+        {
+            replaced = current->chunks;
         }
+        m_view.store(view, std::memory_order_release);
+        retireEpochObject([current, replaced]() {
+            for (BlockChainChunk* chunk : replaced)
+            {
+                delete chunk;
+            }
+            delete current;
+        });
     }
 
 private:
+    // writes one height of the new view, a chunk whose entry a published view may read is copied first
+    static void setEntry(const BlockChainView& current, BlockChainView& view, int height, BlockIndex* block, std::vector<BlockChainChunk*>& replaced)
+    {
+        size_t index = height >> BLOCK_CHAIN_CHUNK_SHIFT;
+        int offset = height & (BLOCK_CHAIN_CHUNK_SIZE - 1);
+        BlockChainChunk* chunk = view.chunks[index];
+        if (offset < chunk->published && index < current.chunks.size() && current.chunks[index] == chunk)
+        {
+            BlockChainChunk* copy = new BlockChainChunk(*chunk);
+            replaced.push_back(chunk);
+            view.chunks[index] = copy;
+            chunk = copy;
+        }
+        chunk->blocks[offset] = block;
+    }
+
 private:
     XUL_LOGGER_DEFINE();
-    std::vector<BlockIndexPtr> m_blocks;
+    std::atomic<const BlockChainView*> m_view;
 };
 
 
@@ -121,8 +207,8 @@ BlockIndex* findLastCommonAncestor(BlockIndex* x, BlockIndex* y)
 
     while (x != y && x && y)
     {
-        x = x->previous.get();
-        y = y->previous.get();
+        x = x->getPrevious();
+        y = y->getPrevious();
     }
 
     // Eventually all chain branches meet at the genesis block.
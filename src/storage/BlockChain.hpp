@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util/number.hpp"
+#include "util/Epoch.hpp"
 #include <xul/lang/object.hpp>
 #include <vector>
 
@@ -15,6 +16,60 @@ class BlockStorage;
 class AppConfig;
 class ChainParams;
 
+const int BLOCK_CHAIN_CHUNK_SHIFT = 12;
+const int BLOCK_CHAIN_CHUNK_SIZE = 1 << BLOCK_CHAIN_CHUNK_SHIFT;
+
+// a fixed run of heights of the active chain, shared by every view it did not change between
+class BlockChainChunk
+{
+public:
+    BlockIndex* blocks[BLOCK_CHAIN_CHUNK_SIZE];
+    // entries below this were visible in a published view and are copied before they change, writer only
+    int published;
+
+    BlockChainChunk() : published(0)
+    {
+    }
+};
+
+/**
+ * Immutable picture of the active chain at one tip. Views share their chunks, so publishing a new tip copies
+ * the chunk table and at most the chunks a reorganization rewrites.
+ */
+class BlockChainView
+{
+public:
+    std::vector<BlockChainChunk*> chunks;
+    int height;
+
+    BlockChainView() : height(-1)
+    {
+    }
+
+    int getHeight() const
+    {
+        return height;
+    }
+    BlockIndex* getBlock(int h) const
+    {
+        if (h < 0 || h > height)
+            return nullptr;
+        return chunks[h >> BLOCK_CHAIN_CHUNK_SHIFT]->blocks[h & (BLOCK_CHAIN_CHUNK_SIZE - 1)];
+    }
+    BlockIndex* getTip() const
+    {
+        return getBlock(height);
+    }
+    bool contains(const BlockIndex* block) const;
+    BlockIndex* next(const BlockIndex* block) const;
+    void getLocator(std::vector<uint256>& have, BlockIndex* block) const;
+};
+
+/**
+ * The active chain. setTip runs on one thread at a time and publishes a new view with a single atomic store;
+ * readers on any thread never lock. The plain getters each read the current view on their own, a reader that
+ * needs several of them to agree holds an EpochGuard and works on getView.
+ */
 class BlockChain : public xul::object
 {
 public:
@@ -25,6 +80,8 @@ public:
     virtual void setTip(BlockIndex* block) = 0;
     virtual BlockIndex* getBlock(int height) const = 0;
     virtual void getLocator(std::vector<uint256>& have, BlockIndex* block) const = 0;
+    // valid until the EpochGuard of the caller ends
+    virtual const BlockChainView* getView() const = 0;
 };
 
 BlockChain* createBlockChain();
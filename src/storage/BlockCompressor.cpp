@@ -0,0 +1,63 @@
+#include "BlockCompressor.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+
+#include <zlib.h>
+
+
+namespace xbtc {
+
+
+class ZlibBlockCompressor : public xul::object_impl<BlockCompressor>
+{
+public:
+    explicit ZlibBlockCompressor(int level) : m_level(level)
+    {
+        XUL_LOGGER_INIT("ZlibBlockCompressor");
+        XUL_REL_EVENT("new " << level);
+    }
+
+    virtual bool compress(const uint8_t* data, size_t size, std::string& output)
+    {
+        uLongf destSize = compressBound(size);
+        output.resize(destSize);
+        int ret = compress2(reinterpret_cast<Bytef*>(&output[0]), &destSize, data, size, m_level);
+        if (ret != Z_OK)
+        {
+            XUL_WARN("compress failed " << xul::make_tuple(ret, size));
+            return false;
+        }
+        if (destSize >= size)
+            return false;
+        output.resize(destSize);
+        return true;
+    }
+    virtual size_t getMaxCompressedSize(size_t size) const
+    {
+        return compressBound(size);
+    }
+    virtual bool decompress(const uint8_t* data, size_t size, uint8_t* output, size_t rawSize)
+    {
+        uLongf destSize = rawSize;
+        int ret = uncompress(output, &destSize, data, size);
+        if (ret != Z_OK || destSize != rawSize)
+        {
+            XUL_WARN("decompress failed " << xul::make_tuple(ret, size, rawSize, destSize));
+            return false;
+        }
+        return true;
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    const int m_level;
+};
+
+
+BlockCompressor* createZlibBlockCompressor(int level)
+{
+    return new ZlibBlockCompressor(level);
+}
+
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+// codec for serialized blocks kept in blk?????.dat files
+class BlockCompressor : public xul::object
+{
+public:
+    // replaces the content of output, fails if the compressed data would not be smaller than the input
+    virtual bool compress(const uint8_t* data, size_t size, std::string& output) = 0;
+    // the room compress needs in output for size bytes of input, a buffer that large is never reallocated
+    virtual size_t getMaxCompressedSize(size_t size) const = 0;
+    // rawSize must be the exact size of the data before compression
+    virtual bool decompress(const uint8_t* data, size_t size, uint8_t* output, size_t rawSize) = 0;
+};
+
+BlockCompressor* createZlibBlockCompressor(int level);
+
+}
@@ -0,0 +1,155 @@
+#include "BlockDecodePool.hpp"
+#include "AppInfo.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/net/io_services.hpp>
+#include <xul/log/log.hpp>
+#include <xul/io/data_input_stream.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace xbtc {
+
+
+class BlockDecodePoolImpl : public xul::object_impl<BlockDecodePool>
+{
+public:
+    class DecodeRequest
+    {
+    public:
+        BlockDecodeTask task;
+        BlockDecodeResult result;
+
+        DecodeRequest() {}
+        DecodeRequest(const BlockDecodeTask& t, const BlockDecodeResult& r) : task(t), result(r) {}
+    };
+    // shared with the results posted to the main io service, a worker may drop the last reference, which frees nothing else
+    class DeliveryState
+    {
+    public:
+        // main io service only
+        bool stopped;
+
+        DeliveryState() : stopped(false) {}
+    };
+
+    explicit BlockDecodePoolImpl(AppInfo* appInfo) : m_appInfo(appInfo), m_stopped(false), m_delivery(std::make_shared<DeliveryState>())
+    {
+        XUL_LOGGER_INIT("BlockDecodePool");
+        XUL_EVENT("new");
+    }
+    ~BlockDecodePoolImpl()
+    {
+        XUL_EVENT("delete");
+        stop();
+    }
+
+    virtual void start(int maxThreads)
+    {
+        assert(m_workers.empty() && !m_stopped);
+        int workerCount = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 1;
+        if (workerCount > maxThreads)
+            workerCount = maxThreads;
+        XUL_REL_EVENT("start " << workerCount);
+        for (int i = 0; i < workerCount; ++i)
+        {
+            m_workers.push_back(std::thread(std::bind(&BlockDecodePoolImpl::runWorker, this)));
+        }
+    }
+    virtual void stop()
+    {
+        m_delivery->stopped = true;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+            m_requests.clear();
+        }
+        m_requestCondition.notify_all();
+        for (auto& worker : m_workers)
+        {
+            if (worker.joinable())
+                worker.join();
+        }
+        m_workers.clear();
+    }
+    virtual void decode(const BlockDecodeTask& task, const BlockDecodeResult& result)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopped)
+                return;
+            m_requests.push_back(DecodeRequest(task, result));
+        }
+        m_requestCondition.notify_one();
+    }
+
+private:
+    // worker threads
+    void runWorker()
+    {
+        for (;;)
+        {
+            DecodeRequest request;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_requestCondition.wait(lock, [this] { return m_stopped || !m_requests.empty(); });
+                if (m_stopped)
+                    break;
+                request = m_requests.front();
+                m_requests.pop_front();
+            }
+            BlockPtr block = request.task();
+            // the buffers the task holds go back to the pool here instead of on the main thread
+            request.task = BlockDecodeTask();
+            std::shared_ptr<DeliveryState> delivery = m_delivery;
+            BlockDecodeResult result = request.result;
+            xul::io_services::post(m_appInfo->getIOService(), [delivery, block, result]() {
+                // decoded before the stop, the owner of the result may be gone
+                if (!delivery->stopped)
+                    result(block);
+            });
+        }
+    }
+
+private:
+    XUL_LOGGER_DEFINE();
+    boost::intrusive_ptr<AppInfo> m_appInfo;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_requestCondition;
+    std::deque<DecodeRequest> m_requests;
+    bool m_stopped;
+    // set once in the constructor, the workers only copy the pointer
+    const std::shared_ptr<DeliveryState> m_delivery;
+};
+
+
+BlockDecodePool* createBlockDecodePool(AppInfo* appInfo)
+{
+    return new BlockDecodePoolImpl(appInfo);
+}
+
+BlockPtr decodeBlockData(const uint8_t* data, size_t size)
+{
+    uint8_t dummybuf[1];
+    xul::memory_data_input_stream is(size == 0 ? dummybuf : data, size, false);
+    BlockPtr block = createBlock();
+    is >> *block;
+    if (!is.good())
+        return BlockPtr();
+    block->header.computeHash();
+    for (auto& tx : block->transactions)
+    {
+        tx.computeHash();
+    }
+    return block;
+}
+
+
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "data/Block.hpp"
+#include <xul/lang/object.hpp>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+class AppInfo;
+
+// runs on a worker thread, a null block means the data is not a valid block
+typedef std::function<BlockPtr ()> BlockDecodeTask;
+// runs on the main io service with the block the task returned
+typedef std::function<void (const BlockPtr&)> BlockDecodeResult;
+
+/**
+ * Worker threads shared by the block decoder and the block importer. The tasks run on the workers, their results
+ * are posted back to the main io service. The workers hold no reference to the pool or its owner, so the last
+ * reference is always dropped where start and stop are called, never on a worker that stop would have to join.
+ * The owner calls stop before it goes away: a result that was not delivered by then is dropped, which lets the
+ * result callbacks use the raw owner pointer.
+ */
+class BlockDecodePool : public xul::object
+{
+public:
+    virtual void start(int maxThreads) = 0;
+    // main io service, the tasks still queued are dropped, the results of running ones are never delivered
+    virtual void stop() = 0;
+    virtual void decode(const BlockDecodeTask& task, const BlockDecodeResult& result) = 0;
+};
+
+BlockDecodePool* createBlockDecodePool(AppInfo* appInfo);
+
+// parses a serialized block and computes the block and transaction hashes, null if the data is not a whole block
+BlockPtr decodeBlockData(const uint8_t* data, size_t size);
+
+}
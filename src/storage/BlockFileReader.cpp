@@ -0,0 +1,173 @@
+#include "BlockFileReader.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/std/strings.hpp>
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace xbtc {
+
+
+class BlockFileMappingImpl : public xul::object_impl<BlockFileMapping>
+{
+public:
+    explicit BlockFileMappingImpl(void* data, size_t size) : m_data(data), m_size(size)
+    {
+    }
+    ~BlockFileMappingImpl()
+    {
+        ::munmap(m_data, m_size);
+    }
+    virtual const uint8_t* getData() const
+    {
+        return static_cast<const uint8_t*>(m_data);
+    }
+    virtual size_t getSize() const
+    {
+        return m_size;
+    }
+    virtual void adviseSequential()
+    {
+        ::madvise(m_data, m_size, MADV_SEQUENTIAL);
+    }
+    virtual void adviseRandom()
+    {
+        ::madvise(m_data, m_size, MADV_RANDOM);
+    }
+    virtual void prefetch(size_t offset, size_t size)
+    {
+        if (offset >= m_size)
+            return;
+        if (size > m_size - offset)
+            size = m_size - offset;
+        size_t pageSize = ::sysconf(_SC_PAGESIZE);
+        size_t start = offset / pageSize * pageSize;
+        ::madvise(static_cast<uint8_t*>(m_data) + start, size + offset - start, MADV_WILLNEED);
+    }
+private:
+    void* m_data;
+    size_t m_size;
+};
+
+
+class BlockFileReaderImpl : public xul::object_impl<BlockFileReader>
+{
+public:
+    typedef boost::intrusive_ptr<BlockFileMapping> BlockFileMappingPtr;
+    typedef std::list<int> LRUList;
+    typedef std::pair<BlockFileMappingPtr, LRUList::iterator> MappingItem;
+    typedef std::unordered_map<int, MappingItem> MappingTable;
+
+    explicit BlockFileReaderImpl(const std::string& dataDir, int maxMappings) : m_dataDir(dataDir), m_maxMappings(maxMappings)
+    {
+        XUL_LOGGER_INIT("BlockFileReader");
+        XUL_REL_EVENT("new " << maxMappings);
+        assert(m_maxMappings > 0);
+    }
+    ~BlockFileReaderImpl()
+    {
+        XUL_REL_EVENT("delete");
+    }
+
+    virtual BlockFileMappingPtr getMapping(int fileIndex, size_t minSize)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_mappings.find(fileIndex);
+        if (iter != m_mappings.end())
+        {
+            MappingItem& item = iter->second;
+            if (item.first->getSize() >= minSize)
+            {
+                m_lru.splice(m_lru.begin(), m_lru, item.second);
+                return item.first;
+            }
+            // the file has grown since it was mapped, readers still holding the old mapping keep it alive
+            m_lru.erase(item.second);
+            m_mappings.erase(iter);
+        }
+        BlockFileMappingPtr mapping = mapFile(fileIndex);
+        if (!mapping)
+            return BlockFileMappingPtr();
+        m_lru.push_front(fileIndex);
+        m_mappings[fileIndex] = std::make_pair(mapping, m_lru.begin());
+        while (m_mappings.size() > static_cast<size_t>(m_maxMappings))
+        {
+            m_mappings.erase(m_lru.back());
+            m_lru.pop_back();
+        }
+        if (mapping->getSize() < minSize)
+            return BlockFileMappingPtr();
+        return mapping;
+    }
+    virtual void removeMapping(int fileIndex)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_mappings.find(fileIndex);
+        if (iter == m_mappings.end())
+            return;
+        m_lru.erase(iter->second.second);
+        m_mappings.erase(iter);
+    }
+    virtual void clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_mappings.clear();
+        m_lru.clear();
+    }
+private:
+    BlockFileMapping* mapFile(int fileIndex)
+    {
+        std::string filepath = xul::paths::join(m_dataDir, xul::strings::format("blocks/blk%05u.dat", fileIndex));
+        int fd = ::open(filepath.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            XUL_DEBUG("mapFile failed to open " << filepath);
+            return nullptr;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        // the mapping stays valid after the descriptor is closed
+        ::close(fd);
+        if (data == MAP_FAILED)
+        {
+            XUL_WARN("mapFile failed to map " << filepath << " " << size);
+            return nullptr;
+        }
+        BlockFileMapping* mapping = new BlockFileMappingImpl(data, size);
+        // blocks are served in arbitrary order by default, sequential scans ask for read-ahead explicitly
+        mapping->adviseRandom();
+        XUL_DEBUG("mapFile " << filepath << " " << size);
+        return mapping;
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    const std::string m_dataDir;
+    const int m_maxMappings;
+    std::mutex m_mutex;
+    MappingTable m_mappings;
+    LRUList m_lru;
+};
+
+
+BlockFileReader* createBlockFileReader(const std::string& dataDir, int maxMappings)
+{
+    return new BlockFileReaderImpl(dataDir, maxMappings);
+}
+
+
+}
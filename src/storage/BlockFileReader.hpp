@@ -0,0 +1,36 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <xul/lang/object_ptr.hpp>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+class BlockFileMapping : public xul::object
+{
+public:
+    virtual const uint8_t* getData() const = 0;
+    virtual size_t getSize() const = 0;
+    virtual void adviseSequential() = 0;
+    virtual void adviseRandom() = 0;
+    // starts reading the range in ahead of the accesses, one readahead instead of a fault per page
+    virtual void prefetch(size_t offset, size_t size) = 0;
+};
+
+// keeps read-only mappings of blk?????.dat files, the least recently used ones are unmapped first
+class BlockFileReader : public xul::object
+{
+public:
+    // the mapping returned covers at least minSize bytes, or null if the file is shorter than that
+    virtual boost::intrusive_ptr<BlockFileMapping> getMapping(int fileIndex, size_t minSize) = 0;
+    virtual void removeMapping(int fileIndex) = 0;
+    virtual void clear() = 0;
+};
+
+BlockFileReader* createBlockFileReader(const std::string& dataDir, int maxMappings);
+
+}
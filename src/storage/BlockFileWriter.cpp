@@ -0,0 +1,470 @@
+#include "BlockFileWriter.hpp"
+#include "db.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/std/strings.hpp>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#if defined(XBTC_USE_IO_URING)
+#include <liburing.h>
+#endif
+
+
+namespace xbtc {
+
+
+// moves the bytes to disk, the file handling around it stays the same for every backend
+class BlockWriteBackend
+{
+public:
+    virtual ~BlockWriteBackend() {}
+    virtual bool write(int fd, const void* data, size_t size, uint64_t position) = 0;
+    // everything written to fd so far is durable when this returns true
+    virtual bool sync(int fd) = 0;
+    // waits for outstanding writes, called before fd gets truncated or closed
+    virtual bool drain() = 0;
+    virtual const char* getName() const = 0;
+};
+
+static bool writeAll(int fd, const uint8_t* buf, size_t size, uint64_t position)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = ::pwrite(fd, buf, size, position);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += bytes;
+        position += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+class PosixWriteBackend : public BlockWriteBackend
+{
+public:
+    virtual bool write(int fd, const void* data, size_t size, uint64_t position)
+    {
+        return writeAll(fd, static_cast<const uint8_t*>(data), size, position);
+    }
+    virtual bool sync(int fd)
+    {
+#if defined(__APPLE__)
+        return ::fcntl(fd, F_FULLFSYNC, 0) == 0;
+#elif defined(__linux__)
+        return ::fdatasync(fd) == 0;
+#else
+        return ::fsync(fd) == 0;
+#endif
+    }
+    virtual bool drain()
+    {
+        return true;
+    }
+    virtual const char* getName() const
+    {
+        return "posix";
+    }
+};
+
+#if defined(XBTC_USE_IO_URING)
+
+// appends are gathered into staging buffers that are written asynchronously, several of them in flight at once,
+// a sync queues a drained fdatasync behind them so one thread keeps the device queue filled
+class UringWriteBackend : public BlockWriteBackend
+{
+public:
+    UringWriteBackend() : m_ready(false), m_failed(false), m_registeredFd(-1), m_inFlight(0), m_staging(-1), m_stagingFd(-1), m_stagingPosition(0)
+    {
+    }
+    ~UringWriteBackend()
+    {
+        if (!m_ready)
+            return;
+        drain();
+        io_uring_queue_exit(&m_ring);
+    }
+    bool init()
+    {
+        if (io_uring_queue_init(BLOCK_WRITE_QUEUE_DEPTH * 2, &m_ring, 0) < 0)
+            return false;
+        int fd = -1;
+        if (io_uring_register_files(&m_ring, &fd, 1) < 0)
+        {
+            io_uring_queue_exit(&m_ring);
+            return false;
+        }
+        m_buffers.resize(BLOCK_WRITE_QUEUE_DEPTH);
+        for (int i = 0; i < BLOCK_WRITE_QUEUE_DEPTH; ++i)
+        {
+            m_buffers[i].data.reserve(BLOCK_WRITE_STAGING_SIZE);
+            m_freeBuffers.push_back(i);
+        }
+        m_ready = true;
+        return true;
+    }
+    virtual bool write(int fd, const void* data, size_t size, uint64_t position)
+    {
+        if (m_failed)
+            return false;
+        if (fd != m_registeredFd && !registerFile(fd))
+            return false;
+        if (m_staging >= 0 && position != m_stagingPosition + m_buffers[m_staging].data.size())
+            submitStaging();
+        const uint8_t* buf = static_cast<const uint8_t*>(data);
+        while (size > 0)
+        {
+            if (m_staging < 0)
+            {
+                m_staging = acquireBuffer();
+                if (m_staging < 0)
+                    return false;
+                m_stagingFd = fd;
+                m_stagingPosition = position;
+            }
+            std::string& staging = m_buffers[m_staging].data;
+            size_t bytes = std::min(size, BLOCK_WRITE_STAGING_SIZE - staging.size());
+            staging.append(reinterpret_cast<const char*>(buf), bytes);
+            buf += bytes;
+            position += bytes;
+            size -= bytes;
+            if (staging.size() >= BLOCK_WRITE_STAGING_SIZE)
+                submitStaging();
+        }
+        return !m_failed;
+    }
+    virtual bool sync(int fd)
+    {
+        submitStaging();
+        io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+            return false;
+        io_uring_prep_fsync(sqe, 0, IORING_FSYNC_DATASYNC);
+        // the drain flag holds the fsync back until every write queued before it has completed
+        sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_DRAIN;
+        io_uring_sqe_set_data(sqe, nullptr);
+        ++m_inFlight;
+        io_uring_submit(&m_ring);
+        return drain();
+    }
+    virtual bool drain()
+    {
+        submitStaging();
+        while (m_inFlight > 0)
+        {
+            reapCompletion();
+        }
+        bool ok = !m_failed;
+        m_failed = false;
+        return ok;
+    }
+    virtual const char* getName() const
+    {
+        return "io_uring";
+    }
+private:
+    class StagingBuffer
+    {
+    public:
+        std::string data;
+        int fd;
+        uint64_t position;
+    };
+
+    bool registerFile(int fd)
+    {
+        if (!drain())
+            return false;
+        if (io_uring_register_files_update(&m_ring, 0, &fd, 1) < 0)
+        {
+            m_failed = true;
+            return false;
+        }
+        m_registeredFd = fd;
+        return true;
+    }
+    int acquireBuffer()
+    {
+        while (m_freeBuffers.empty() && m_inFlight > 0)
+        {
+            reapCompletion();
+        }
+        if (m_freeBuffers.empty())
+            return -1;
+        int index = m_freeBuffers.back();
+        m_freeBuffers.pop_back();
+        m_buffers[index].data.clear();
+        return index;
+    }
+    io_uring_sqe* getSqe()
+    {
+        io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+        while (!sqe && m_inFlight > 0)
+        {
+            reapCompletion();
+            sqe = io_uring_get_sqe(&m_ring);
+        }
+        return sqe;
+    }
+    void submitStaging()
+    {
+        if (m_staging < 0)
+            return;
+        StagingBuffer& buffer = m_buffers[m_staging];
+        buffer.fd = m_stagingFd;
+        buffer.position = m_stagingPosition;
+        io_uring_sqe* sqe = getSqe();
+        if (!sqe)
+        {
+            m_failed = !writeAll(buffer.fd, reinterpret_cast<const uint8_t*>(buffer.data.data()), buffer.data.size(), buffer.position) || m_failed;
+            m_freeBuffers.push_back(m_staging);
+            m_staging = -1;
+            return;
+        }
+        io_uring_prep_write(sqe, 0, buffer.data.data(), buffer.data.size(), buffer.position);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        io_uring_sqe_set_data(sqe, &buffer);
+        ++m_inFlight;
+        m_staging = -1;
+        io_uring_submit(&m_ring);
+    }
+    void reapCompletion()
+    {
+        io_uring_cqe* cqe = nullptr;
+        int ret = io_uring_wait_cqe(&m_ring, &cqe);
+        if (ret < 0)
+        {
+            if (ret == -EINTR)
+                return;
+            // the ring is unusable, nothing more will complete
+            m_failed = true;
+            m_inFlight = 0;
+            return;
+        }
+        StagingBuffer* buffer = static_cast<StagingBuffer*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(&m_ring, cqe);
+        --m_inFlight;
+        if (!buffer)
+        {
+            if (res < 0)
+                m_failed = true;
+            return;
+        }
+        if (res < 0)
+        {
+            m_failed = true;
+        }
+        else if (static_cast<size_t>(res) < buffer->data.size())
+        {
+            // finish a short write synchronously
+            m_failed = !writeAll(buffer->fd, reinterpret_cast<const uint8_t*>(buffer->data.data()) + res, buffer->data.size() - res, buffer->position + res) || m_failed;
+        }
+        m_freeBuffers.push_back(static_cast<int>(buffer - &m_buffers[0]));
+    }
+private:
+    io_uring m_ring;
+    bool m_ready;
+    bool m_failed;
+    int m_registeredFd;
+    int m_inFlight;
+    std::vector<StagingBuffer> m_buffers;
+    std::vector<int> m_freeBuffers;
+    int m_staging;
+    int m_stagingFd;
+    uint64_t m_stagingPosition;
+};
+
+#endif
+
+static BlockWriteBackend* createBlockWriteBackend()
+{
+#if defined(XBTC_USE_IO_URING)
+    std::unique_ptr<UringWriteBackend> backend(new UringWriteBackend);
+    if (backend->init())
+        return backend.release();
+    // kernels without io_uring, or with it disabled, keep the plain path
+#endif
+    return new PosixWriteBackend;
+}
+
+
+class BlockFileWriterImpl : public xul::object_impl<BlockFileWriter>
+{
+public:
+    explicit BlockFileWriterImpl(const std::string& dataDir, unsigned chunkSize)
+        : m_dataDir(dataDir), m_chunkSize(chunkSize), m_fd(-1), m_fileIndex(-1), m_allocatedSize(0), m_writtenSize(0), m_dirty(false)
+    {
+        XUL_LOGGER_INIT("BlockFileWriter");
+        assert(m_chunkSize > 0);
+        m_backend.reset(createBlockWriteBackend());
+        XUL_REL_EVENT("new " << chunkSize << " " << m_backend->getName());
+    }
+    ~BlockFileWriterImpl()
+    {
+        XUL_REL_EVENT("delete");
+        close();
+    }
+
+    virtual bool write(int fileIndex, unsigned position, const void* data, size_t size)
+    {
+        if (fileIndex != m_fileIndex && !openFile(fileIndex, position))
+            return false;
+        uint64_t endPos = static_cast<uint64_t>(position) + size;
+        if (endPos > m_allocatedSize)
+        {
+            allocate(endPos);
+        }
+        if (!m_backend->write(m_fd, data, size, position))
+        {
+            XUL_ERROR("write failed " << xul::make_tuple(fileIndex, position, size, errno));
+            return false;
+        }
+        if (endPos > m_writtenSize)
+            m_writtenSize = endPos;
+        m_dirty = true;
+        return true;
+    }
+    virtual bool sync()
+    {
+        if (m_fd < 0 || !m_dirty)
+            return true;
+        if (!m_backend->sync(m_fd))
+        {
+            XUL_ERROR("sync failed " << xul::make_tuple(m_fileIndex, errno));
+            return false;
+        }
+        m_dirty = false;
+        return true;
+    }
+    virtual void close()
+    {
+        if (m_fd < 0)
+            return;
+        if (!m_backend->drain())
+        {
+            XUL_ERROR("close failed to complete writes " << m_fileIndex);
+        }
+        // give back the unused tail of the last preallocated chunk
+        if (m_allocatedSize > m_writtenSize && ::ftruncate(m_fd, m_writtenSize) != 0)
+        {
+            XUL_WARN("close failed to truncate " << xul::make_tuple(m_fileIndex, m_writtenSize, errno));
+        }
+        sync();
+        ::close(m_fd);
+        m_fd = -1;
+        m_fileIndex = -1;
+        m_allocatedSize = 0;
+        m_writtenSize = 0;
+        m_dirty = false;
+    }
+private:
+    // dataSize is where the data of the file ends by its block file info, a longer file has a preallocated tail
+    // left behind by a crash, which is cut off so it is never taken for data
+    bool openFile(int fileIndex, uint64_t dataSize)
+    {
+        // the writes to the previous file must not be taken as durable by a later sync of this one
+        if (!sync())
+            return false;
+        close();
+        std::string filepath = xul::paths::join(m_dataDir, xul::strings::format("blocks/blk%05u.dat", fileIndex));
+        int fd = ::open(filepath.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            XUL_ERROR("openFile failed " << filepath << " " << errno);
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        uint64_t fileSize = st.st_size;
+        if (fileSize > dataSize)
+        {
+            XUL_REL_EVENT("openFile trim tail " << filepath << " " << xul::make_tuple(fileSize, dataSize));
+            if (::ftruncate(fd, dataSize) != 0)
+            {
+                XUL_ERROR("openFile failed to truncate " << filepath << " " << errno);
+                ::close(fd);
+                return false;
+            }
+            fileSize = dataSize;
+        }
+        m_fd = fd;
+        m_fileIndex = fileIndex;
+        m_allocatedSize = fileSize;
+        m_writtenSize = fileSize;
+        XUL_DEBUG("openFile " << filepath << " " << m_allocatedSize);
+        return true;
+    }
+    void allocate(uint64_t endPos)
+    {
+        uint64_t newSize = (endPos + m_chunkSize - 1) / m_chunkSize * m_chunkSize;
+        // preallocation is only an optimization, a failure here surfaces as a write error if the disk is really full
+#if defined(__linux__)
+        if (::posix_fallocate(m_fd, m_allocatedSize, newSize - m_allocatedSize) != 0)
+        {
+            XUL_WARN("allocate failed " << xul::make_tuple(m_fileIndex, m_allocatedSize, newSize));
+            return;
+        }
+#elif defined(__APPLE__)
+        fstore_t store;
+        store.fst_flags = F_ALLOCATECONTIG;
+        store.fst_posmode = F_PEOFPOSMODE;
+        store.fst_offset = 0;
+        store.fst_length = newSize - m_allocatedSize;
+        store.fst_bytesalloc = 0;
+        if (::fcntl(m_fd, F_PREALLOCATE, &store) == -1)
+        {
+            store.fst_flags = F_ALLOCATEALL;
+            ::fcntl(m_fd, F_PREALLOCATE, &store);
+        }
+        if (::ftruncate(m_fd, newSize) != 0)
+        {
+            XUL_WARN("allocate failed " << xul::make_tuple(m_fileIndex, m_allocatedSize, newSize));
+            return;
+        }
+#else
+        if (::ftruncate(m_fd, newSize) != 0)
+            return;
+#endif
+        m_allocatedSize = newSize;
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    const std::string m_dataDir;
+    const unsigned m_chunkSize;
+    int m_fd;
+    int m_fileIndex;
+    uint64_t m_allocatedSize;
+    uint64_t m_writtenSize;
+    bool m_dirty;
+    std::unique_ptr<BlockWriteBackend> m_backend;
+};
+
+
+BlockFileWriter* createBlockFileWriter(const std::string& dataDir, unsigned chunkSize)
+{
+    return new BlockFileWriterImpl(dataDir, chunkSize);
+}
+
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+// appends to blk?????.dat files through one persistent descriptor, growing the files in preallocated chunks
+class BlockFileWriter : public xul::object
+{
+public:
+    // the first write after a file is opened goes to the end of its data as the block file info has it, anything
+    // in the file past that position is cut off
+    virtual bool write(int fileIndex, unsigned position, const void* data, size_t size) = 0;
+    // make everything written since the last sync durable
+    virtual bool sync() = 0;
+    virtual void close() = 0;
+};
+
+BlockFileWriter* createBlockFileWriter(const std::string& dataDir, unsigned chunkSize);
+
+}
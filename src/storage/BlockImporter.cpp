@@ -0,0 +1,463 @@
+#include "BlockImporter.hpp"
+#include "BlockCache.hpp"
+#include "BlockCompressor.hpp"
+#include "BlockIndexSnapshot.hpp"
+#include "BlockIndexJournal.hpp"
+#include "ChainParams.hpp"
+#include "BlockDecodePool.hpp"
+#include "BlockOrphanTable.hpp"
+#include "data/Block.hpp"
+#include "AppInfo.hpp"
+#include "AppConfig.hpp"
+#include "db.hpp"
+#include "util/BufferPool.hpp"
+
+#include <leveldb/db.h>
+#include <leveldb/options.h>
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+#include <xul/util/time_counter.hpp>
+#include <xul/io/data_encoding.hpp>
+#include <xul/data/bit_converter.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/os/file_system.hpp>
+#include <xul/std/strings.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+namespace xbtc {
+
+
+class BlockImporterImpl : public xul::object_impl<BlockImporter>
+{
+public:
+    class ImportRecord
+    {
+    public:
+        PooledBuffer data;
+        bool compressed;
+        // where the record lies in a block file of the data dir, the file index is -1 for other files
+        DiskBlockPos pos;
+
+        ImportRecord() : compressed(false) {}
+        ImportRecord(const PooledBuffer& d, bool c, const DiskBlockPos& p) : data(d), compressed(c), pos(p) {}
+    };
+    class OrphanBlock
+    {
+    public:
+        BlockPtr block;
+        DiskBlockPos pos;
+        size_t bytes;
+
+        OrphanBlock() : bytes(0) {}
+        OrphanBlock(const BlockPtr& b, const DiskBlockPos& p, size_t n) : block(b), pos(p), bytes(n) {}
+    };
+    typedef BlockOrphanTable<OrphanBlock> OrphanBlockTable;
+    // data[begin, end) holds the bytes of the file from offset + begin on
+    class ReadBuffer
+    {
+    public:
+        std::vector<uint8_t> data;
+        uint64_t offset;
+        size_t begin;
+        size_t end;
+
+        explicit ReadBuffer(size_t size) : data(size), offset(0), begin(0), end(0) {}
+    };
+
+    explicit BlockImporterImpl(AppInfo* appInfo)
+        : m_appInfo(appInfo), m_reindexFiles(0), m_stopped(false), m_readerFinished(false), m_readerDone(false), m_inFlight(0), m_orphanBytes(0)
+        , m_failedCount(0), m_importedCount(0), m_skippedCount(0), m_rejectedCount(0), m_droppedCount(0)
+    {
+        XUL_LOGGER_INIT("BlockImporter");
+        XUL_REL_EVENT("new");
+        m_compressor = createZlibBlockCompressor(1);
+        m_pool = createBlockDecodePool(appInfo);
+    }
+    ~BlockImporterImpl()
+    {
+        XUL_REL_EVENT("delete");
+        stop();
+    }
+
+    virtual void start(const std::vector<std::string>& files, size_t reindexFiles, const std::function<void()>& callback)
+    {
+        assert(!m_reader.joinable());
+        assert(reindexFiles <= files.size());
+        m_files = files;
+        m_reindexFiles = reindexFiles;
+        m_callback = callback;
+        m_startTime.sync();
+        XUL_REL_EVENT("start " << xul::make_tuple(m_files.size(), reindexFiles));
+        m_pool->start(MAX_IMPORT_THREADS);
+        m_reader = std::thread(std::bind(&BlockImporterImpl::runReader, this));
+    }
+    virtual void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+        }
+        m_slotCondition.notify_all();
+        joinThreads();
+    }
+private:
+    void joinThreads()
+    {
+        if (m_reader.joinable())
+            m_reader.join();
+        m_pool->stop();
+    }
+    // reader thread
+    void runReader()
+    {
+        for (size_t i = 0; i < m_files.size(); ++i)
+        {
+            if (m_stopped)
+                break;
+            // reindexed files are listed in file index order
+            readFile(m_files[i], i < m_reindexFiles ? static_cast<int>(i) : -1);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_readerFinished = true;
+        }
+        // queued behind every record, its result tells the main io service that no more records are coming
+        m_pool->decode([]() { return BlockPtr(); }, [this](const BlockPtr&) { onReaderFinished(); });
+    }
+    void readFile(const std::string& filepath, int fileIndex)
+    {
+        FILE* fp = fopen(filepath.c_str(), "rb");
+        if (!fp)
+        {
+            XUL_WARN("readFile failed to open " << filepath << " " << errno);
+            return;
+        }
+        uint8_t magic[4];
+        xul::bit_converter::little_endian().from_dword(magic, m_appInfo->getChainParams()->protocolMagic);
+        ReadBuffer buffer(1024 * 1024);
+        size_t need = 8;
+        int records = 0;
+        // records are located by their magic, garbage and preallocated zeros between them are skipped
+        while (!m_stopped && fillBuffer(fp, buffer, need))
+        {
+            need = 8;
+            const uint8_t* first = &buffer.data[0] + buffer.begin;
+            const uint8_t* last = &buffer.data[0] + buffer.end;
+            const uint8_t* found = std::search(first, last, magic, magic + 4);
+            if (last - found < 8)
+            {
+                // keep what may be the start of a record, the next read completes it
+                buffer.begin = (found != last) ? static_cast<size_t>(found - &buffer.data[0]) : buffer.end - 3;
+                need = buffer.end - buffer.begin + 1;
+                continue;
+            }
+            uint64_t position = buffer.offset + (found - &buffer.data[0]);
+            uint32_t size = xul::bit_converter::little_endian().to_dword(found + 4);
+            bool compressed = (size & BLOCK_COMPRESSED_FLAG) != 0;
+            size &= ~BLOCK_COMPRESSED_FLAG;
+            buffer.begin = static_cast<size_t>(found + 8 - &buffer.data[0]);
+            if (size < 80 || size > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+            if (!fillBuffer(fp, buffer, size))
+                break;
+            PooledBuffer data = m_appInfo->getBufferPool()->allocate(size);
+            data->assign(reinterpret_cast<const char*>(&buffer.data[buffer.begin]), size);
+            buffer.begin += size;
+            DiskBlockPos pos;
+            if (fileIndex >= 0)
+            {
+                pos = DiskBlockPos(fileIndex, static_cast<unsigned>(position));
+                pos.compressedSize = compressed ? size : 0;
+            }
+            if (!pushRecord(ImportRecord(data, compressed, pos)))
+                break;
+            ++records;
+        }
+        fclose(fp);
+        XUL_EVENT("readFile " << filepath << " " << xul::make_tuple(fileIndex, records, m_startTime.elapsed()));
+    }
+    // makes need bytes available from buffer.begin on, returns false if the file ends before
+    static bool fillBuffer(FILE* fp, ReadBuffer& buffer, size_t need)
+    {
+        if (buffer.end - buffer.begin >= need)
+            return true;
+        if (buffer.begin > 0)
+        {
+            memmove(&buffer.data[0], &buffer.data[buffer.begin], buffer.end - buffer.begin);
+            buffer.offset += buffer.begin;
+            buffer.end -= buffer.begin;
+            buffer.begin = 0;
+        }
+        if (buffer.data.size() < need)
+            buffer.data.resize(need);
+        while (buffer.end < need)
+        {
+            size_t bytes = fread(&buffer.data[buffer.end], 1, buffer.data.size() - buffer.end, fp);
+            if (bytes == 0)
+                return false;
+            buffer.end += bytes;
+        }
+        return true;
+    }
+    bool pushRecord(const ImportRecord& record)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // bounds the memory held by blocks read ahead of validation and by blocks waiting for their parent
+        m_slotCondition.wait(lock, [this] {
+            return m_stopped || (m_inFlight < MAX_IMPORT_BLOCKS_IN_FLIGHT && m_orphanBytes < MAX_IMPORT_ORPHAN_BYTES);
+        });
+        if (m_stopped)
+            return false;
+        ++m_inFlight;
+        lock.unlock();
+        // the pool is stopped before the importer goes away, so neither closure needs a reference to it
+        // a failed record still goes to the main io service, its slot is released there with the others
+        DiskBlockPos pos = record.pos;
+        m_pool->decode([this, record]() { return decodeRecord(record); },
+            [this, pos](const BlockPtr& block) { onBlockDecoded(block, pos); });
+        return true;
+    }
+    // worker threads
+    BlockPtr decodeRecord(const ImportRecord& record)
+    {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(record.data->data());
+        size_t size = record.data->size();
+        PooledBuffer rawData;
+        if (record.compressed)
+        {
+            if (size <= 4)
+                return BlockPtr();
+            uint32_t rawSize = xul::bit_converter::little_endian().to_dword(data);
+            if (rawSize == 0 || rawSize > MAX_BLOCK_SERIALIZED_SIZE)
+                return BlockPtr();
+            rawData = m_appInfo->getBufferPool()->allocate(rawSize);
+            if (!m_compressor->decompress(data + 4, size - 4, reinterpret_cast<uint8_t*>(&(*rawData)[0]), rawSize))
+                return BlockPtr();
+            data = reinterpret_cast<const uint8_t*>(rawData->data());
+            size = rawSize;
+        }
+        return decodeBlockData(data, size);
+    }
+    // main io service
+    void onBlockDecoded(const BlockPtr& block, const DiskBlockPos& pos)
+    {
+        if (block)
+            handleBlock(block, pos);
+        else
+            ++m_failedCount;
+        releaseSlot();
+        checkFinished();
+    }
+    void onReaderFinished()
+    {
+        m_readerDone = true;
+        checkFinished();
+    }
+    void checkFinished()
+    {
+        if (!m_readerDone)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_inFlight > 0)
+                return;
+        }
+        onImportFinished();
+    }
+    void handleBlock(const BlockPtr& block, const DiskBlockPos& pos)
+    {
+        BlockCache* cache = m_appInfo->getBlockCache();
+        if (hasBlockData(cache->getBlockIndex(block->getHash())))
+        {
+            ++m_skippedCount;
+            return;
+        }
+        if (!hasBlockData(cache->getBlockIndex(block->header.previousBlockHash)))
+        {
+            // blocks are not stored in chain order, park the block until its parent shows up
+            OrphanBlock orphan(block, pos, estimateBlockMemory(block.get()));
+            m_orphans.add(block->header.previousBlockHash, orphan);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_orphanBytes += orphan.bytes;
+            }
+            if (m_orphans.size() % 1000 == 0)
+            {
+                XUL_EVENT("handleBlock orphans " << xul::make_tuple(m_orphans.size(), m_orphanBytes));
+            }
+            return;
+        }
+        connectBlocks(OrphanBlock(block, pos, 0));
+    }
+    void releaseSlot()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            assert(m_inFlight > 0);
+            --m_inFlight;
+            // the reader waits for the orphan budget, with nothing left in flight no parent can come to free it
+            if (m_inFlight == 0 && !m_readerFinished && m_orphanBytes >= MAX_IMPORT_ORPHAN_BYTES)
+            {
+                dropOrphans();
+            }
+        }
+        m_slotCondition.notify_one();
+    }
+    // called with m_mutex held, the dropped blocks are left to the network
+    void dropOrphans()
+    {
+        size_t count = 0;
+        OrphanBlock orphan;
+        while (m_orphanBytes > MAX_IMPORT_ORPHAN_BYTES / 2 && m_orphans.takeAny(orphan))
+        {
+            m_orphanBytes -= orphan.bytes;
+            ++count;
+        }
+        m_droppedCount += count;
+        XUL_REL_WARN("dropOrphans " << xul::make_tuple(count, m_orphans.size(), m_orphanBytes));
+    }
+    void connectBlocks(const OrphanBlock& block)
+    {
+        BlockCache* cache = m_appInfo->getBlockCache();
+        std::deque<OrphanBlock> pending;
+        pending.push_back(block);
+        size_t freedBytes = 0;
+        while (!pending.empty())
+        {
+            OrphanBlock current = pending.front();
+            pending.pop_front();
+            freedBytes += current.bytes;
+            // reindexed blocks stay where they are, imported ones are written to the block files
+            BlockIndex* blockIndex = (current.pos.fileIndex >= 0)
+                ? cache->addStoredBlock(current.block.get(), current.pos) : cache->addBlock(current.block.get());
+            if (!blockIndex)
+            {
+                ++m_rejectedCount;
+                XUL_WARN("connectBlocks rejected " << current.block->getHash());
+                continue;
+            }
+            ++m_importedCount;
+            if (m_importedCount % 10000 == 0)
+            {
+                XUL_REL_EVENT("connectBlocks " << xul::make_tuple(m_importedCount, blockIndex->height, m_orphans.size(), m_startTime.elapsed()));
+            }
+            std::vector<OrphanBlock> children;
+            m_orphans.takeChildren(current.block->getHash(), children);
+            pending.insert(pending.end(), children.begin(), children.end());
+        }
+        if (freedBytes > 0)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_orphanBytes -= freedBytes;
+            }
+            m_slotCondition.notify_one();
+        }
+    }
+    void onImportFinished()
+    {
+        joinThreads();
+        XUL_REL_EVENT("onImportFinished " << xul::make_tuple(m_importedCount, m_skippedCount, m_rejectedCount, m_failedCount)
+                      << " " << xul::make_tuple(m_orphans.size(), m_droppedCount, m_startTime.elapsed()));
+        m_orphans.clear();
+        if (m_callback)
+        {
+            m_callback();
+        }
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    boost::intrusive_ptr<AppInfo> m_appInfo;
+    boost::intrusive_ptr<BlockCompressor> m_compressor;
+    std::vector<std::string> m_files;
+    size_t m_reindexFiles;
+    std::function<void()> m_callback;
+    std::thread m_reader;
+    boost::intrusive_ptr<BlockDecodePool> m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_slotCondition;
+    std::atomic<bool> m_stopped;
+    bool m_readerFinished;
+    // the result queued behind the last record has come back, main io service only
+    bool m_readerDone;
+    int m_inFlight;
+    // estimated memory of the parked orphans, written on the main io service and read by the reader
+    size_t m_orphanBytes;
+    int m_failedCount;
+    int m_importedCount;
+    int m_skippedCount;
+    int m_rejectedCount;
+    size_t m_droppedCount;
+    OrphanBlockTable m_orphans;
+    xul::time_counter m_startTime;
+};
+
+
+BlockImporter* createBlockImporter(AppInfo* appInfo)
+{
+    return new BlockImporterImpl(appInfo);
+}
+
+static std::string formatBlockFilePath(const std::string& dir, const char* prefix, int fileIndex)
+{
+    return xul::paths::join(dir, xul::strings::format("%s%05u.dat", prefix, fileIndex));
+}
+
+static bool fileExists(const std::string& filepath)
+{
+    return ::access(filepath.c_str(), F_OK) == 0;
+}
+
+bool prepareBlockReindex(const AppConfig* config, std::vector<std::string>& files)
+{
+    std::string blocksDir = xul::paths::join(config->dataDir, "blocks");
+    // the chain is rebuilt from the first block on, the files a pruned node deleted cannot be replaced from disk
+    if (config->prune > 0)
+    {
+        XUL_APP_REL_ERROR("prepareBlockReindex reindex is not supported in prune mode");
+        return false;
+    }
+    for (int fileIndex = 0; ; ++fileIndex)
+    {
+        std::string blockFile = formatBlockFilePath(blocksDir, "blk", fileIndex);
+        if (!fileExists(blockFile))
+            break;
+        files.push_back(blockFile);
+    }
+    if (files.empty() && fileExists(xul::paths::join(blocksDir, "index")))
+    {
+        XUL_APP_REL_ERROR("prepareBlockReindex first block file is missing, the block files were pruned " << blocksDir);
+        return false;
+    }
+    // a snapshot or journal of the old block indexes must not be applied to the rebuilt ones
+    ::unlink(getBlockIndexSnapshotPath(config->dataDir).c_str());
+    ::unlink(getBlockIndexJournalPath(config->dataDir).c_str());
+    const char* dbdirs[] = { "blocks/index", "chainstate" };
+    for (const char* dbdir : dbdirs)
+    {
+        leveldb::Status status = leveldb::DestroyDB(xul::paths::join(config->dataDir, dbdir), leveldb::Options());
+        if (!status.ok())
+        {
+            XUL_APP_REL_ERROR("prepareBlockReindex failed to destroy " << dbdir << " " << status.ToString());
+            return false;
+        }
+    }
+    XUL_APP_REL_EVENT("prepareBlockReindex " << files.size());
+    return true;
+}
+
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+namespace xbtc {
+
+
+class AppInfo;
+class AppConfig;
+
+// feeds blocks from blk?????.dat style files through the block cache without the network
+class BlockImporter : public xul::object
+{
+public:
+    // the callback runs on the main io service once every block read from the files has been handed to the block cache,
+    // the first reindexFiles files are the block files of the data dir in file index order, their blocks are indexed in place
+    virtual void start(const std::vector<std::string>& files, size_t reindexFiles, const std::function<void()>& callback) = 0;
+    // blocks read but not yet handed to the block cache are dropped, the callback of start does not run afterwards
+    virtual void stop() = 0;
+};
+
+BlockImporter* createBlockImporter(AppInfo* appInfo);
+
+// lists the existing block files and drops the block index and chainstate, must run before they are opened,
+// fails on a pruned node whose first block files are gone
+bool prepareBlockReindex(const AppConfig* config, std::vector<std::string>& files);
+
+}
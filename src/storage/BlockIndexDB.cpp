@@ -5,7 +5,9 @@
 #include "db.hpp"
 #include "AppConfig.hpp"
 #include "data/Block.hpp"
+#include "data/BlockIndexTable.hpp"
 #include "util/serialization.hpp"
+#include "util/Parallel.hpp"
 
 #include <leveldb/options.h>
 #include <leveldb/cache.h>
@@ -20,6 +22,7 @@
 
 #include <functional>
 #include <memory>
+#include <vector>
 
 
 namespace xbtc {
@@ -79,9 +82,18 @@ public:
         {
             batch.write(DB_LAST_BLOCK, data.lastBlockFile);
         }
-        for (const auto& item : *data.blocks)
+        if (data.pruned)
         {
-            batch.write(m_dataEncoding.encode(DB_BLOCK_INDEX, item.second->getHash()), *item.second);
+            batch.write(DB_PRUNED_FLAG, 1);
+        }
+        batch.write(DB_FLUSH_SEQUENCE, data.sequence);
+        for (const BlockIndex* block : *data.blocks)
+        {
+            batch.write(m_dataEncoding.encode(DB_BLOCK_INDEX, block->getHash()), *block);
+        }
+        for (const BlockIndex* block : *data.changedBlocks)
+        {
+            batch.write(m_dataEncoding.encode(DB_BLOCK_INDEX, block->getHash()), *block);
         }
         for (const auto& fileinfo : data.files)
         {
@@ -99,49 +111,83 @@ public:
         XUL_DEBUG("readBlockFileInfo " << fileIndex << " " << xul::hex_encoding::upper_case().encode(keystr));
         return m_db->read(keystr, info);
     }
-    virtual void loadAll(BlockIndexesData& data)
+    virtual bool readFlushSequence(uint64_t& sequence)
+    {
+        return m_db->read(DB_FLUSH_SEQUENCE, sequence);
+    }
+    virtual void loadFiles(BlockIndexesData& data)
     {
         int lastBlockFile = 0;
         if (m_db->read(DB_LAST_BLOCK, lastBlockFile))
         {
             data.lastBlockFile = lastBlockFile;
         }
-        boost::intrusive_ptr<DBIterator> cursor(m_db->createIterator());
-        cursor->seekToFirst();
-        int count = 0;
-        while (cursor->valid())
+        int pruned = 0;
+        if (m_db->read(DB_PRUNED_FLAG, pruned))
         {
-            std::string key = cursor->getKey();
-            assert(!key.empty());
-            xul::slice val = cursor->getValue();
-            if (key[0] == DB_BLOCK_INDEX)
+            data.pruned = pruned != 0;
+        }
+        loadBlockFiles(data);
+    }
+    virtual void loadAll(BlockIndexesData& data)
+    {
+        loadFiles(data);
+        // decoding and hashing dominate, so the block index keys are split by the first hash byte and loaded in parallel
+        std::vector<std::vector<BlockIndex*> > parts(getParallelThreadCount(MAX_BLOCK_INDEX_LOAD_THREADS));
+        runParallel(256, parts.size(), [this, &parts](size_t begin, size_t end, int slice) {
+            loadBlockIndexRange(begin, end, parts[slice]);
+        });
+        size_t count = 0;
+        for (const auto& part : parts)
+        {
+            count += part.size();
+        }
+        data.blocks->reserve(count);
+        for (const auto& part : parts)
+        {
+            for (BlockIndex* block : part)
             {
-                BlockIndexPtr block = loadBlockIndex(key, val);
-                if (block)
-                {
-                    (*data.blocks)[block->getHash()] = block;
-                }
+                data.blocks->insert(block);
             }
-            else if (key[0] == DB_BLOCK_FILES)
+        }
+        XUL_EVENT("loadAll " << xul::make_tuple(count, data.files.size(), parts.size()));
+    }
+private:
+    void loadBlockFiles(BlockIndexesData& data)
+    {
+        boost::intrusive_ptr<DBIterator> cursor(m_db->createIterator());
+        cursor->seek(std::string(1, DB_BLOCK_FILES));
+        for (; cursor->valid(); cursor->next())
+        {
+            std::string key = cursor->getKey();
+            if (key.empty() || key[0] != DB_BLOCK_FILES)
+                break;
+            BlockFileInfo fileinfo;
+            if (loadBlockFileInfo(fileinfo, key, cursor->getValue()))
             {
-                BlockFileInfo fileinfo;
-                if (loadBlockFileInfo(fileinfo, key, val))
-                {
-                    data.files.push_back(fileinfo);
-                }
+                data.files.push_back(fileinfo);
             }
-            else
+        }
+    }
+    // loads the block indexes whose hash starts with a byte in [firstByte, endByte)
+    void loadBlockIndexRange(int firstByte, int endByte, std::vector<BlockIndex*>& blocks)
+    {
+        boost::intrusive_ptr<DBIterator> cursor(m_db->createIterator());
+        std::string startKey(1, DB_BLOCK_INDEX);
+        startKey.push_back(static_cast<char>(firstByte));
+        cursor->seek(startKey);
+        for (; cursor->valid(); cursor->next())
+        {
+            std::string key = cursor->getKey();
+            if (key.size() < 2 || key[0] != DB_BLOCK_INDEX || static_cast<uint8_t>(key[1]) >= endByte)
+                break;
+            BlockIndex* block = loadBlockIndex(key, cursor->getValue());
+            if (block)
             {
-                //
-                XUL_WARN("loadAll ignore key " << xul::hex_encoding::upper_case().encode(key) << " " << count);
-                cursor->next();
-                continue;
+                blocks.push_back(block);
             }
-            ++count;
-            cursor->next();
         }
     }
-private:
     bool loadBlockFileInfo(BlockFileInfo& fileinfo, const std::string& key, const xul::slice& val)
     {
         char tag = 0;
@@ -162,7 +208,7 @@ private:
         return true;
 
     }
-    BlockIndexPtr loadBlockIndex(const std::string& key, const xul::slice& val)
+    BlockIndex* loadBlockIndex(const std::string& key, const xul::slice& val)
     {
         char tag;
         uint256 hash;
@@ -170,21 +216,21 @@ private:
         if (!success)
         {
             XUL_WARN("loadBlockIndex invalid key " << xul::hex_encoding::upper_case().encode(key));
-            return BlockIndexPtr();
+            return nullptr;
         }
         assert(tag == DB_BLOCK_INDEX);
-        BlockIndexPtr block = createBlockIndex();
+        BlockIndex* block = createBlockIndex();
         success = m_dataEncoding.decode(val.data(), val.size(), *block);
         if (!success)
         {
             XUL_WARN("loadBlockIndex invalid block " << xul::hex_encoding::upper_case().encode(key) << " " << val.size()
                      << " " << xul::unix_time::from_utc_time(block->header.timestamp));
-            return BlockIndexPtr();
+            return nullptr;
         }
         if (block->fileIndex > 10000)
         {
             assert(false);
-            return BlockIndexPtr();
+            return nullptr;
         }
         block->header.computeHash();
         if (block->height == 0)
@@ -195,7 +241,7 @@ private:
         if (block->getHash() != hash)
         {
             assert(false);
-            return BlockIndexPtr();
+            return nullptr;
         }
         return block;
     }
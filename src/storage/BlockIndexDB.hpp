@@ -19,6 +19,9 @@ class BlockIndexDB : public xul::object
 public:
     virtual bool open() = 0;
     virtual void loadAll(BlockIndexesData& data) = 0;
+    // everything but the block indexes themselves, for a start from a block index snapshot
+    virtual void loadFiles(BlockIndexesData& data) = 0;
+    virtual bool readFlushSequence(uint64_t& sequence) = 0;
     virtual bool writeBlocks(const BlockIndexesData& data) = 0;
     virtual bool readLastBlockFile(int& fileIndex) = 0;
     virtual bool readBlockFileInfo(int fileIndex, BlockFileInfo& info) = 0;
@@ -0,0 +1,404 @@
+#include "BlockIndexJournal.hpp"
+#include "data/Block.hpp"
+#include "data/BlockIndexTable.hpp"
+#include "util/serialization.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+#include <xul/data/big_number_io.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/util/time_counter.hpp>
+#include <xul/io/data_input_stream.hpp>
+#include <xul/io/data_output_stream.hpp>
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+
+
+namespace xbtc {
+
+
+// a single flush never comes close, anything larger is garbage from a torn write
+const uint32_t MAX_BLOCK_INDEX_JOURNAL_FRAME_SIZE = 256 * 1024 * 1024;
+
+// frame layout: payload size and crc32 of the payload, native order like the snapshot, then the payload
+class BlockIndexJournalFrameHeader
+{
+public:
+    uint32_t size;
+    uint32_t checksum;
+};
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t len = ::write(fd, p, size);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += len;
+        size -= len;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t len = ::read(fd, p, size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return false;
+        p += len;
+        size -= len;
+    }
+    return true;
+}
+
+// the part of a block index that changes after it was created, same fields and order as the block index record
+static void writeBlockIndexState(xul::data_output_stream& os, const BlockIndex& block)
+{
+    os << makeVarWriter(block.height) << makeVarWriter(block.status) << makeVarWriter(block.transactionCount);
+    os << makeVarWriter(block.fileIndex) << makeVarWriter(block.dataPosition) << makeVarWriter(block.undoPosition) << makeVarWriter(block.compressedSize);
+}
+
+static void readBlockIndexState(xul::data_input_stream& is, BlockIndex& block)
+{
+    is >> makeVarReader(block.height) >> makeVarReader(block.status) >> makeVarReader(block.transactionCount);
+    is >> makeVarReader(block.fileIndex) >> makeVarReader(block.dataPosition) >> makeVarReader(block.undoPosition) >> makeVarReader(block.compressedSize);
+}
+
+std::string getBlockIndexJournalPath(const std::string& dataDir)
+{
+    return xul::paths::join(dataDir, "blocks/index.journal");
+}
+
+class BlockIndexJournalImpl : public xul::object_impl<BlockIndexJournal>
+{
+public:
+    explicit BlockIndexJournalImpl(const std::string& path) : m_path(path), m_fd(-1), m_size(0), m_sequence(0), m_torn(false)
+    {
+        XUL_LOGGER_INIT("BlockIndexJournal");
+        XUL_REL_EVENT("new " << path);
+        m_pending = std::make_shared<BlockIndexTable>();
+        clearPending();
+    }
+    ~BlockIndexJournalImpl()
+    {
+        XUL_REL_EVENT("delete");
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+        }
+    }
+    virtual bool open()
+    {
+        xul::time_counter starttime;
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0)
+        {
+            XUL_REL_ERROR("open failed " << m_path << " " << errno);
+            return false;
+        }
+        m_frames.clear();
+        m_size = 0;
+        BlockIndexJournalFrameHeader header;
+        while (readAll(m_fd, &header, sizeof(header)))
+        {
+            if (header.size < sizeof(uint64_t) || header.size > MAX_BLOCK_INDEX_JOURNAL_FRAME_SIZE)
+                break;
+            std::string payload(header.size, '\0');
+            if (!readAll(m_fd, &payload[0], payload.size()))
+                break;
+            if (crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(payload.data()), payload.size()) != header.checksum)
+                break;
+            m_frames.push_back(payload);
+            m_size += sizeof(header) + payload.size();
+        }
+        struct stat st;
+        if (::fstat(m_fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > m_size)
+        {
+            // only the last append can be torn, whatever follows the last good frame was never acknowledged
+            XUL_REL_WARN("open truncate torn tail " << xul::make_tuple(st.st_size, m_size, m_frames.size()));
+            if (::ftruncate(m_fd, m_size) != 0 || ::fsync(m_fd) != 0)
+            {
+                XUL_REL_ERROR("open failed to truncate " << m_path << " " << errno);
+                return false;
+            }
+        }
+        m_sequence = 0;
+        if (!m_frames.empty())
+        {
+            xul::memory_data_input_stream is(reinterpret_cast<const uint8_t*>(m_frames.back().data()), m_frames.back().size(), false);
+            is >> m_sequence;
+        }
+        XUL_REL_EVENT("open " << xul::make_tuple(m_frames.size(), m_size, m_sequence, starttime.elapsed()));
+        return true;
+    }
+    virtual uint64_t getLastSequence() const
+    {
+        return m_sequence;
+    }
+    virtual void replay(BlockIndexesData& data)
+    {
+        xul::time_counter starttime;
+        size_t count = 0;
+        for (const std::string& payload : m_frames)
+        {
+            xul::memory_data_input_stream is(reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), false);
+            if (!replayFrame(is, data))
+            {
+                // the checksum passed, so this is a bug rather than disk damage, keep what was applied so far
+                XUL_REL_ERROR("replay bad frame " << xul::make_tuple(count, payload.size()));
+                assert(false);
+                break;
+            }
+            ++count;
+        }
+        m_frames.clear();
+        if (m_sequence < data.sequence)
+        {
+            m_sequence = data.sequence;
+        }
+        XUL_REL_EVENT("replay " << xul::make_tuple(count, m_pending->size(), m_pendingFiles.size(), starttime.elapsed()));
+    }
+    virtual bool append(const BlockIndexesData& data)
+    {
+        assert(m_fd >= 0);
+        if (m_torn && !truncateTornFrame())
+            return false;
+        std::ostringstream oss;
+        xul::ostream_data_output_stream os(oss, false);
+        os << data.sequence << makeVarWriter(data.lastBlockFile) << static_cast<uint8_t>(data.pruned ? 1 : 0);
+        VarEncoding::writeCompactSize(os, data.files.size());
+        for (const auto& fileinfo : data.files)
+        {
+            os << makeVarWriter(fileinfo.fileIndex) << fileinfo;
+        }
+        VarEncoding::writeCompactSize(os, data.blocks->size());
+        for (const BlockIndex* block : *data.blocks)
+        {
+            os << *block;
+        }
+        VarEncoding::writeCompactSize(os, data.changedBlocks->size());
+        for (const BlockIndex* block : *data.changedBlocks)
+        {
+            os << block->getHash();
+            writeBlockIndexState(os, *block);
+        }
+        std::string payload = oss.str();
+        BlockIndexJournalFrameHeader header;
+        header.size = payload.size();
+        header.checksum = crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(payload.data()), payload.size());
+        if (!writeAll(m_fd, &header, sizeof(header)) || !writeAll(m_fd, payload.data(), payload.size()) || ::fdatasync(m_fd) != 0)
+        {
+            XUL_REL_ERROR("append failed " << xul::make_tuple(data.sequence, payload.size(), errno));
+            // cut the partial frame off, a later append must not land behind it
+            m_torn = true;
+            truncateTornFrame();
+            return false;
+        }
+        m_size += sizeof(header) + payload.size();
+        m_sequence = data.sequence;
+        mergePending(data);
+        XUL_EVENT("append " << xul::make_tuple(data.sequence, data.blocks->size(), data.changedBlocks->size(), payload.size(), m_size));
+        return true;
+    }
+    virtual uint64_t getSize() const
+    {
+        return m_size;
+    }
+    virtual void getPending(BlockIndexesData& data) const
+    {
+        data.blocks = std::make_shared<BlockIndexTable>(*m_pending);
+        data.files.clear();
+        for (const auto& item : m_pendingFiles)
+        {
+            data.files.push_back(item.second);
+        }
+        data.lastBlockFile = m_lastBlockFile;
+        data.pruned = m_pruned;
+        data.sequence = m_sequence;
+    }
+    virtual bool reset()
+    {
+        assert(m_fd >= 0);
+        if (::ftruncate(m_fd, 0) != 0 || ::fsync(m_fd) != 0)
+        {
+            XUL_REL_ERROR("reset failed " << m_path << " " << errno);
+            return false;
+        }
+        XUL_EVENT("reset " << xul::make_tuple(m_size, m_pending->size(), m_sequence));
+        m_size = 0;
+        m_torn = false;
+        clearPending();
+        return true;
+    }
+private:
+    // every append fails until the partial frame of a failed one is gone
+    bool truncateTornFrame()
+    {
+        if (::ftruncate(m_fd, m_size) != 0)
+        {
+            XUL_REL_ERROR("truncateTornFrame failed " << xul::make_tuple(m_size, errno) << " " << m_path);
+            return false;
+        }
+        m_torn = false;
+        return true;
+    }
+    bool replayFrame(xul::memory_data_input_stream& is, BlockIndexesData& data)
+    {
+        uint64_t sequence = 0;
+        is >> sequence;
+        if (sequence <= data.sequence)
+        {
+            // left over from a compaction whose reset failed, the database already has it
+            return is.good();
+        }
+        uint8_t pruned = 0;
+        is >> makeVarReader(data.lastBlockFile) >> pruned;
+        m_lastBlockFile = data.lastBlockFile;
+        if (pruned)
+        {
+            data.pruned = true;
+            m_pruned = true;
+        }
+        uint64_t count = 0;
+        if (!VarEncoding::readCompactSize(is, count))
+            return false;
+        for (uint64_t i = 0; i < count && is.good(); ++i)
+        {
+            BlockFileInfo fileinfo;
+            is >> makeVarReader(fileinfo.fileIndex) >> fileinfo;
+            replaceBlockFile(data.files, fileinfo);
+            m_pendingFiles[fileinfo.fileIndex] = fileinfo;
+        }
+        if (!VarEncoding::readCompactSize(is, count))
+            return false;
+        for (uint64_t i = 0; i < count && is.good(); ++i)
+        {
+            BlockIndex record;
+            is >> record;
+            if (!is.good())
+                return false;
+            record.header.computeHash();
+            BlockIndex* block = data.blocks->find(record.getHash());
+            if (!block)
+            {
+                block = createBlockIndex();
+                block->header = record.header;
+                data.blocks->insert(block);
+            }
+            copyBlockIndexState(record, *block);
+            m_pending->insert(block);
+        }
+        if (!VarEncoding::readCompactSize(is, count))
+            return false;
+        for (uint64_t i = 0; i < count && is.good(); ++i)
+        {
+            uint256 hash;
+            BlockIndex record;
+            is >> hash;
+            readBlockIndexState(is, record);
+            if (!is.good())
+                return false;
+            BlockIndex* block = data.blocks->find(hash);
+            if (!block)
+            {
+                XUL_WARN("replayFrame unknown block " << hash << " " << sequence);
+                continue;
+            }
+            copyBlockIndexState(record, *block);
+            m_pending->insert(block);
+        }
+        m_sequence = sequence;
+        return is.good();
+    }
+    void mergePending(const BlockIndexesData& data)
+    {
+        for (BlockIndex* block : *data.blocks)
+        {
+            m_pending->insert(block);
+        }
+        for (BlockIndex* block : *data.changedBlocks)
+        {
+            m_pending->insert(block);
+        }
+        for (const auto& fileinfo : data.files)
+        {
+            m_pendingFiles[fileinfo.fileIndex] = fileinfo;
+        }
+        m_lastBlockFile = data.lastBlockFile;
+        m_pruned = m_pruned || data.pruned;
+    }
+    void clearPending()
+    {
+        m_pending->clear();
+        m_pendingFiles.clear();
+        m_lastBlockFile = 0;
+        m_pruned = false;
+    }
+    static void copyBlockIndexState(const BlockIndex& from, BlockIndex& to)
+    {
+        to.height = from.height;
+        to.status = from.status;
+        to.transactionCount = from.transactionCount;
+        to.fileIndex = from.fileIndex;
+        to.dataPosition = from.dataPosition;
+        to.undoPosition = from.undoPosition;
+        to.compressedSize = from.compressedSize;
+    }
+    static void replaceBlockFile(std::vector<BlockFileInfo>& files, const BlockFileInfo& fileinfo)
+    {
+        for (auto& item : files)
+        {
+            if (item.fileIndex == fileinfo.fileIndex)
+            {
+                item = fileinfo;
+                return;
+            }
+        }
+        files.push_back(fileinfo);
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    std::string m_path;
+    int m_fd;
+    uint64_t m_size;
+    uint64_t m_sequence;
+    // a failed append left a partial frame behind m_size
+    bool m_torn;
+    // payloads read by open, consumed by replay
+    std::vector<std::string> m_frames;
+    // merged content of the journal, what a compaction writes to the database
+    BlockIndexTablePtr m_pending;
+    std::map<int, BlockFileInfo> m_pendingFiles;
+    int m_lastBlockFile;
+    bool m_pruned;
+};
+
+
+BlockIndexJournal* createBlockIndexJournal(const std::string& path)
+{
+    return new BlockIndexJournalImpl(path);
+}
+
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <string>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+class BlockIndexesData;
+
+/**
+ * Append-only log of block index flushes in front of the block index database.
+ * Every flush becomes one checksummed frame: new indexes in full, indexes whose status or position changed as
+ * compact deltas without the header, plus the touched block file records. The journaled state is kept merged
+ * in memory and written to the database in one batch when the journal is compacted.
+ */
+class BlockIndexJournal : public xul::object
+{
+public:
+    // reads the frames into memory, a frame torn by a crash at the end is cut off
+    virtual bool open() = 0;
+    // sequence of the last journaled flush, 0 if the journal is empty
+    virtual uint64_t getLastSequence() const = 0;
+    // applies the frames read by open to the indexes and block files loaded from the database or a snapshot,
+    // frames not newer than data.sequence, the sequence of the database, are skipped
+    virtual void replay(BlockIndexesData& data) = 0;
+    // appends and syncs the frame of one flush
+    virtual bool append(const BlockIndexesData& data) = 0;
+    virtual uint64_t getSize() const = 0;
+    // the merged state of everything journaled since the last reset, ready for the database
+    virtual void getPending(BlockIndexesData& data) const = 0;
+    // empties the journal after its content reached the database
+    virtual bool reset() = 0;
+};
+
+std::string getBlockIndexJournalPath(const std::string& dataDir);
+
+BlockIndexJournal* createBlockIndexJournal(const std::string& path);
+
+
+}
@@ -0,0 +1,225 @@
+#include "BlockIndexSnapshot.hpp"
+#include "data/BlockIndexTable.hpp"
+
+#include <xul/log/log.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/data/date_time.hpp>
+#include <xul/util/time_counter.hpp>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+
+
+namespace xbtc {
+
+
+const uint32_t BLOCK_INDEX_SNAPSHOT_MAGIC = 0x53494258; // "XBIS"
+const uint32_t BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+// the entries start on a page boundary, and a slab is a whole number of pages, so every slab can be used in place
+const size_t BLOCK_INDEX_SNAPSHOT_HEADER_SIZE = 4096;
+
+// the slabs are stored as they are in memory, so the layout checks stand in for a portable format
+class BlockIndexSnapshotHeader
+{
+public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entrySize;
+    uint32_t slabShift;
+    uint64_t sequence;
+    uint32_t entryCount;
+    BlockIndexHandle bestHeader;
+    uint64_t slotCapacity;
+    uint64_t slotCount;
+    uint32_t checksum;
+};
+
+static uint32_t computeChecksum(uint32_t crc, const void* data, size_t size)
+{
+    const Bytef* p = static_cast<const Bytef*>(data);
+    while (size > 0)
+    {
+        uInt len = size > 0x40000000 ? 0x40000000 : static_cast<uInt>(size);
+        crc = crc32(crc, p, len);
+        p += len;
+        size -= len;
+    }
+    return crc;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t len = ::write(fd, p, size);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += len;
+        size -= len;
+    }
+    return true;
+}
+
+std::string getBlockIndexSnapshotPath(const std::string& dataDir)
+{
+    return xul::paths::join(dataDir, "blocks/index.snapshot");
+}
+
+std::shared_ptr<BlockIndexSnapshot> captureBlockIndexSnapshot(const std::shared_ptr<const std::vector<BlockIndex> >& entries,
+    const BlockIndexTable& blocks, const BlockIndex* bestHeader)
+{
+    auto snapshot = std::make_shared<BlockIndexSnapshot>();
+    snapshot->entries = entries;
+    blocks.copySlots(snapshot->slots);
+    snapshot->slotCount = blocks.size();
+    snapshot->bestHeader = bestHeader ? bestHeader->handle : NULL_BLOCK_INDEX_HANDLE;
+    return snapshot;
+}
+
+bool writeBlockIndexSnapshot(const std::string& path, const BlockIndexSnapshot& snapshot)
+{
+    xul::time_counter starttime;
+    char header[BLOCK_INDEX_SNAPSHOT_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    BlockIndexSnapshotHeader* info = reinterpret_cast<BlockIndexSnapshotHeader*>(header);
+    info->magic = BLOCK_INDEX_SNAPSHOT_MAGIC;
+    info->version = BLOCK_INDEX_SNAPSHOT_VERSION;
+    info->entrySize = sizeof(BlockIndex);
+    info->slabShift = BlockIndexSlab::SLAB_SHIFT;
+    info->sequence = snapshot.sequence;
+    info->entryCount = snapshot.entries->size();
+    info->bestHeader = snapshot.bestHeader;
+    info->slotCapacity = snapshot.slots.size();
+    info->slotCount = snapshot.slotCount;
+    size_t entryBytes = snapshot.entries->size() * sizeof(BlockIndex);
+    size_t slotBytes = snapshot.slots.size() * sizeof(uint64_t);
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    crc = computeChecksum(crc, snapshot.entries->data(), entryBytes);
+    info->checksum = computeChecksum(crc, snapshot.slots.data(), slotBytes);
+
+    // written aside and renamed into place, a crash never leaves a torn snapshot behind
+    std::string tempPath = path + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        XUL_APP_REL_ERROR("writeBlockIndexSnapshot failed to open " << tempPath << " " << errno);
+        return false;
+    }
+    bool success = writeAll(fd, header, sizeof(header))
+        && writeAll(fd, snapshot.entries->data(), entryBytes)
+        && writeAll(fd, snapshot.slots.data(), slotBytes)
+        && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!success || ::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        XUL_APP_REL_ERROR("writeBlockIndexSnapshot failed to write " << path << " " << errno);
+        ::unlink(tempPath.c_str());
+        return false;
+    }
+    XUL_APP_REL_EVENT("writeBlockIndexSnapshot " << xul::make_tuple(snapshot.sequence, snapshot.slotCount, entryBytes + slotBytes, starttime.elapsed()));
+    return true;
+}
+
+static bool checkSnapshotHeader(const BlockIndexSnapshotHeader& info, size_t fileSize, uint64_t sequence)
+{
+    if (info.magic != BLOCK_INDEX_SNAPSHOT_MAGIC || info.version != BLOCK_INDEX_SNAPSHOT_VERSION
+        || info.entrySize != sizeof(BlockIndex) || info.slabShift != BlockIndexSlab::SLAB_SHIFT)
+    {
+        XUL_APP_REL_EVENT("loadBlockIndexSnapshot incompatible " << xul::make_tuple(info.magic, info.version, info.entrySize, info.slabShift));
+        return false;
+    }
+    if (info.sequence != sequence)
+    {
+        XUL_APP_REL_EVENT("loadBlockIndexSnapshot stale " << xul::make_tuple(info.sequence, sequence));
+        return false;
+    }
+    // without a best header the restored indexes would be taken for unlinked ones
+    if (info.bestHeader == NULL_BLOCK_INDEX_HANDLE || info.bestHeader >= info.entryCount)
+    {
+        XUL_APP_REL_ERROR("loadBlockIndexSnapshot bad best header " << xul::make_tuple(info.bestHeader, info.entryCount));
+        return false;
+    }
+    if (info.entryCount == 0
+        || fileSize != BLOCK_INDEX_SNAPSHOT_HEADER_SIZE + uint64_t(info.entryCount) * info.entrySize + info.slotCapacity * sizeof(uint64_t))
+    {
+        XUL_APP_REL_ERROR("loadBlockIndexSnapshot bad size " << xul::make_tuple(fileSize, info.entryCount, info.slotCapacity));
+        return false;
+    }
+    return true;
+}
+
+bool loadBlockIndexSnapshot(const std::string& path, uint64_t sequence, BlockIndexTable& blocks, BlockIndex*& bestHeader)
+{
+    xul::time_counter starttime;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    ::unlink(path.c_str());
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(BLOCK_INDEX_SNAPSHOT_HEADER_SIZE))
+    {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    // private and writable, the slabs used in place are modified like any other block index
+    void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        XUL_APP_REL_ERROR("loadBlockIndexSnapshot failed to map " << path << " " << size);
+        return false;
+    }
+    char* base = static_cast<char*>(data);
+    BlockIndexSnapshotHeader info;
+    memcpy(&info, base, sizeof(info));
+    if (!checkSnapshotHeader(info, size, sequence))
+    {
+        ::munmap(data, size);
+        return false;
+    }
+    ::madvise(data, size, MADV_SEQUENTIAL);
+    char* entries = base + BLOCK_INDEX_SNAPSHOT_HEADER_SIZE;
+    size_t entryBytes = size_t(info.entryCount) * info.entrySize;
+    const char* slots = entries + entryBytes;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    crc = computeChecksum(crc, entries, entryBytes);
+    crc = computeChecksum(crc, slots, info.slotCapacity * sizeof(uint64_t));
+    if (crc != info.checksum)
+    {
+        XUL_APP_REL_ERROR("loadBlockIndexSnapshot checksum mismatch " << xul::make_tuple(crc, info.checksum));
+        ::munmap(data, size);
+        return false;
+    }
+    if (!blocks.restoreSlots(reinterpret_cast<const uint64_t*>(slots), info.slotCapacity, info.slotCount)
+        || !BlockIndexSlab::restore(reinterpret_cast<BlockIndex*>(entries), info.entryCount))
+    {
+        XUL_APP_REL_ERROR("loadBlockIndexSnapshot failed to restore " << xul::make_tuple(info.entryCount, info.slotCount));
+        blocks.clear();
+        ::munmap(data, size);
+        return false;
+    }
+    // only the complete slabs are used in place, the last one and the table were copied
+    size_t keepBytes = BLOCK_INDEX_SNAPSHOT_HEADER_SIZE + size_t(info.entryCount >> BlockIndexSlab::SLAB_SHIFT) * BlockIndexSlab::SLAB_SIZE * info.entrySize;
+    if (keepBytes < size)
+    {
+        ::munmap(base + keepBytes, size - keepBytes);
+    }
+    ::madvise(data, keepBytes, MADV_RANDOM);
+    bestHeader = BlockIndexSlab::get(info.bestHeader);
+    XUL_APP_REL_EVENT("loadBlockIndexSnapshot " << xul::make_tuple(info.sequence, info.slotCount, size, starttime.elapsed()));
+    return true;
+}
+
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "data/Block.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace xbtc {
+
+
+class BlockIndexTable;
+
+/**
+ * Image of the block index slabs and hash table, taken by BlockCache at a flush and written by BlockStorage
+ * right after the block indexes of the same flush. On startup the file is mapped and the slabs are used in
+ * place, so the indexes need no decoding, hashing, proof of work checks or chain work accumulation.
+ */
+class BlockIndexSnapshot
+{
+public:
+    uint64_t sequence;
+    BlockIndexHandle bestHeader;
+    // copied from the slabs at the capture, freed once the snapshot is written
+    std::shared_ptr<const std::vector<BlockIndex> > entries;
+    std::vector<uint64_t> slots;
+    uint64_t slotCount;
+
+    BlockIndexSnapshot() : sequence(0), bestHeader(NULL_BLOCK_INDEX_HANDLE), slotCount(0)
+    {
+    }
+};
+
+std::string getBlockIndexSnapshotPath(const std::string& dataDir);
+
+std::shared_ptr<BlockIndexSnapshot> captureBlockIndexSnapshot(const std::shared_ptr<const std::vector<BlockIndex> >& entries,
+    const BlockIndexTable& blocks, const BlockIndex* bestHeader);
+
+bool writeBlockIndexSnapshot(const std::string& path, const BlockIndexSnapshot& snapshot);
+
+/**
+ * Maps the snapshot file and installs it as the block indexes, fails if it is missing, corrupt, written by
+ * a different build or not from the given flush sequence. The file is removed either way, a snapshot is only
+ * good for the start right after it was written.
+ */
+bool loadBlockIndexSnapshot(const std::string& path, uint64_t sequence, BlockIndexTable& blocks, BlockIndex*& bestHeader);
+
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "data/Block.hpp"
+#include <unordered_map>
+#include <vector>
+
+
+namespace xbtc {
+
+
+// the block is stored, or accepted by the block cache and queued for the disk, BLOCK_HAVE_DATA is set once it is written
+inline bool hasBlockData(const BlockIndex* blockIndex)
+{
+    return blockIndex && ((blockIndex->status & BLOCK_HAVE_DATA) || blockIndex->transactionCount > 0);
+}
+
+/**
+ * Blocks waiting for their parent, keyed by the parent hash, shared by the block importer and the reorder buffer.
+ * The owner keeps whatever else it tracks per entry, such as its memory. Not thread safe.
+ */
+template <typename EntryType>
+class BlockOrphanTable
+{
+public:
+    typedef std::unordered_multimap<uint256, EntryType> EntryMap;
+
+    void add(const uint256& previousHash, const EntryType& entry)
+    {
+        m_entries.insert(std::make_pair(previousHash, entry));
+    }
+    // the entry is found by value, returns false if it is not there
+    bool remove(const uint256& previousHash, const EntryType& entry)
+    {
+        auto range = m_entries.equal_range(previousHash);
+        for (auto iter = range.first; iter != range.second; ++iter)
+        {
+            if (iter->second == entry)
+            {
+                m_entries.erase(iter);
+                return true;
+            }
+        }
+        return false;
+    }
+    // appends the blocks waiting for hash to children
+    void getChildren(const uint256& hash, std::vector<EntryType>& children) const
+    {
+        auto range = m_entries.equal_range(hash);
+        for (auto iter = range.first; iter != range.second; ++iter)
+        {
+            children.push_back(iter->second);
+        }
+    }
+    // appends the blocks waiting for hash to children and forgets them
+    void takeChildren(const uint256& hash, std::vector<EntryType>& children)
+    {
+        auto range = m_entries.equal_range(hash);
+        for (auto iter = range.first; iter != range.second; ++iter)
+        {
+            children.push_back(iter->second);
+        }
+        m_entries.erase(range.first, range.second);
+    }
+    // forgets an arbitrary entry, returns false when empty
+    bool takeAny(EntryType& entry)
+    {
+        if (m_entries.empty())
+            return false;
+        auto iter = m_entries.begin();
+        entry = iter->second;
+        m_entries.erase(iter);
+        return true;
+    }
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+    bool empty() const
+    {
+        return m_entries.empty();
+    }
+    void clear()
+    {
+        m_entries.clear();
+    }
+
+private:
+    EntryMap m_entries;
+};
+
+}
@@ -1,25 +1,40 @@
 #include "BlockStorage.hpp"
 #include "BlockIndexDB.hpp"
+#include "BlockFileReader.hpp"
+#include "BlockFileWriter.hpp"
+#include "BlockCompressor.hpp"
+#include "BlockIndexSnapshot.hpp"
+#include "BlockIndexJournal.hpp"
 #include "ChainParams.hpp"
 #include "data/Block.hpp"
+#include "data/BlockIndexTable.hpp"
 #include "AppInfo.hpp"
 #include "AppConfig.hpp"
 #include "db.hpp"
+#include "util/BufferPool.hpp"
+#include "util/serialization.hpp"
 
 #include <xul/lang/object_impl.hpp>
 #include <xul/net/io_services.hpp>
 #include <xul/log/log.hpp>
 #include <xul/util/time_counter.hpp>
+#include <xul/util/timer_holder.hpp>
 #include <xul/io/data_input_stream.hpp>
 #include <xul/io/data_output_stream.hpp>
 #include <xul/io/data_encoding.hpp>
-#include <xul/io/stdfile.hpp>
 #include <xul/os/paths.hpp>
+#include <xul/std/strings.hpp>
 
+#include <algorithm>
 #include <deque>
 #include <functional>
+#include <future>
+#include <mutex>
 #include <unordered_map>
 
+#include <errno.h>
+#include <unistd.h>
+
 
 namespace xbtc {
 
@@ -27,23 +42,59 @@ namespace xbtc {
 class DummyBlockStorageListener : public BlockStorageListener
 {
 public:
-    virtual void onBlockWritten(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos) {}
+    virtual void onBlockWritten(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos, const TransactionOffsetList& txOffsets) {}
 };
 
-class BlockStorageImpl : public xul::object_impl<BlockStorage>
+class BlockStorageImpl : public xul::object_impl<BlockStorage>, public xul::timer_listener
 {
 public:
+    class PendingBlockWrite
+    {
+    public:
+        DiskBlockPos pos;
+        BlockPtr block;
+        BlockIndex* blockIndex;
+        std::shared_ptr<TransactionOffsetList> txOffsets;
+
+        PendingBlockWrite(const DiskBlockPos& p, const BlockPtr& b, BlockIndex* bi, const std::shared_ptr<TransactionOffsetList>& offsets)
+            : pos(p), block(b), blockIndex(bi), txOffsets(offsets) {}
+    };
+    typedef std::vector<PendingBlockWrite> PendingBlockWriteList;
+
     explicit BlockStorageImpl(AppInfo* appInfo) : m_appInfo(appInfo)
     {
         XUL_LOGGER_INIT("BlockStorage");
         XUL_REL_EVENT("new");
         m_db = createBlockIndexDB(appInfo->getAppConfig());
+        m_journal = createBlockIndexJournal(getBlockIndexJournalPath(appInfo->getAppConfig()->dataDir));
+        m_reader = createBlockFileReader(appInfo->getAppConfig()->dataDir, MAX_MAPPED_BLOCKFILES);
+        m_writer = createBlockFileWriter(appInfo->getAppConfig()->dataDir, BLOCKFILE_CHUNK_SIZE);
+        // compressed blocks are always readable, the option only decides how new blocks are written
+        int compressionLevel = appInfo->getAppConfig()->blockCompression;
+        m_compressor = createZlibBlockCompressor(compressionLevel > 0 ? compressionLevel : 1);
+        m_compressBlocks = compressionLevel > 0;
+        m_pendingWrites.reserve(BLOCK_WRITE_GROUP_SIZE);
+        m_commitTimer.create_periodic_timer(appInfo->getDiskIOService());
+        m_commitTimer.set_listener(this);
+        m_commitTimer.start(BLOCK_WRITE_GROUP_INTERVAL / 2);
         m_lastBlockFile = 0;
+        m_lastBlockSize = 4096;
+        m_pruneTarget = appInfo->getAppConfig()->prune > 0 ? appInfo->getAppConfig()->prune : 0;
+        if (m_pruneTarget > 0 && m_pruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+        {
+            XUL_REL_WARN("prune target too small " << m_pruneTarget);
+            m_pruneTarget = MIN_DISK_SPACE_FOR_BLOCK_FILES;
+        }
+        m_pruned = false;
+        m_flushSequence = 0;
         setListener(nullptr);
     }
     ~BlockStorageImpl()
     {
         XUL_REL_EVENT("delete");
+        // without a close the listener may be gone already, the last group is made durable but never announced
+        m_pendingWrites.clear();
+        m_writer->close();
     }
     virtual bool load(BlockIndexesData& data)
     {
@@ -52,10 +103,51 @@ public:
         if (!m_db->open())
             return false;
         xul::time_counter starttime2;
-        m_db->loadAll(data);
-        XUL_DEBUG("load " << xul::make_tuple(starttime.elapsed(), starttime2.elapsed()));
-        m_blockFiles = std::move(data.files);
+        m_db->readFlushSequence(m_flushSequence);
+        if (!m_journal->open())
+            return false;
+        // a snapshot is always written right after a compaction, so it matches the database, not the journal
+        if (loadBlockIndexSnapshot(getBlockIndexSnapshotPath(m_appInfo->getAppConfig()->dataDir), m_flushSequence, *data.blocks, data.bestHeader))
+        {
+            m_db->loadFiles(data);
+        }
+        else
+        {
+            m_db->loadAll(data);
+        }
+        data.sequence = m_flushSequence;
+        m_journal->replay(data);
+        if (m_journal->getLastSequence() > m_flushSequence)
+        {
+            m_flushSequence = m_journal->getLastSequence();
+        }
+        compactJournal();
+        m_lastSnapshotTime.sync();
+        XUL_DEBUG("load " << xul::make_tuple(starttime.elapsed(), starttime2.elapsed(), m_flushSequence));
+        m_blockFiles.clear();
+        for (const auto& fileinfo : data.files)
+        {
+            if (m_blockFiles.size() <= fileinfo.fileIndex)
+            {
+                m_blockFiles.resize(fileinfo.fileIndex + 1);
+            }
+            m_blockFiles[fileinfo.fileIndex] = fileinfo;
+        }
         m_lastBlockFile = data.lastBlockFile;
+        if (m_appInfo->getAppConfig()->reindex && data.files.empty())
+        {
+            // the old block files are reindexed where they are, new blocks go into the files after them
+            while (::access(xul::paths::join(m_appInfo->getAppConfig()->dataDir, xul::strings::format("blocks/blk%05u.dat", m_lastBlockFile)).c_str(), F_OK) == 0)
+            {
+                ++m_lastBlockFile;
+            }
+            XUL_REL_EVENT("load reindex keeps block files " << m_lastBlockFile);
+        }
+        m_pruned = data.pruned;
+        if (m_pruned && m_pruneTarget == 0)
+        {
+            XUL_REL_WARN("load block files were pruned, old blocks are unavailable");
+        }
         return true;
     }
     virtual void setListener(BlockStorageListener* listener)
@@ -63,38 +155,259 @@ public:
         m_listener = listener ? listener : &m_dummyListener;
     }
 
-    virtual DiskBlockPos writeBlock(Block* block, BlockIndex* blockIndex)
+    virtual void writeBlock(Block* block, BlockIndex* blockIndex)
     {
-        auto s = std::make_shared<std::string>();
-        s->resize(2*1024*1024);
-        xul::memory_data_output_stream os(&(*s)[0], s->size(), false);
-        os << *block;
-        s->resize(os.position());
-        DiskBlockPos pos = findBlockPos(0, s->size() + 8);
-        m_blockFiles[pos.fileIndex].addBlock(blockIndex->height, blockIndex->header.timestamp);
-        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::doWriteBlock, this, s, pos, BlockPtr(block), BlockIndexPtr(blockIndex)));
-        return pos;
+        auto txOffsets = std::make_shared<TransactionOffsetList>();
+        PooledBuffer s = serializeBlock(block, *txOffsets);
+        if (!s)
+        {
+            assert(false);
+            return;
+        }
+        // compression and the file position wait for the disk io service, the caller is the network thread
+        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::doWriteBlock, this, s, BlockPtr(block), blockIndex, txOffsets));
+    }
+    virtual void registerBlock(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos)
+    {
+        // only the transaction offsets are wanted, the record itself is on disk already
+        auto txOffsets = std::make_shared<TransactionOffsetList>();
+        PooledBuffer s = serializeBlock(block, *txOffsets);
+        if (!s)
+        {
+            assert(false);
+            return;
+        }
+        unsigned recordSize = 8 + (pos.compressedSize > 0 ? pos.compressedSize : s->size());
+        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::doRegisterBlock, this, pos, recordSize, BlockPtr(block), blockIndex, txOffsets));
     }
     virtual Block* readBlock(const BlockIndex* blockIndex)
     {
-        return doReadBlock(blockIndex);
+        if (!(blockIndex->status & BLOCK_HAVE_DATA))
+        {
+            // pruned or never stored
+            XUL_DEBUG("readBlock no data " << blockIndex->getHash() << " " << blockIndex->height);
+            return nullptr;
+        }
+        return doReadBlock(blockIndex, nullptr);
+    }
+    virtual Block* readBlock(const BlockIndex* blockIndex, TransactionOffsetList& txOffsets)
+    {
+        if (!(blockIndex->status & BLOCK_HAVE_DATA))
+            return nullptr;
+        return doReadBlock(blockIndex, &txOffsets);
+    }
+    virtual bool readTransaction(int fileIndex, uint32_t dataPosition, uint32_t txOffset, Transaction& tx)
+    {
+        boost::intrusive_ptr<BlockFileMapping> mapping;
+        PooledBuffer rawData;
+        uint32_t blockSize = 0;
+        const uint8_t* data = locateBlockData(fileIndex, dataPosition, mapping, rawData, blockSize);
+        if (!data || txOffset >= blockSize)
+            return false;
+        xul::memory_data_input_stream is(data + txOffset, blockSize - txOffset, false);
+        is >> tx;
+        if (!is.good())
+            return false;
+        tx.computeHash();
+        return true;
+    }
+    virtual void readBlocks(const ConstBlockIndexList& blockIndexes, xul::io_service* ios, const BlockReadCallback& callback)
+    {
+        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::doReadBlocks, this, blockIndexes, boost::intrusive_ptr<xul::io_service>(ios), callback));
+    }
+    virtual bool isPruneMode() const
+    {
+        return m_pruneTarget > 0;
+    }
+    virtual bool findFilesToPrune(int tipHeight, std::vector<int>& files)
+    {
+        if (m_pruneTarget == 0 || tipHeight <= MIN_BLOCKS_TO_KEEP)
+            return false;
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        unsigned lastBlockToPrune = tipHeight - MIN_BLOCKS_TO_KEEP;
+        uint64_t usage = 0;
+        for (const auto& fileinfo : m_blockFiles)
+        {
+            usage += fileinfo.size + fileinfo.undoSize;
+        }
+        // leave room for the preallocated chunk of the current file
+        const uint64_t buffer = BLOCKFILE_CHUNK_SIZE;
+        if (usage + buffer < m_pruneTarget)
+            return false;
+        for (int fileIndex = 0; fileIndex < m_lastBlockFile && fileIndex < m_blockFiles.size(); ++fileIndex)
+        {
+            const BlockFileInfo& fileinfo = m_blockFiles[fileIndex];
+            if (fileinfo.size == 0)
+                continue;
+            if (usage + buffer < m_pruneTarget)
+                break;
+            if (fileinfo.maxHeight > lastBlockToPrune)
+                continue;
+            usage -= fileinfo.size + fileinfo.undoSize;
+            files.push_back(fileIndex);
+        }
+        XUL_EVENT("findFilesToPrune " << xul::make_tuple(tipHeight, files.size(), usage, m_pruneTarget));
+        return !files.empty();
+    }
+    virtual void pruneFiles(const std::vector<int>& files)
+    {
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        for (int fileIndex : files)
+        {
+            assert(fileIndex >= 0 && fileIndex < m_blockFiles.size() && fileIndex != m_lastBlockFile);
+            m_blockFiles[fileIndex].clear();
+            m_blockFiles[fileIndex].fileIndex = fileIndex;
+            m_dirtyFiles.insert(fileIndex);
+            m_filesToDelete.push_back(fileIndex);
+        }
+        m_pruned = true;
+    }
+    virtual void on_timer_elapsed(xul::timer* sender)
+    {
+        if (!m_pendingWrites.empty() && m_pendingWriteTime.elapsed() >= BLOCK_WRITE_GROUP_INTERVAL)
+        {
+            commitWrites(false);
+        }
     }
     virtual void flush(const std::shared_ptr<BlockIndexesData>& data)
     {
+        std::unique_lock<std::mutex> lock(m_fileMutex);
         data->lastBlockFile = m_lastBlockFile;
+        data->pruned = m_pruned;
+        data->sequence = ++m_flushSequence;
+        if (data->snapshot)
+        {
+            data->snapshot->sequence = data->sequence;
+            m_lastSnapshotTime.sync();
+        }
         for (auto blockFile : m_dirtyFiles)
         {
             assert(blockFile >= 0 && blockFile < m_blockFiles.size());
             data->files.push_back(m_blockFiles[blockFile]);
         }
         m_dirtyFiles.clear();
-        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::doFlush, this, data));
+        std::vector<int> filesToDelete;
+        filesToDelete.swap(m_filesToDelete);
+        lock.unlock();
+        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::doFlush, this, data, filesToDelete));
+    }
+    virtual bool isSnapshotDue()
+    {
+        return m_lastSnapshotTime.elapsed() >= BLOCK_INDEX_SNAPSHOT_INTERVAL;
+    }
+    virtual void finishWrites()
+    {
+        std::promise<void> done;
+        // runs behind every queued write and every queued announcement of an earlier group
+        xul::io_services::post(m_appInfo->getDiskIOService(), [this, &done]() {
+            commitWrites(true);
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+    virtual void close()
+    {
+        std::promise<void> done;
+        // runs behind every queued write, the last group is made durable and announced before the files close
+        xul::io_services::post(m_appInfo->getDiskIOService(), [this, &done]() {
+            commitWrites(true);
+            m_writer->close();
+            done.set_value();
+        });
+        done.get_future().wait();
+        XUL_REL_EVENT("close " << m_flushSequence);
     }
 private:
-    void doFlush(std::shared_ptr<BlockIndexesData> data)
+    PooledBuffer serializeBlock(const Block* block, TransactionOffsetList& txOffsets)
     {
-        m_db->writeBlocks(*data);
+        // start from the size of the last block, blocks on the chain tend to be of similar size
+        for (size_t bufsize = m_lastBlockSize; bufsize <= MAX_BLOCK_SERIALIZED_SIZE * 2; bufsize *= 2)
+        {
+            PooledBuffer s = m_appInfo->getBufferPool()->allocate(bufsize);
+            xul::memory_data_output_stream os(&(*s)[0], s->size(), false);
+            // same bytes as os << *block, with the transaction offsets noted on the way
+            txOffsets.clear();
+            txOffsets.reserve(block->transactions.size());
+            os << block->header;
+            VarEncoding::writeCompactSize(os, block->transactions.size());
+            for (const auto& tx : block->transactions)
+            {
+                txOffsets.push_back(os.position());
+                os << tx;
+            }
+            if (os.good())
+            {
+                s->resize(os.position());
+                m_lastBlockSize = s->size();
+                return s;
+            }
+            bufsize = s->size();
+        }
+        XUL_WARN("serializeBlock block too large " << block->getHash());
+        return PooledBuffer();
+    }
+    void doFlush(std::shared_ptr<BlockIndexesData> data, std::vector<int> filesToDelete)
+    {
+        // block index entries must never point to block data that is not on disk yet
+        commitWrites(false);
+        // one sequential append instead of a database batch, the database catches up when the journal is compacted
+        if (!m_journal->append(*data))
+        {
+            XUL_ERROR("doFlush failed to journal block indexes " << xul::make_tuple(data->blocks->size(), data->changedBlocks->size()));
+            // keep the files until their block indexes are cleared on disk
+            return;
+        }
+        for (int fileIndex : filesToDelete)
+        {
+            deleteBlockFile(fileIndex);
+        }
+        // a snapshot is checked against the database sequence, so the journal goes into the database first
+        if (data->snapshot || m_journal->getSize() >= BLOCK_INDEX_JOURNAL_COMPACT_SIZE)
+        {
+            if (!compactJournal())
+                return;
+        }
+        // the snapshot matches the block indexes just written, it is useless if they failed
+        if (data->snapshot)
+        {
+            writeBlockIndexSnapshot(getBlockIndexSnapshotPath(m_appInfo->getAppConfig()->dataDir), *data->snapshot);
+        }
     }
+    // writes everything journaled since the last compaction in one database batch and empties the journal
+    bool compactJournal()
+    {
+        if (m_journal->getSize() == 0)
+            return true;
+        xul::time_counter starttime;
+        BlockIndexesData pending;
+        m_journal->getPending(pending);
+        if (!m_db->writeBlocks(pending))
+        {
+            XUL_ERROR("compactJournal failed to write block indexes " << pending.blocks->size());
+            // the journal stays, it is replayed on the next start
+            return false;
+        }
+        uint64_t size = m_journal->getSize();
+        m_journal->reset();
+        XUL_EVENT("compactJournal " << xul::make_tuple(pending.sequence, pending.blocks->size(), pending.files.size(), size, starttime.elapsed()));
+        return true;
+    }
+    void deleteBlockFile(int fileIndex)
+    {
+        m_reader->removeMapping(fileIndex);
+        const char* names[] = { "blocks/blk%05u.dat", "blocks/rev%05u.dat" };
+        for (const char* name : names)
+        {
+            std::string filepath = xul::paths::join(m_appInfo->getAppConfig()->dataDir, xul::strings::format(name, fileIndex));
+            if (::unlink(filepath.c_str()) != 0 && errno != ENOENT)
+            {
+                XUL_WARN("deleteBlockFile failed " << filepath << " " << errno);
+                continue;
+            }
+            XUL_EVENT("deleteBlockFile " << filepath);
+        }
+    }
+    // called with m_fileMutex held
     DiskBlockPos findBlockPos(int preferredFile, unsigned blockSize)
     {
         int blockFile = preferredFile > 0 ? preferredFile : m_lastBlockFile;
@@ -120,46 +433,78 @@ private:
         return pos;
     }
 
-    std::string formatBlockFilePath(int fileIndex)
-    {
-        std::string filepath = xul::paths::join(m_appInfo->getAppConfig()->dataDir, xul::strings::format("blocks/blk%05u.dat", fileIndex));
-        return filepath;
-    }
-
-    Block* doReadBlock(const BlockIndex* blockIndex)
+    // returns the serialized block stored at dataPosition, either inside the file mapping or inflated into rawData
+    const uint8_t* locateBlockData(int fileIndex, uint32_t dataPosition, boost::intrusive_ptr<BlockFileMapping>& mapping, PooledBuffer& rawData, uint32_t& blockSize)
     {
-        std::string filepath = formatBlockFilePath(blockIndex->fileIndex);
-        xul::stdfile_reader fin;
-        if (!fin.open_binary(filepath.c_str()))
+        if (dataPosition < 8)
+            return nullptr;
+        size_t headerPos = dataPosition - 8;
+        mapping = m_reader->getMapping(fileIndex, dataPosition);
+        if (!mapping)
         {
             return nullptr;
         }
-        assert(blockIndex->dataPosition >= 8);
-        if (!fin.seek(blockIndex->dataPosition - 8))
+        const uint8_t* buf = mapping->getData() + headerPos;
+        uint32_t magic = xul::bit_converter::little_endian().to_dword(buf);
+        blockSize = xul::bit_converter::little_endian().to_dword(buf + 4);
+        bool compressed = (blockSize & BLOCK_COMPRESSED_FLAG) != 0;
+        blockSize &= ~BLOCK_COMPRESSED_FLAG;
+        if (magic != m_appInfo->getChainParams()->protocolMagic || blockSize == 0 || blockSize > MAX_BLOCK_SERIALIZED_SIZE)
         {
             return nullptr;
         }
-        uint8_t buf[8];
-        size_t size = fin.read(buf, 8);
-        if (size != 8)
+        if (dataPosition + blockSize > mapping->getSize())
         {
-            return nullptr;
+            // the block was appended after the file got mapped
+            mapping = m_reader->getMapping(fileIndex, dataPosition + blockSize);
+            if (!mapping)
+            {
+                return nullptr;
+            }
         }
-        uint32_t magic = xul::bit_converter::little_endian().to_dword(buf);
-        uint32_t blockSize = xul::bit_converter::little_endian().to_dword(buf + 4);
-        if (magic != m_appInfo->getChainParams()->protocolMagic || blockSize == 0 || blockSize > 2*1024*1024)
+        const uint8_t* data = mapping->getData() + dataPosition;
+        if (!compressed)
+            return data;
+        if (blockSize <= 4)
+            return nullptr;
+        uint32_t rawSize = xul::bit_converter::little_endian().to_dword(data);
+        if (rawSize == 0 || rawSize > MAX_BLOCK_SERIALIZED_SIZE)
+            return nullptr;
+        rawData = m_appInfo->getBufferPool()->allocate(rawSize);
+        if (!m_compressor->decompress(data + 4, blockSize - 4, reinterpret_cast<uint8_t*>(&(*rawData)[0]), rawSize))
+            return nullptr;
+        blockSize = rawSize;
+        return reinterpret_cast<const uint8_t*>(rawData->data());
+    }
+    Block* doReadBlock(const BlockIndex* blockIndex, TransactionOffsetList* txOffsets)
+    {
+        assert(blockIndex->dataPosition >= 8);
+        boost::intrusive_ptr<BlockFileMapping> mapping;
+        PooledBuffer rawData;
+        uint32_t blockSize = 0;
+        const uint8_t* data = locateBlockData(blockIndex->fileIndex, blockIndex->dataPosition, mapping, rawData, blockSize);
+        if (!data)
         {
             return nullptr;
         }
-        std::string s;
-        s.resize(blockSize);
-        size = fin.read(&s[0], blockSize);
-        if (size != blockSize)
+        if (((blockIndex->status & BLOCK_OPT_COMPRESSED) != 0) != (rawData != nullptr))
         {
+            // the position points at some other record, whatever decodes there is not this block
+            XUL_WARN("doReadBlock record does not match block index " << blockIndex->getHash() << " " << xul::make_tuple(blockSize, blockIndex->compressedSize));
             return nullptr;
         }
+        // raw blocks are decoded straight from the mapped file, no intermediate copy of the block data
+        xul::memory_data_input_stream is(data, blockSize, false);
         Block* block = createBlock();
-        if (!xul::data_encoding::little_endian().decode(s, *block))
+        if (txOffsets)
+        {
+            decodeBlock(is, *block, *txOffsets);
+        }
+        else
+        {
+            is >> *block;
+        }
+        if (!is.good())
         {
             block->release_reference();
             return nullptr;
@@ -171,44 +516,209 @@ private:
         }
         return block;
     }
-    void doWriteBlock(std::shared_ptr<std::string> data, DiskBlockPos pos, BlockPtr block, BlockIndexPtr blockIndex)
+    void doReadBlocks(ConstBlockIndexList blockIndexes, boost::intrusive_ptr<xul::io_service> ios, BlockReadCallback callback)
     {
-        xul::stdfile_writer fout;
-        std::string filepath = formatBlockFilePath(pos.fileIndex);
-        if (!fout.open_binary_writing(filepath.c_str()))
+        // visit the blocks in file order, the results still go back in request order
+        std::vector<size_t> order;
+        order.reserve(blockIndexes.size());
+        for (size_t i = 0; i < blockIndexes.size(); ++i)
+        {
+            if (blockIndexes[i]->status & BLOCK_HAVE_DATA)
+                order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [&blockIndexes](size_t x, size_t y) {
+            const BlockIndex* a = blockIndexes[x];
+            const BlockIndex* b = blockIndexes[y];
+            return a->fileIndex < b->fileIndex || (a->fileIndex == b->fileIndex && a->dataPosition < b->dataPosition);
+        });
+        prefetchBlocks(blockIndexes, order);
+        BlockList blocks(blockIndexes.size());
+        for (size_t i : order)
         {
-            if (!fout.open_binary(filepath.c_str()))
+            blocks[i] = doReadBlock(blockIndexes[i], nullptr);
+        }
+        XUL_DEBUG("doReadBlocks " << xul::make_tuple(blockIndexes.size(), order.size()));
+        xul::io_services::post(ios.get(), std::bind(callback, blocks));
+    }
+    // coalesces blocks lying close together in one file into a single readahead
+    void prefetchBlocks(const ConstBlockIndexList& blockIndexes, const std::vector<size_t>& order)
+    {
+        size_t runStart = 0;
+        while (runStart < order.size())
+        {
+            const BlockIndex* first = blockIndexes[order[runStart]];
+            const BlockIndex* last = first;
+            size_t runEnd = runStart + 1;
+            while (runEnd < order.size())
             {
-                assert(false);
-                return;
+                const BlockIndex* next = blockIndexes[order[runEnd]];
+                if (next->fileIndex != first->fileIndex || next->dataPosition - last->dataPosition > BLOCK_READ_COALESCE_SPAN)
+                    break;
+                last = next;
+                ++runEnd;
             }
+            if (runEnd - runStart > 1)
+            {
+                boost::intrusive_ptr<BlockFileMapping> mapping = m_reader->getMapping(first->fileIndex, last->dataPosition);
+                if (mapping)
+                {
+                    uint32_t lastSize = xul::bit_converter::little_endian().to_dword(mapping->getData() + last->dataPosition - 4) & ~BLOCK_COMPRESSED_FLAG;
+                    mapping->prefetch(first->dataPosition - 8, last->dataPosition + lastSize - (first->dataPosition - 8));
+                }
+            }
+            runStart = runEnd;
         }
-        if (!fout.seek(pos.position))
+    }
+    // same as is >> block, with the transaction offsets noted on the way
+    static void decodeBlock(xul::memory_data_input_stream& is, Block& block, TransactionOffsetList& txOffsets)
+    {
+        is >> block.header;
+        uint64_t count = 0;
+        if (!VarEncoding::readCompactSize(is, count))
+            return;
+        if (count > 50000)
         {
-            assert(false);
+            is.set_bad();
             return;
         }
-        uint8_t buf[8];
+        block.transactions.resize(count);
+        txOffsets.resize(count);
+        for (size_t i = 0; i < count && is.good(); ++i)
+        {
+            txOffsets[i] = is.position();
+            is >> block.transactions[i];
+        }
+    }
+    void doWriteBlock(PooledBuffer data, BlockPtr block, BlockIndex* blockIndex, std::shared_ptr<TransactionOffsetList> txOffsets)
+    {
+        uint32_t rawSize = 0;
+        if (m_compressBlocks)
+        {
+            PooledBuffer compressed = m_appInfo->getBufferPool()->allocate(m_compressor->getMaxCompressedSize(data->size()));
+            if (m_compressor->compress(reinterpret_cast<const uint8_t*>(data->data()), data->size(), *compressed))
+            {
+                rawSize = data->size();
+                data = compressed;
+            }
+        }
+        DiskBlockPos pos;
+        {
+            std::lock_guard<std::mutex> lock(m_fileMutex);
+            pos = findBlockPos(0, data->size() + (rawSize > 0 ? 12 : 8));
+            m_blockFiles[pos.fileIndex].addBlock(blockIndex->height, blockIndex->header.timestamp);
+        }
+        if (rawSize > 0)
+        {
+            pos.compressedSize = data->size() + 4;
+        }
+        uint8_t buf[12];
+        size_t headerSize = 8;
         xul::bit_converter::little_endian().from_dword(buf, m_appInfo->getChainParams()->protocolMagic);
-        xul::bit_converter::little_endian().from_dword(buf + 4, data->size());
-        fout.write(buf, 8);
-        size_t size = fout.write(*data);
-        XUL_EVENT("doWriteBlock " << xul::make_tuple(pos.fileIndex, pos.position, size, data->size()));
-        assert(size == data->size());
-        fout.flush();
-        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::signalBlockWritten, this, pos, block, blockIndex));
+        if (rawSize > 0)
+        {
+            assert(pos.compressedSize == data->size() + 4);
+            xul::bit_converter::little_endian().from_dword(buf + 4, pos.compressedSize | BLOCK_COMPRESSED_FLAG);
+            xul::bit_converter::little_endian().from_dword(buf + 8, rawSize);
+            headerSize = 12;
+        }
+        else
+        {
+            xul::bit_converter::little_endian().from_dword(buf + 4, data->size());
+        }
+        if (!m_writer->write(pos.fileIndex, pos.position, buf, headerSize) || !m_writer->write(pos.fileIndex, pos.position + headerSize, data->data(), data->size()))
+        {
+            XUL_ERROR("doWriteBlock failed " << xul::make_tuple(pos.fileIndex, pos.position, data->size()));
+            assert(false);
+            return;
+        }
+        XUL_EVENT("doWriteBlock " << xul::make_tuple(pos.fileIndex, pos.position, data->size(), m_pendingWrites.size()));
+        if (m_pendingWrites.empty())
+        {
+            m_pendingWriteTime.sync();
+        }
+        m_pendingWrites.push_back(PendingBlockWrite(pos, block, blockIndex, txOffsets));
+        if (m_pendingWrites.size() >= BLOCK_WRITE_GROUP_SIZE)
+        {
+            commitWrites(false);
+        }
+    }
+    void doRegisterBlock(DiskBlockPos pos, unsigned recordSize, BlockPtr block, BlockIndex* blockIndex, std::shared_ptr<TransactionOffsetList> txOffsets)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_fileMutex);
+            if (m_blockFiles.size() <= pos.fileIndex)
+            {
+                m_blockFiles.resize(pos.fileIndex + 1);
+            }
+            BlockFileInfo& fileinfo = m_blockFiles[pos.fileIndex];
+            fileinfo.fileIndex = pos.fileIndex;
+            if (fileinfo.size < pos.position + recordSize)
+                fileinfo.size = pos.position + recordSize;
+            fileinfo.addBlock(blockIndex->height, blockIndex->header.timestamp);
+            m_dirtyFiles.insert(pos.fileIndex);
+        }
+        // announced in order with the written blocks, once the group they joined is committed
+        if (m_pendingWrites.empty())
+        {
+            m_pendingWriteTime.sync();
+        }
+        m_pendingWrites.push_back(PendingBlockWrite(pos, block, blockIndex, txOffsets));
+        if (m_pendingWrites.size() >= BLOCK_WRITE_GROUP_SIZE)
+        {
+            commitWrites(false);
+        }
+    }
+    // immediate runs the written callbacks in place instead of queueing them, for the close
+    void commitWrites(bool immediate)
+    {
+        if (m_pendingWrites.empty())
+            return;
+        if (!m_writer->sync())
+        {
+            // the group stays pending, the next commit syncs it again
+            XUL_ERROR("commitWrites failed to sync " << m_pendingWrites.size());
+            return;
+        }
+        PendingBlockWriteList writes;
+        writes.swap(m_pendingWrites);
+        m_pendingWrites.reserve(BLOCK_WRITE_GROUP_SIZE);
+        for (const auto& item : writes)
+        {
+            if (immediate)
+            {
+                signalBlockWritten(item.pos, item.block, item.blockIndex, item.txOffsets);
+                continue;
+            }
+            xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&BlockStorageImpl::signalBlockWritten, this, item.pos, item.block, item.blockIndex, item.txOffsets));
+        }
     }
-    void signalBlockWritten(DiskBlockPos pos, BlockPtr block, BlockIndexPtr blockIndex)
+    void signalBlockWritten(DiskBlockPos pos, BlockPtr block, BlockIndex* blockIndex, std::shared_ptr<TransactionOffsetList> txOffsets)
     {
-        m_listener->onBlockWritten(block.get(), blockIndex.get(), pos);
+        m_listener->onBlockWritten(block.get(), blockIndex, pos, *txOffsets);
     }
 private:
     XUL_LOGGER_DEFINE();
     boost::intrusive_ptr<AppInfo> m_appInfo;
     boost::intrusive_ptr<BlockIndexDB> m_db;
+    boost::intrusive_ptr<BlockIndexJournal> m_journal;
+    boost::intrusive_ptr<BlockFileReader> m_reader;
+    boost::intrusive_ptr<BlockFileWriter> m_writer;
+    boost::intrusive_ptr<BlockCompressor> m_compressor;
+    bool m_compressBlocks;
+    PendingBlockWriteList m_pendingWrites;
+    xul::time_counter m_pendingWriteTime;
+    xul::timer_holder m_commitTimer;
+    // guards the block file table, positions are handed out on the disk io service and flushed from the main one
+    std::mutex m_fileMutex;
     int m_lastBlockFile;
+    size_t m_lastBlockSize;
     std::vector<BlockFileInfo> m_blockFiles;
     std::set<int> m_dirtyFiles;
+    std::vector<int> m_filesToDelete;
+    uint64_t m_pruneTarget;
+    bool m_pruned;
+    uint64_t m_flushSequence;
+    xul::time_counter m_lastSnapshotTime;
     std::vector<DiskBlockPos> m_blockPositions;
     BlockStorageListener* m_listener;
     DummyBlockStorageListener m_dummyListener;
@@ -1,9 +1,17 @@
 #pragma once
 
 #include <xul/lang/object.hpp>
+#include <xul/lang/object_ptr.hpp>
+#include <functional>
 #include <memory>
+#include <vector>
+#include <stdint.h>
 
 
+namespace xul {
+    class io_service;
+}
+
 namespace xbtc {
 
 
@@ -14,11 +22,19 @@ class AppInfo;
 class BlockListener;
 class DiskBlockPos;
 class BlockIndexesData;
+class Transaction;
+
+typedef std::vector<uint32_t> TransactionOffsetList;
+typedef std::vector<boost::intrusive_ptr<Block> > BlockList;
+typedef std::vector<const BlockIndex*> ConstBlockIndexList;
+// receives the blocks in request order, a block that could not be read is null
+typedef std::function<void (const BlockList& blocks)> BlockReadCallback;
 
 class BlockStorageListener
 {
 public:
-    virtual void onBlockWritten(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos) = 0;
+    // txOffsets holds where each transaction starts within the serialized block
+    virtual void onBlockWritten(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos, const TransactionOffsetList& txOffsets) = 0;
 };
 
 class BlockStorage : public xul::object
@@ -26,9 +42,29 @@ class BlockStorage : public xul::object
 public:
     virtual bool load(BlockIndexesData& data) = 0;
     virtual void setListener(BlockStorageListener* listener) = 0;
-    virtual DiskBlockPos writeBlock(Block* block, BlockIndex* blockIndex) = 0;
+    // serializes the block in place, compresses and writes it on the disk io service, onBlockWritten reports its position
+    virtual void writeBlock(Block* block, BlockIndex* blockIndex) = 0;
+    // takes a block found at pos in the block files by reindex, it is announced through onBlockWritten like a written one
+    virtual void registerBlock(Block* block, BlockIndex* blockIndex, const DiskBlockPos& pos) = 0;
     virtual Block* readBlock(const BlockIndex* blockIndex) = 0;
+    virtual Block* readBlock(const BlockIndex* blockIndex, TransactionOffsetList& txOffsets) = 0;
+    // decodes only the transaction at txOffset of the block stored at dataPosition, compressed blocks are inflated first
+    virtual bool readTransaction(int fileIndex, uint32_t dataPosition, uint32_t txOffset, Transaction& tx) = 0;
+    // reads and decodes on the disk io service and completes on ios, nearby blocks of a batch are fetched in one sequential pass
+    virtual void readBlocks(const ConstBlockIndexList& blockIndexes, xul::io_service* ios, const BlockReadCallback& callback) = 0;
     virtual void flush(const std::shared_ptr<BlockIndexesData>& data) = 0;
+    // true once BLOCK_INDEX_SNAPSHOT_INTERVAL has passed since the last snapshot was handed to flush
+    virtual bool isSnapshotDue() = 0;
+    // makes every queued write durable and announces it through onBlockWritten before it returns, so the final flush
+    // at shutdown sees the last group, the io services must be running
+    virtual void finishWrites() = 0;
+    // waits until everything queued on the disk io service is done, the io services must be running
+    virtual void close() = 0;
+    virtual bool isPruneMode() const = 0;
+    // picks the oldest block files to delete to get back under the prune target, none of them holds blocks near the tip
+    virtual bool findFilesToPrune(int tipHeight, std::vector<int>& files) = 0;
+    // the files are deleted after the next flush has persisted the block indexes that no longer reference them
+    virtual void pruneFiles(const std::vector<int>& files) = 0;
 };
 
 BlockStorage* createBlockStorage(AppInfo* appInfo);
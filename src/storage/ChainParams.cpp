@@ -62,6 +62,19 @@ ChainParams* createMainChainParams()
     params->dnsSeeds.emplace_back("seed.bitcoinstats.com"); // Christian Decker, supports x1 - xf
     params->dnsSeeds.emplace_back("seed.bitcoin.jonasschnelli.ch"); // Jonas Schnelli, only supports x1, x5, x9, and xd
     params->dnsSeeds.emplace_back("seed.btc.petertodd.org"); // Peter Todd, only supports x1, x5, x9, and xd
+    params->checkpoints[11111] = uint256::parse("0000000069e244f73d78e8fd29ba2fd2ed618bd6fa2ee92559f542fdb26e7c1d");
+    params->checkpoints[33333] = uint256::parse("000000002dd5588a74784eaa7ab0507a18ad16a236e7b1ce69f00d7ddfb5d0a6");
+    params->checkpoints[74000] = uint256::parse("0000000000573993a3c9e41ce34471c079dcf5f52a0e824a81e7f953b8661a20");
+    params->checkpoints[105000] = uint256::parse("00000000000291ce28027faea320c8d2b054b2e0fe44a773f3eefb151d6bdc97");
+    params->checkpoints[134444] = uint256::parse("00000000000005b12ffd4cd315cd34ffd4a594f430ac814c91184a0d42d2b0fe");
+    params->checkpoints[168000] = uint256::parse("000000000000099e61ea72015e79632f216fe6cb33d7899acb35b75c8303b763");
+    params->checkpoints[193000] = uint256::parse("000000000000059f452a5f7340de6682a977387c17010ff6e6c3bd83ca8b1317");
+    params->checkpoints[210000] = uint256::parse("000000000000048b95347e83192f69cf0366076336c639f9b7228e9ba171342e");
+    params->checkpoints[216116] = uint256::parse("00000000000001b4f4b433e81ee46494af945cf96014816a4e2370f11b23df4e");
+    params->checkpoints[225430] = uint256::parse("00000000000001c108384350f74090433e7fcf79a606b8e797f065b130575932");
+    params->checkpoints[250000] = uint256::parse("000000000000003887df1f29024b06fc2200b55f8af8f35453d7be294df2d214");
+    params->checkpoints[279000] = uint256::parse("0000000000000001ae8c72a0b0c301f67e3afca10e819efa9041e458e9bd7e40");
+    params->checkpoints[295000] = uint256::parse("00000000000000004d9b4ef50f0f9d686fd69db2e03af35a100370c64632a983");
     return params;
 }
 
@@ -76,6 +89,7 @@ ChainParams* createTestNetChainParams()
     params->dnsSeeds.emplace_back("seed.tbtc.petertodd.org");
     params->dnsSeeds.emplace_back("seed.testnet.bitcoin.sprovoost.nl");
     params->dnsSeeds.emplace_back("testnet-seed.bluematt.me"); // Just a static list of stable node(s), only supports x9
+    params->checkpoints[546] = uint256::parse("000000002a936ca763904c3c35fce2f3556c559c0214345d31b1bcebf76acb70");
     return params;
 }
 
@@ -2,6 +2,7 @@
 
 #include "data/Block.hpp"
 #include <xul/lang/object_ptr.hpp>
+#include <map>
 
 
 namespace xbtc {
@@ -12,6 +13,8 @@ class ChainParams : public xul::object
 public:
     boost::intrusive_ptr<Block> genesisBlock;
     std::vector<std::string> dnsSeeds;
+    // block hashes by height known to be on the main chain, they anchor the header segments fetched in parallel
+    std::map<int, uint256> checkpoints;
 
     uint32_t protocolMagic;
     int defaultPort;
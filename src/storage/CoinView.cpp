@@ -14,6 +14,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
+#include <utility>
 
 
 namespace xbtc {
@@ -62,39 +63,32 @@ public:
         Coin* coin = fetchCoin(out);
         return coin != nullptr and coin->output.value > 0;
     }
-    virtual void transfer(const Transaction* tx, int height)
+    virtual bool connectBlock(const Block* block, int height)
     {
-        XUL_DEBUG("transfer " << tx->getHash() << " " << xul::make_tuple(tx->inputs.size(), tx->outputs.size(), tx->isCoinBase()));
-        if (tx->getHash().format(false) == "d5d27987d2a3dfc724e359870c6644b40e497bdc0589a033220fe15429d88599")
-        {
-            XUL_EVENT("transfer " << tx->getHash() << " " << xul::make_tuple(tx->inputs.size(), tx->outputs.size(), tx->isCoinBase()));
-        }
-        uint256 hash = tx->getHash();
-        int64_t inputval = 0;
-        if (!tx->isCoinBase())
+        boost::intrusive_ptr<CoinViewOverlay> view = createCoinViewOverlay(this);
+        if (!view->connectBlock(block, height))
+            return false;
+        view->commit();
+        return true;
+    }
+    virtual void applyChanges(CoinsData& changes)
+    {
+        for (const auto& out : changes.removedCoins)
         {
-            for (const auto& input : tx->inputs)
-            {
-                Coin* coin = fetchCoin(input.previousOutput);
-                assert(coin && coin->output.value > 0);
-                if (input.previousOutput.hash.str() == "d5d27987d2a3dfc724e359870c6644b40e497bdc0589a033220fe15429d88599")
-                {
-                    XUL_EVENT("transfer test tx input: " << input.previousOutput.hash << " " << coin->output.value);
-                }
-                inputval += coin->output.value;
-                removeCoin(input.previousOutput);
-            }
+            removeCoin(out);
         }
-        int64_t outputval = 0;
-        for (int i = 0; i < tx->outputs.size(); ++i)
+        m_coinsData.addedCoins.reserve(m_coinsData.addedCoins.size() + changes.addedCoins.size());
+        for (auto& item : changes.addedCoins)
         {
-            TransactionOutPoint out(hash, i);
-            outputval += tx->outputs[i].value;
-            addCoin(out, Coin(tx->outputs[i], height, tx->isCoinBase()));
+            if (!item.second.dirty)
+                continue;
+            assert(item.second.coin.height <= changes.bestBlockHeight);
+            m_coinsData.removedCoins.erase(item.first);
+            m_coinsData.addedCoins[item.first] = std::move(item.second);
         }
-        if (!tx->isCoinBase())
+        if (!changes.bestBlockHash.is_null())
         {
-            assert(inputval >= outputval);
+            setBestBlockHash(changes.bestBlockHash, changes.bestBlockHeight);
         }
     }
     virtual Coin* fetchCoin(const TransactionOutPoint& out)
@@ -116,9 +110,23 @@ public:
         }
         assert(tempcoin.output.value > 0);
         assert(tempcoin.height <= m_coinsData.bestBlockHeight || m_coinsData.bestBlockHeight == 0);
-        entry.coin = tempcoin;
+        entry.coin = std::move(tempcoin);
         return &entry.coin;
     }
+    virtual bool peekCoin(const TransactionOutPoint& out, Coin& coin)
+    {
+        if (m_coinsData.removedCoins.find(out) != m_coinsData.removedCoins.end())
+            return false;
+        auto iter = m_coinsData.addedCoins.find(out);
+        if (iter != m_coinsData.addedCoins.end())
+        {
+            if (iter->second.coin.output.value <= 0)
+                return false;
+            coin = iter->second.coin;
+            return true;
+        }
+        return m_db->readCoin(out, coin);
+    }
     bool flush()
     {
         // if (m_lastFlushTime.elapsed() < 5000)
@@ -140,21 +148,6 @@ public:
         return true;
     }
 private:
-    void addCoin(const TransactionOutPoint& out, const Coin& coin)
-    {
-        assert(coin.height <= m_coinsData.bestBlockHeight);
-        // if (m_coinsData.addedCoins.find(out) != m_coinsData.addedCoins.end())
-        // {
-        //     auto iter = m_coinsData.addedCoins.find(out);
-        //     auto outpoint = iter->first;
-        //     const auto& entry = iter->second;
-        //     XUL_EVENT("addCoin dup " << outpoint.hash << " " << outpoint.index << " " << xul::make_tuple(entry.coin.output.value, entry.coin.height)
-        //               << " " << xul::make_tuple(coin.output.value, coin.height));
-        //     assert(outpoint == out);
-        //     assert(false);
-        // }
-        m_coinsData.addedCoins[out] = CoinEntry(coin, true);
-    }
     void removeCoin(const TransactionOutPoint& out)
     {
         // assert(m_coinsData.addedCoins.find(out) != m_coinsData.addedCoins.end());
@@ -172,10 +165,208 @@ private:
 };
 
 
+class CoinViewOverlayImpl : public xul::object_impl<CoinViewOverlay>
+{
+public:
+    explicit CoinViewOverlayImpl(CoinView* base) : m_base(base)
+    {
+        XUL_LOGGER_INIT("CoinViewOverlay");
+        m_changes.bestBlockHash = base->getBestBlockHash();
+        m_changes.bestBlockHeight = base->getBestBlockHeight();
+    }
+
+    virtual bool load()
+    {
+        return true;
+    }
+    virtual bool flush()
+    {
+        commit();
+        return true;
+    }
+    virtual CoinView* getBase()
+    {
+        return m_base.get();
+    }
+    virtual const uint256& getBestBlockHash() const
+    {
+        return m_changes.bestBlockHash;
+    }
+    virtual int getBestBlockHeight() const
+    {
+        return m_changes.bestBlockHeight;
+    }
+    virtual void setBestBlockHash(const uint256& hash, int height)
+    {
+        m_changes.bestBlockHash = hash;
+        m_changes.bestBlockHeight = height;
+    }
+    virtual bool hasCoin(const TransactionOutPoint& out)
+    {
+        Coin* coin = fetchCoin(out);
+        return coin != nullptr && coin->output.value > 0;
+    }
+    virtual Coin* fetchCoin(const TransactionOutPoint& out)
+    {
+        if (m_changes.removedCoins.find(out) != m_changes.removedCoins.end())
+            return nullptr;
+        auto iter = m_changes.addedCoins.find(out);
+        if (iter != m_changes.addedCoins.end())
+            return &iter->second.coin;
+        // cache a clean copy of the base coin (or a null coin), peekCoin leaves the base view untouched
+        CoinEntry& entry = m_changes.addedCoins[out];
+        if (!m_base->peekCoin(out, entry.coin))
+            entry.coin = Coin();
+        return &entry.coin;
+    }
+    virtual bool peekCoin(const TransactionOutPoint& out, Coin& coin)
+    {
+        if (m_changes.removedCoins.find(out) != m_changes.removedCoins.end())
+            return false;
+        auto iter = m_changes.addedCoins.find(out);
+        if (iter == m_changes.addedCoins.end())
+            return m_base->peekCoin(out, coin);
+        if (iter->second.coin.output.value <= 0)
+            return false;
+        coin = iter->second.coin;
+        return true;
+    }
+    virtual const Coin* findCoin(const TransactionOutPoint& out) const
+    {
+        if (m_changes.removedCoins.find(out) != m_changes.removedCoins.end())
+            return nullptr;
+        auto iter = m_changes.addedCoins.find(out);
+        if (iter == m_changes.addedCoins.end())
+            return nullptr;
+        return &iter->second.coin;
+    }
+    virtual void fetchInputs(const Block* block)
+    {
+        for (const auto& tx : block->transactions)
+        {
+            if (tx.isCoinBase())
+                continue;
+            for (const auto& input : tx.inputs)
+            {
+                fetchCoin(input.previousOutput);
+            }
+        }
+    }
+    virtual bool connectBlock(const Block* block, int height)
+    {
+        size_t outputCount = 0;
+        for (const auto& tx : block->transactions)
+        {
+            outputCount += tx.outputs.size();
+        }
+        // reserve once for the whole block so that adding coins never rehashes midway
+        m_changes.addedCoins.reserve(m_changes.addedCoins.size() + outputCount);
+        for (const auto& tx : block->transactions)
+        {
+            if (!connectTransaction(tx, height))
+                return false;
+        }
+        return true;
+    }
+    virtual void applyChanges(CoinsData& changes)
+    {
+        for (const auto& out : changes.removedCoins)
+        {
+            removeCoin(out);
+        }
+        for (auto& item : changes.addedCoins)
+        {
+            if (!item.second.dirty)
+                continue;
+            m_changes.removedCoins.erase(item.first);
+            m_changes.addedCoins[item.first] = std::move(item.second);
+        }
+        if (!changes.bestBlockHash.is_null())
+        {
+            setBestBlockHash(changes.bestBlockHash, changes.bestBlockHeight);
+        }
+    }
+    virtual void commit()
+    {
+        m_base->applyChanges(m_changes);
+        discard();
+    }
+    virtual void discard()
+    {
+        CoinsData empty;
+        empty.bestBlockHash = m_base->getBestBlockHash();
+        empty.bestBlockHeight = m_base->getBestBlockHeight();
+        std::swap(m_changes, empty);
+    }
+private:
+    bool connectTransaction(const Transaction& tx, int height)
+    {
+        XUL_DEBUG("connectTransaction " << tx.getHash() << " " << xul::make_tuple(tx.inputs.size(), tx.outputs.size(), tx.isCoinBase()));
+        const bool isCoinBase = tx.isCoinBase();
+        int64_t inputval = 0;
+        if (!isCoinBase)
+        {
+            for (const auto& input : tx.inputs)
+            {
+                Coin* coin = fetchCoin(input.previousOutput);
+                if (!coin || coin->output.value <= 0)
+                {
+                    XUL_WARN("connectTransaction missing coin " << tx.getHash() << " " << input.previousOutput.hash << " " << input.previousOutput.index);
+                    assert(false);
+                    return false;
+                }
+                inputval += coin->output.value;
+                removeCoin(input.previousOutput);
+            }
+        }
+        int64_t outputval = 0;
+        for (uint32_t i = 0; i < tx.outputs.size(); ++i)
+        {
+            const TransactionOutput& output = tx.outputs[i];
+            outputval += output.value;
+            addCoin(TransactionOutPoint(tx.getHash(), i), output, height, isCoinBase);
+        }
+        if (!isCoinBase && inputval < outputval)
+        {
+            XUL_WARN("connectTransaction overspending " << tx.getHash() << " " << xul::make_tuple(inputval, outputval));
+            assert(false);
+            return false;
+        }
+        return true;
+    }
+    void addCoin(TransactionOutPoint&& out, const TransactionOutput& output, int height, bool isCoinBase)
+    {
+        assert(height <= m_changes.bestBlockHeight);
+        m_changes.removedCoins.erase(out);
+        // the entry may already exist as a null placeholder left by fetchCoin,
+        // so fill it in place: the script is copied exactly once, straight into the map
+        CoinEntry& entry = m_changes.addedCoins[std::move(out)];
+        entry.coin.output = output;
+        entry.coin.height = height;
+        entry.coin.isCoinBase = isCoinBase;
+        entry.dirty = true;
+    }
+    void removeCoin(const TransactionOutPoint& out)
+    {
+        m_changes.addedCoins.erase(out);
+        m_changes.removedCoins.insert(out);
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    boost::intrusive_ptr<CoinView> m_base;
+    CoinsData m_changes;
+};
+
+
 CoinView* createCoinView(const AppConfig* config)
 {
     return new CoinViewImpl(config);
 }
 
+CoinViewOverlay* createCoinViewOverlay(CoinView* base)
+{
+    return new CoinViewOverlayImpl(base);
+}
+
 
 }
@@ -16,6 +16,7 @@ class BlockChain;
 class Transaction;
 class TransactionOutPoint;
 class Coin;
+class CoinsData;
 
 class CoinView : public xul::object
 {
@@ -25,11 +26,29 @@ public:
     virtual const uint256& getBestBlockHash() const = 0;
     virtual int getBestBlockHeight() const = 0;
     virtual void setBestBlockHash(const uint256& hash, int height) = 0;
-    virtual void transfer(const Transaction* tx, int height) = 0;
+    virtual bool connectBlock(const Block* block, int height) = 0;
     virtual bool hasCoin(const TransactionOutPoint& out) = 0;
     virtual Coin* fetchCoin(const TransactionOutPoint& out) = 0;
+    // read-only lookup that copies the coin out, unlike fetchCoin a miss leaves no entry behind in the view
+    virtual bool peekCoin(const TransactionOutPoint& out, Coin& coin) = 0;
+    virtual void applyChanges(CoinsData& changes) = 0;
+};
+
+// scratch view stacked on another CoinView: it collects the changes of one block,
+// which are either committed to the base view in one batch or simply thrown away
+class CoinViewOverlay : public CoinView
+{
+public:
+    virtual CoinView* getBase() = 0;
+    // pull the coins spent by the block from the base view, after that findCoin never touches the base
+    virtual void fetchInputs(const Block* block) = 0;
+    // read-only lookup, safe to be called from several threads while nobody modifies the overlay
+    virtual const Coin* findCoin(const TransactionOutPoint& out) const = 0;
+    virtual void commit() = 0;
+    virtual void discard() = 0;
 };
 
 CoinView* createCoinView(const AppConfig* config);
+CoinViewOverlay* createCoinViewOverlay(CoinView* base);
 
 }
@@ -0,0 +1,230 @@
+#include "TxIndex.hpp"
+#include "ObjectDB.hpp"
+#include "BlockChain.hpp"
+#include "AppInfo.hpp"
+#include "AppConfig.hpp"
+#include "db.hpp"
+#include "data/Block.hpp"
+#include "util/serialization.hpp"
+
+#include <leveldb/options.h>
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/net/io_services.hpp>
+#include <xul/log/log.hpp>
+#include <xul/os/paths.hpp>
+#include <xul/os/file_system.hpp>
+#include <xul/io/data_encoding.hpp>
+#include <xul/util/time_counter.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+
+namespace xbtc {
+
+
+extern leveldb::Options getDBOptions(size_t nCacheSize);
+
+// last block whose transactions are in the index
+class TxIndexLocator
+{
+public:
+    int height;
+    uint256 hash;
+
+    TxIndexLocator() : height(-1) {}
+};
+
+xul::data_input_stream& operator>>(xul::data_input_stream& is, TxIndexLocator& locator)
+{
+    return is >> locator.height >> locator.hash;
+}
+
+xul::data_output_stream& operator<<(xul::data_output_stream& os, const TxIndexLocator& locator)
+{
+    return os << locator.height << locator.hash;
+}
+
+class TxIndexImpl : public xul::object_impl<TxIndex>
+{
+public:
+    explicit TxIndexImpl(AppInfo* appInfo, BlockStorage* storage)
+        : m_appInfo(appInfo), m_storage(storage), m_dataEncoding(xul::data_encoding::little_endian()), m_backfilling(false)
+    {
+        XUL_LOGGER_INIT("TxIndex");
+        XUL_REL_EVENT("new");
+        m_db = std::make_shared<ObjectDB>(getDBOptions(m_appInfo->getAppConfig()->dbCache / 8), false);
+    }
+    ~TxIndexImpl()
+    {
+        XUL_REL_EVENT("delete");
+    }
+
+    virtual bool open()
+    {
+        std::string dbdir = xul::paths::join(m_appInfo->getAppConfig()->dataDir, "indexes/txindex");
+        if (!xul::file_system::ensure_directory_exists(dbdir.c_str()))
+        {
+            XUL_REL_ERROR("failed to open db dir: " << dbdir);
+            return false;
+        }
+        if (!m_db->open(dbdir.c_str()))
+        {
+            XUL_REL_ERROR("failed to open db " << dbdir);
+            return false;
+        }
+        m_db->read(DB_BEST_BLOCK, m_locator);
+        XUL_REL_EVENT("open " << dbdir << " " << m_locator.height << " " << m_locator.hash);
+        return true;
+    }
+    virtual void addBlock(const Block* block, const BlockIndex* blockIndex, const TransactionOffsetList& txOffsets)
+    {
+        if (m_backfilling || blockIndex->height != m_locator.height + 1)
+            return;
+        ObjectDBWriteBatch batch = m_db->createWriteBatch();
+        writeBlock(batch, block, blockIndex, txOffsets);
+        if (!batch.execute(false))
+        {
+            XUL_WARN("addBlock failed " << blockIndex->height);
+            return;
+        }
+        setLocator(blockIndex);
+    }
+    virtual void startBackfill(BlockChain* chain)
+    {
+        m_chain = chain;
+        BlockIndex* indexed = m_locator.height >= 0 ? m_chain->getBlock(m_locator.height) : nullptr;
+        if (m_locator.height >= 0 && (!indexed || indexed->getHash() != m_locator.hash))
+        {
+            // the indexed blocks left the chain, index it again from the start
+            XUL_REL_WARN("startBackfill stale index " << m_locator.height << " " << m_locator.hash);
+            m_locator = TxIndexLocator();
+        }
+        if (m_locator.height >= m_chain->getHeight())
+            return;
+        XUL_REL_EVENT("startBackfill " << xul::make_tuple(m_locator.height, m_chain->getHeight()));
+        m_backfilling = true;
+        m_backfillTime.sync();
+        xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&TxIndexImpl::backfill, TxIndexPtr(this)));
+    }
+    virtual bool findTransaction(const uint256& txid, TxIndexPosition& pos)
+    {
+        return m_db->read(m_dataEncoding.encode(DB_TXINDEX, txid), pos);
+    }
+    virtual bool readTransaction(const uint256& txid, Transaction& tx)
+    {
+        TxIndexPosition pos;
+        if (!findTransaction(txid, pos))
+            return false;
+        if (!m_storage->readTransaction(pos.fileIndex, pos.dataPosition, pos.txOffset, tx))
+            return false;
+        if (tx.getHash() != txid)
+        {
+            // a stale or damaged entry points at another transaction
+            XUL_REL_ERROR("readTransaction mismatch " << txid << " " << tx.getHash() << " " << xul::make_tuple(pos.fileIndex, pos.dataPosition, pos.txOffset));
+            return false;
+        }
+        return true;
+    }
+private:
+    typedef boost::intrusive_ptr<TxIndexImpl> TxIndexPtr;
+
+    void writeBlock(ObjectDBWriteBatch& batch, const Block* block, const BlockIndex* blockIndex, const TransactionOffsetList& txOffsets)
+    {
+        assert(txOffsets.size() == block->transactions.size());
+        TxIndexPosition pos;
+        pos.fileIndex = blockIndex->fileIndex;
+        pos.dataPosition = blockIndex->dataPosition;
+        for (size_t i = 0; i < block->transactions.size(); ++i)
+        {
+            pos.txOffset = txOffsets[i];
+            batch.write(m_dataEncoding.encode(DB_TXINDEX, block->transactions[i].getHash()), pos);
+        }
+        TxIndexLocator locator;
+        locator.height = blockIndex->height;
+        locator.hash = blockIndex->getHash();
+        batch.write(DB_BEST_BLOCK, locator);
+    }
+    void setLocator(const BlockIndex* blockIndex)
+    {
+        m_locator.height = blockIndex->height;
+        m_locator.hash = blockIndex->getHash();
+    }
+    // runs on the disk io service between block writes, so blocks connected meanwhile are picked up by the next slice
+    void backfill()
+    {
+        int tipHeight = m_chain->getHeight();
+        int endHeight = std::min(m_locator.height + TXINDEX_BACKFILL_BATCH_SIZE, tipHeight);
+        ObjectDBWriteBatch batch = m_db->createWriteBatch();
+        TransactionOffsetList txOffsets;
+        const BlockIndex* lastIndexed = nullptr;
+        for (int height = m_locator.height + 1; height <= endHeight; ++height)
+        {
+            BlockIndex* blockIndex = m_chain->getBlock(height);
+            assert(blockIndex);
+            BlockPtr block = m_storage->readBlock(blockIndex, txOffsets);
+            if (!block)
+            {
+                // pruned blocks can not be indexed, move past them
+                XUL_DEBUG("backfill no block data " << height);
+                lastIndexed = blockIndex;
+                continue;
+            }
+            writeBlock(batch, block.get(), blockIndex, txOffsets);
+            lastIndexed = blockIndex;
+        }
+        if (lastIndexed)
+        {
+            TxIndexLocator locator;
+            locator.height = lastIndexed->height;
+            locator.hash = lastIndexed->getHash();
+            batch.write(DB_BEST_BLOCK, locator);
+            if (!batch.execute(false))
+            {
+                XUL_WARN("backfill failed " << xul::make_tuple(m_locator.height, endHeight));
+                m_backfilling = false;
+                return;
+            }
+            setLocator(lastIndexed);
+        }
+        if (m_locator.height < m_chain->getHeight())
+        {
+            xul::io_services::post(m_appInfo->getDiskIOService(), std::bind(&TxIndexImpl::backfill, TxIndexPtr(this)));
+            return;
+        }
+        m_backfilling = false;
+        XUL_REL_EVENT("backfill done " << xul::make_tuple(m_locator.height, m_backfillTime.elapsed()));
+    }
+private:
+    XUL_LOGGER_DEFINE();
+    boost::intrusive_ptr<AppInfo> m_appInfo;
+    boost::intrusive_ptr<BlockStorage> m_storage;
+    boost::intrusive_ptr<BlockChain> m_chain;
+    std::shared_ptr<ObjectDB> m_db;
+    xul::data_encoding m_dataEncoding;
+    TxIndexLocator m_locator;
+    std::atomic<bool> m_backfilling;
+    xul::time_counter m_backfillTime;
+};
+
+
+TxIndex* createTxIndex(AppInfo* appInfo, BlockStorage* storage)
+{
+    return new TxIndexImpl(appInfo, storage);
+}
+
+xul::data_input_stream& operator>>(xul::data_input_stream& is, TxIndexPosition& pos)
+{
+    return is >> makeVarReader(pos.fileIndex) >> makeVarReader(pos.dataPosition) >> makeVarReader(pos.txOffset);
+}
+
+xul::data_output_stream& operator<<(xul::data_output_stream& os, const TxIndexPosition& pos)
+{
+    return os << makeVarWriter(pos.fileIndex) << makeVarWriter(pos.dataPosition) << makeVarWriter(pos.txOffset);
+}
+
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "BlockStorage.hpp"
+#include "util/number.hpp"
+#include <xul/lang/object.hpp>
+
+
+namespace xbtc {
+
+
+class Block;
+class BlockIndex;
+class BlockChain;
+class Transaction;
+class AppInfo;
+
+class TxIndexPosition
+{
+public:
+    int fileIndex;
+    uint32_t dataPosition;
+    uint32_t txOffset;
+
+    TxIndexPosition() : fileIndex(0), dataPosition(0), txOffset(0) {}
+};
+
+// txid -> location of the transaction in the block files
+class TxIndex : public xul::object
+{
+public:
+    virtual bool open() = 0;
+    // called on the disk io service for each connected block, blocks the backfill has not reached yet are left to it
+    virtual void addBlock(const Block* block, const BlockIndex* blockIndex, const TransactionOffsetList& txOffsets) = 0;
+    // indexes the chain blocks connected before the index was enabled, a slice at a time on the disk io service
+    virtual void startBackfill(BlockChain* chain) = 0;
+    virtual bool findTransaction(const uint256& txid, TxIndexPosition& pos) = 0;
+    // reads just the one transaction from its block file, fails for pruned blocks
+    virtual bool readTransaction(const uint256& txid, Transaction& tx) = 0;
+};
+
+TxIndex* createTxIndex(AppInfo* appInfo, BlockStorage* storage);
+
+xul::data_input_stream& operator>>(xul::data_input_stream& is, TxIndexPosition& pos);
+xul::data_output_stream& operator<<(xul::data_output_stream& os, const TxIndexPosition& pos);
+
+}
@@ -4,11 +4,13 @@
 #include "script/Script.hpp"
 #include "data/Block.hpp"
 #include "data/Coin.hpp"
+#include "data/MerkleTree.hpp"
 #include "util/Key.hpp"
 #include "AppInfo.hpp"
 #include "AppConfig.hpp"
 #include "Consensus.hpp"
 #include "Compatibility.hpp"
+#include "db.hpp"
 
 #include <xul/lang/object_impl.hpp>
 #include <xul/log/log.hpp>
@@ -99,7 +101,7 @@ SignatureChecker* createSignatureChecker(const Transaction* tx, int idx)
 class ValidatorImpl : public xul::object_impl<Validator>
 {
 public:
-    explicit ValidatorImpl(CoinView* coinView, const AppConfig* config) : m_coinView(coinView), m_config(config)
+    explicit ValidatorImpl(const AppConfig* config) : m_config(config)
     {
         XUL_LOGGER_INIT("Validator");
         XUL_REL_EVENT("new");
@@ -124,16 +126,54 @@ public:
     {
         return true;
     }
-    virtual bool verifyTransactions(const Block* block, const BlockIndex* blockIndex)
+    virtual bool checkBlock(const Block* block, size_t size)
     {
-        if (!checkDuplicateTransaction(block, blockIndex))
+        if (!checkProofOfWork(block->header))
             return false;
-        if (!verifyTransactionInputs(block, blockIndex))
+        if (block->transactions.empty() || size > MAX_BLOCK_SERIALIZED_SIZE)
+        {
+            XUL_WARN("checkBlock invalid size " << xul::make_tuple(block->transactions.size(), size) << " " << block->getHash());
+            return false;
+        }
+        bool mutated = false;
+        uint256 merkleRoot = MerkleTree::build(block, &mutated);
+        if (merkleRoot != block->header.merkleRootHash)
+        {
+            XUL_WARN("checkBlock merkle root mismatch " << merkleRoot << " " << block->getHash());
+            return false;
+        }
+        // a repeated last transaction keeps the root, a block mutated that way must not poison the valid one
+        if (mutated)
+        {
+            XUL_WARN("checkBlock duplicate transaction " << block->getHash());
+            return false;
+        }
+        if (!block->transactions[0].isCoinBase())
+        {
+            XUL_WARN("checkBlock first transaction is not coinbase " << block->getHash());
+            return false;
+        }
+        for (size_t i = 1; i < block->transactions.size(); ++i)
+        {
+            if (block->transactions[i].isCoinBase())
+            {
+                XUL_WARN("checkBlock more than one coinbase " << i << " " << block->getHash());
+                return false;
+            }
+        }
+        return true;
+    }
+    virtual bool verifyTransactions(const Block* block, const BlockIndex* blockIndex, CoinViewOverlay* coinView)
+    {
+        if (!checkDuplicateTransaction(block, blockIndex, coinView))
+            return false;
+        coinView->fetchInputs(block);
+        if (!verifyTransactionInputs(block, blockIndex, coinView))
             return false;
         return true;
     }
 private:
-    bool checkDuplicateTransaction(const Block* block, const BlockIndex* blockIndex)
+    bool checkDuplicateTransaction(const Block* block, const BlockIndex* blockIndex, CoinView* coinView)
     {
         bool forbidDuplicateTransaction = Compatibility::forbidDuplicateTransaction(blockIndex);
         if (!forbidDuplicateTransaction)
@@ -144,7 +184,7 @@ private:
             {
                 XUL_DEBUG("checkDuplicateTransaction " << blockIndex->height << " " << tx.getHash()
                           << " " << xul::hex_encoding::upper_case().encode(tx.outputs[i].scriptPublicKey));
-                if (m_coinView->hasCoin(TransactionOutPoint(tx.getHash(), i)))
+                if (coinView->hasCoin(TransactionOutPoint(tx.getHash(), i)))
                 {
                     XUL_ERROR("checkDuplicateTransaction invalid transaction " << tx.getHash() << " " << xul::make_tuple(blockIndex->height, i));
                     assert(false);
@@ -154,7 +194,7 @@ private:
         }
         return true;
     }
-    bool verifyTransactionInput(const Block* block, const BlockIndex* blockIndex, int txindex, int index)
+    bool verifyTransactionInput(const Block* block, const BlockIndex* blockIndex, const CoinViewOverlay* coinView, int txindex, int index)
     {
         const Transaction& tx = block->transactions[txindex];
         if (tx.isCoinBase())
@@ -168,7 +208,7 @@ private:
                   << " " << txin.previousOutput.hash << " " << txin.previousOutput.index);
         TransactionSignatureChecker checker(&tx, index);
         ScriptVM vm(checker);
-        Coin* coin = m_coinView->fetchCoin(txin.previousOutput);
+        const Coin* coin = coinView->findCoin(txin.previousOutput);
         const TransactionOutput* txout = nullptr;
         if (coin && coin->output.value > 0)
         {
@@ -247,13 +287,13 @@ private:
         }
         return true;
     }
-    bool verifyTransactionInputs(const Block* block, const BlockIndex* blockIndex)
+    bool verifyTransactionInputs(const Block* block, const BlockIndex* blockIndex, const CoinViewOverlay* coinView)
     {
         for (int i = 0; i < block->transactions.size(); ++i)
         {
             for (int j = 0; j < block->transactions[i].inputs.size(); ++j)
             {
-                if (!verifyTransactionInput(block, blockIndex, i, j))
+                if (!verifyTransactionInput(block, blockIndex, coinView, i, j))
                     return false;
             }
         }
@@ -261,14 +301,13 @@ private:
     }
 private:
     XUL_LOGGER_DEFINE();
-    boost::intrusive_ptr<CoinView> m_coinView;
     boost::intrusive_ptr<const AppConfig> m_config;
 };
 
 
-Validator* createValidator(CoinView* coinView, const AppConfig* config)
+Validator* createValidator(const AppConfig* config)
 {
-    return new ValidatorImpl(coinView, config);
+    return new ValidatorImpl(config);
 }
 
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <xul/lang/object.hpp>
+#include <stddef.h>
 
 
 namespace xbtc {
@@ -11,7 +12,7 @@ class BlockHeader;
 class Block;
 class AppConfig;
 class Transaction;
-class CoinView;
+class CoinViewOverlay;
 
 class Validator : public xul::object
 {
@@ -19,9 +20,11 @@ public:
     virtual bool validateBlockHeader(const BlockHeader& header) = 0;
     virtual bool validateBlockIndex(const BlockIndex* block) = 0;
     virtual bool validateBlock(const Block* block, const BlockIndex* blockIndex) = 0;
-    virtual bool verifyTransactions(const Block* block, const BlockIndex* blockIndex) = 0;
+    // context free checks of a received block and its serialized size, safe on any thread
+    virtual bool checkBlock(const Block* block, size_t size) = 0;
+    virtual bool verifyTransactions(const Block* block, const BlockIndex* blockIndex, CoinViewOverlay* coinView) = 0;
 };
 
-Validator* createValidator(CoinView* coinView, const AppConfig* config);
+Validator* createValidator(const AppConfig* config);
 
 }
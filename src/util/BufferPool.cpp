@@ -0,0 +1,130 @@
+#include "BufferPool.hpp"
+
+#include <xul/lang/object_impl.hpp>
+#include <xul/log/log.hpp>
+
+#include <mutex>
+#include <vector>
+#include <assert.h>
+
+
+namespace xbtc {
+
+
+// size classes are 4 KiB, 8 KiB, ... 8 MiB, enough for the largest witness block
+const int MIN_BUFFER_CLASS_BITS = 12;
+const int MAX_BUFFER_CLASS_BITS = 23;
+const int BUFFER_CLASS_COUNT = MAX_BUFFER_CLASS_BITS - MIN_BUFFER_CLASS_BITS + 1;
+
+inline int getBufferClass(size_t size)
+{
+    int bits = MIN_BUFFER_CLASS_BITS;
+    while ((static_cast<size_t>(1) << bits) < size)
+        ++bits;
+    return bits - MIN_BUFFER_CLASS_BITS;
+}
+
+inline size_t getBufferClassSize(int cls)
+{
+    return static_cast<size_t>(1) << (cls + MIN_BUFFER_CLASS_BITS);
+}
+
+// shared with the deleters of outstanding buffers, so that it outlives the pool object itself
+class BufferPoolState
+{
+public:
+    std::mutex mutex;
+    std::vector<std::string*> freeBuffers[BUFFER_CLASS_COUNT];
+    size_t cachedBytes;
+    const size_t maxCachedBytes;
+
+    explicit BufferPoolState(size_t maxBytes) : cachedBytes(0), maxCachedBytes(maxBytes) {}
+    ~BufferPoolState()
+    {
+        for (auto& buffers : freeBuffers)
+        {
+            for (auto buf : buffers)
+                delete buf;
+        }
+    }
+    std::string* take(int cls)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string*>& buffers = freeBuffers[cls];
+        if (buffers.empty())
+            return nullptr;
+        std::string* buf = buffers.back();
+        buffers.pop_back();
+        cachedBytes -= getBufferClassSize(cls);
+        return buf;
+    }
+    void give(std::string* buf, int cls)
+    {
+        size_t size = getBufferClassSize(cls);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cachedBytes + size <= maxCachedBytes)
+            {
+                freeBuffers[cls].push_back(buf);
+                cachedBytes += size;
+                return;
+            }
+        }
+        delete buf;
+    }
+};
+
+class BufferPoolImpl : public xul::object_impl<BufferPool>
+{
+public:
+    explicit BufferPoolImpl(size_t maxCachedBytes) : m_state(std::make_shared<BufferPoolState>(maxCachedBytes))
+    {
+        XUL_LOGGER_INIT("BufferPool");
+        XUL_REL_EVENT("new " << maxCachedBytes);
+    }
+    ~BufferPoolImpl()
+    {
+        XUL_REL_EVENT("delete");
+    }
+
+    virtual PooledBuffer allocate(size_t minSize)
+    {
+        int cls = getBufferClass(minSize);
+        if (cls >= BUFFER_CLASS_COUNT)
+        {
+            XUL_WARN("allocate oversized buffer " << minSize);
+            return std::make_shared<std::string>(minSize, '\0');
+        }
+        size_t size = getBufferClassSize(cls);
+        std::string* buf = m_state->take(cls);
+        if (buf)
+        {
+            // only shrinks or restores the length, the storage is reused
+            buf->resize(size);
+        }
+        else
+        {
+            buf = new std::string(size, '\0');
+        }
+        std::shared_ptr<BufferPoolState> state = m_state;
+        return PooledBuffer(buf, [state, cls](std::string* s) { state->give(s, cls); });
+    }
+    virtual size_t getCachedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->cachedBytes;
+    }
+
+private:
+    XUL_LOGGER_DEFINE();
+    std::shared_ptr<BufferPoolState> m_state;
+};
+
+
+BufferPool* createBufferPool(size_t maxCachedBytes)
+{
+    return new BufferPoolImpl(maxCachedBytes);
+}
+
+
+}
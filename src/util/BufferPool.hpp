@@ -0,0 +1,25 @@
+#pragma once
+
+#include <xul/lang/object.hpp>
+#include <memory>
+#include <string>
+#include <stddef.h>
+
+
+namespace xbtc {
+
+
+typedef std::shared_ptr<std::string> PooledBuffer;
+
+// hands out reusable byte buffers in power-of-two size classes
+class BufferPool : public xul::object
+{
+public:
+    // the buffer comes sized to at least minSize, and goes back to the pool when its last reference is dropped
+    virtual PooledBuffer allocate(size_t minSize) = 0;
+    virtual size_t getCachedBytes() const = 0;
+};
+
+BufferPool* createBufferPool(size_t maxCachedBytes);
+
+}
@@ -0,0 +1,175 @@
+#include "Epoch.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <stdint.h>
+
+
+namespace xbtc {
+
+
+// enough for the net, disk, script and loader threads, any thread beyond them reads through the locked overflow
+const int MAX_EPOCH_READERS = 256;
+
+class EpochReaderSlot
+{
+public:
+    std::atomic<bool> used;
+    // the epoch the reader entered, 0 while it is outside any guard
+    std::atomic<uint64_t> epoch;
+};
+
+class RetiredEpochObject
+{
+public:
+    uint64_t epoch;
+    std::function<void ()> deleter;
+};
+
+static std::atomic<uint64_t> s_globalEpoch(1);
+static EpochReaderSlot s_readerSlots[MAX_EPOCH_READERS];
+static std::mutex s_retiredMutex;
+static std::vector<RetiredEpochObject> s_retiredObjects;
+// readers of threads that found every slot taken, slower but still correct
+static std::mutex s_overflowMutex;
+static std::multiset<uint64_t> s_overflowEpochs;
+
+// claims a reader slot for the calling thread on first use and gives it back when the thread ends
+class EpochThreadState
+{
+public:
+    // -1 if every slot was taken, the thread then enters its guards through s_overflowEpochs
+    int slot;
+    int depth;
+    uint64_t overflowEpoch;
+
+    EpochThreadState() : slot(-1), depth(0), overflowEpoch(0)
+    {
+        for (int i = 0; i < MAX_EPOCH_READERS; ++i)
+        {
+            bool expected = false;
+            if (s_readerSlots[i].used.compare_exchange_strong(expected, true))
+            {
+                slot = i;
+                break;
+            }
+        }
+    }
+    ~EpochThreadState()
+    {
+        if (slot >= 0)
+        {
+            s_readerSlots[slot].epoch.store(0);
+            s_readerSlots[slot].used.store(false);
+        }
+    }
+};
+
+static EpochThreadState& getEpochThreadState()
+{
+    static thread_local EpochThreadState state;
+    return state;
+}
+
+EpochGuard::EpochGuard()
+{
+    EpochThreadState& state = getEpochThreadState();
+    // nested guards keep the epoch of the outermost one
+    if (state.depth++ == 0)
+    {
+        if (state.slot < 0)
+        {
+            // the writer scans under the same lock, so it either sees this reader or this reader sees the new object
+            std::lock_guard<std::mutex> lock(s_overflowMutex);
+            state.overflowEpoch = s_globalEpoch.load();
+            s_overflowEpochs.insert(state.overflowEpoch);
+            return;
+        }
+        // sequentially consistent, so the writer either sees this reader or this reader sees the new object
+        s_readerSlots[state.slot].epoch.store(s_globalEpoch.load());
+    }
+}
+
+EpochGuard::~EpochGuard()
+{
+    EpochThreadState& state = getEpochThreadState();
+    if (--state.depth == 0)
+    {
+        if (state.slot < 0)
+        {
+            std::lock_guard<std::mutex> lock(s_overflowMutex);
+            s_overflowEpochs.erase(s_overflowEpochs.find(state.overflowEpoch));
+            return;
+        }
+        s_readerSlots[state.slot].epoch.store(0, std::memory_order_release);
+    }
+}
+
+static uint64_t getOldestReaderEpoch()
+{
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < MAX_EPOCH_READERS; ++i)
+    {
+        uint64_t epoch = s_readerSlots[i].epoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    std::lock_guard<std::mutex> lock(s_overflowMutex);
+    if (!s_overflowEpochs.empty() && *s_overflowEpochs.begin() < oldest)
+        oldest = *s_overflowEpochs.begin();
+    return oldest;
+}
+
+static void doReclaimEpochObjects(std::vector<std::function<void ()> >& deleters)
+{
+    uint64_t oldest = getOldestReaderEpoch();
+    size_t kept = 0;
+    for (size_t i = 0; i < s_retiredObjects.size(); ++i)
+    {
+        // a reader that entered after the object was retired cannot have loaded it
+        if (s_retiredObjects[i].epoch < oldest)
+        {
+            deleters.push_back(s_retiredObjects[i].deleter);
+            continue;
+        }
+        if (kept != i)
+            s_retiredObjects[kept] = s_retiredObjects[i];
+        ++kept;
+    }
+    s_retiredObjects.resize(kept);
+}
+
+void retireEpochObject(const std::function<void ()>& deleter)
+{
+    std::vector<std::function<void ()> > deleters;
+    {
+        std::lock_guard<std::mutex> lock(s_retiredMutex);
+        RetiredEpochObject item;
+        item.epoch = s_globalEpoch.fetch_add(1);
+        item.deleter = deleter;
+        s_retiredObjects.push_back(item);
+        doReclaimEpochObjects(deleters);
+    }
+    for (const auto& func : deleters)
+    {
+        func();
+    }
+}
+
+void reclaimEpochObjects()
+{
+    std::vector<std::function<void ()> > deleters;
+    {
+        std::lock_guard<std::mutex> lock(s_retiredMutex);
+        doReclaimEpochObjects(deleters);
+    }
+    for (const auto& func : deleters)
+    {
+        func();
+    }
+}
+
+
+}
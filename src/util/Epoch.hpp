@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+
+
+namespace xbtc {
+
+
+/**
+ * Epoch based reclamation for structures that are read without locks and replaced by a single writer.
+ * A reader holds an EpochGuard while it uses anything it loaded from such a structure, the writer publishes
+ * the replacement and hands the old object to retireEpochObject, which frees it once every reader that could
+ * still see it has left its guard. Entering and leaving a guard are two atomic stores, readers never wait.
+ */
+class EpochGuard
+{
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+private:
+    EpochGuard(const EpochGuard&);
+    EpochGuard& operator=(const EpochGuard&);
+};
+
+// to be called after the object was unlinked from everything new readers can reach
+void retireEpochObject(const std::function<void ()>& deleter);
+
+// frees what no reader can see anymore, retireEpochObject does this too
+void reclaimEpochObjects();
+
+}
@@ -0,0 +1,154 @@
+#include "Parallel.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace xbtc {
+
+
+// threads kept for the whole process, so a headers message or a load does not start threads of its own
+class ParallelPool
+{
+public:
+    ParallelPool() : m_stopped(false)
+    {
+    }
+    ~ParallelPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+        }
+        m_taskCondition.notify_all();
+        for (auto& t : m_threads)
+        {
+            t.join();
+        }
+    }
+    // the calling thread works through the queue as well, so a slice that runs a parallel loop of its own never
+    // waits on a pool whose threads all wait in turn
+    void run(std::vector<std::function<void ()> >& funcs)
+    {
+        auto batch = std::make_shared<Batch>();
+        batch->pending = funcs.size();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            while (m_threads.size() + 1 < funcs.size())
+            {
+                m_threads.push_back(std::thread(&ParallelPool::runWorker, this));
+            }
+            for (auto& func : funcs)
+            {
+                m_tasks.push_back(Task(std::move(func), batch));
+            }
+        }
+        m_taskCondition.notify_all();
+        m_doneCondition.notify_all();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (batch->pending > 0)
+        {
+            if (m_tasks.empty())
+            {
+                m_doneCondition.wait(lock);
+                continue;
+            }
+            Task task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            lock.unlock();
+            runTask(task);
+            lock.lock();
+        }
+    }
+
+private:
+    class Batch
+    {
+    public:
+        size_t pending;
+    };
+    class Task
+    {
+    public:
+        std::function<void ()> func;
+        std::shared_ptr<Batch> batch;
+
+        Task(std::function<void ()>&& f, const std::shared_ptr<Batch>& b) : func(std::move(f)), batch(b) {}
+    };
+
+    void runWorker()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_taskCondition.wait(lock, [this] { return m_stopped || !m_tasks.empty(); });
+            if (m_stopped)
+                break;
+            Task task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            lock.unlock();
+            runTask(task);
+            lock.lock();
+        }
+    }
+    void runTask(Task& task)
+    {
+        task.func();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--task.batch->pending == 0)
+            m_doneCondition.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_taskCondition;
+    std::condition_variable m_doneCondition;
+    std::deque<Task> m_tasks;
+    std::vector<std::thread> m_threads;
+    bool m_stopped;
+};
+
+static ParallelPool& getParallelPool()
+{
+    static ParallelPool pool;
+    return pool;
+}
+
+int getParallelThreadCount(int maxThreads)
+{
+    int count = std::thread::hardware_concurrency();
+    if (count < 1)
+        count = 1;
+    return count < maxThreads ? count : maxThreads;
+}
+
+void runParallel(size_t count, int maxThreads, const std::function<void (size_t begin, size_t end, int slice)>& func)
+{
+    int threadCount = getParallelThreadCount(maxThreads);
+    if (count < static_cast<size_t>(threadCount))
+        threadCount = count > 0 ? static_cast<int>(count) : 1;
+    if (threadCount == 1)
+    {
+        func(0, count, 0);
+        return;
+    }
+    size_t sliceSize = (count + threadCount - 1) / threadCount;
+    std::vector<std::function<void ()> > slices;
+    slices.reserve(threadCount);
+    for (int i = 0; i < threadCount; ++i)
+    {
+        size_t begin = sliceSize * i;
+        if (begin >= count)
+            break;
+        size_t end = begin + sliceSize < count ? begin + sliceSize : count;
+        slices.push_back([&func, begin, end, i]() { func(begin, end, i); });
+    }
+    getParallelPool().run(slices);
+}
+
+
+}
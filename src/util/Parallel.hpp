@@ -0,0 +1,16 @@
+#pragma once
+
+#include <functional>
+#include <stddef.h>
+
+
+namespace xbtc {
+
+
+// splits [0, count) into one contiguous slice per thread and waits for all of them,
+// func gets the slice bounds and the slice number, the slices run on threads shared by the whole process
+void runParallel(size_t count, int maxThreads, const std::function<void (size_t begin, size_t end, int slice)>& func);
+
+int getParallelThreadCount(int maxThreads);
+
+}